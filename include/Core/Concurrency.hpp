@@ -1,6 +1,10 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <mutex>
+#include <type_traits>
+#include <vector>
 
 #include "Core/Core.hpp"
 
@@ -14,59 +18,365 @@ enum class ThreadType : int8
 extern thread_local ThreadType threadType;
 inline bool isInMainThread() { return threadType == ThreadType::Main; }
 
-// Multiple producers, single consumer queue with fixed size.
-template<typename ItemType, uint64 queueSize>
-class MPSCStaticQueue
+struct CpuTopology
 {
+  struct LogicalProcessor
+  {
+    int32 id;               // Windows: processor group * 64 + number within the group. Linux: cpu number.
+    int32 coreIndex;        // SMT siblings share the same physical core index.
+    int32 cacheDomainIndex; // Logical processors sharing the last level cache share the same cache domain index.
+  };
+  std::vector<LogicalProcessor> logicalProcessors; // Sorted by cache domain, then by core.
+  int32 coreCount = 0;
+  int32 cacheDomainCount = 0;
+};
+// Only logical processors the process is allowed to run on are reported.
+bool tryDetectCpuTopology(CpuTopology& outTopology);
+void logCpuTopology(const CpuTopology& topology);
+// Id of the logical processor the calling thread runs on right now.
+int32 getCurrentLogicalProcessorId();
+// On Windows all logical processors have to be in the same processor group.
+bool trySetCurrentThreadAffinity(const int32* logicalProcessorIds, int64 logicalProcessorCount);
+// Lets the calling thread run on any logical processor available to the process.
+void resetCurrentThreadAffinity();
+
+// Chase-Lev work stealing deque with fixed capacity.
+// Owner thread pushes and pops at the bottom (LIFO), other threads steal from the top (FIFO).
+// ItemType has to be trivially copyable, usually a pointer.
+template<typename ItemType, int64 capacity>
+class WorkStealingQueue
+{
+  static_assert(capacity > 0 && (capacity & (capacity - 1)) == 0, "capacity must be a power of two");
+  static_assert(std::is_trivially_copyable_v<ItemType>, "ItemType must be trivially copyable");
+
+public:
+
+  WorkStealingQueue() = default;
+  WorkStealingQueue(const WorkStealingQueue& other) = delete;
+  WorkStealingQueue(WorkStealingQueue&& other) = delete;
+  ~WorkStealingQueue() = default;
+
+  // Owner thread only. Returns false if the queue is full.
+  bool tryPush(ItemType item)
+  {
+    const int64 currentBottom = bottom.load(std::memory_order_relaxed);
+    const int64 currentTop = top.load(std::memory_order_acquire);
+    if (currentBottom - currentTop >= capacity)
+    {
+      return false;
+    }
+
+    items[currentBottom & indexMask].store(item, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom.store(currentBottom + 1, std::memory_order_relaxed);
+
+    return true;
+  }
+
+  // Owner thread only.
+  bool tryPop(ItemType& outItem)
+  {
+    const int64 newBottom = bottom.load(std::memory_order_relaxed) - 1;
+    bottom.store(newBottom, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64 currentTop = top.load(std::memory_order_relaxed);
+
+    if (currentTop > newBottom)
+    {
+      bottom.store(newBottom + 1, std::memory_order_relaxed);
+      return false;
+    }
+
+    outItem = items[newBottom & indexMask].load(std::memory_order_relaxed);
+    if (currentTop == newBottom)
+    {
+      // Last item, stealers might be racing us for it.
+      const bool won = top.compare_exchange_strong(currentTop, currentTop + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+      bottom.store(newBottom + 1, std::memory_order_relaxed);
+      return won;
+    }
+
+    return true;
+  }
+
+  // Any thread. Can fail spuriously when racing with other stealers.
+  bool trySteal(ItemType& outItem)
+  {
+    int64 currentTop = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const int64 currentBottom = bottom.load(std::memory_order_acquire);
+    if (currentTop >= currentBottom)
+    {
+      return false;
+    }
+
+    ItemType item = items[currentTop & indexMask].load(std::memory_order_relaxed);
+    if (!top.compare_exchange_strong(currentTop, currentTop + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+    {
+      return false;
+    }
+
+    outItem = item;
+    return true;
+  }
+
+  // Approximate when called from other threads than the owner.
+  int64 getSize() const
+  {
+    return std::max(bottom.load(std::memory_order_relaxed) - top.load(std::memory_order_relaxed), int64(0));
+  }
+  bool isEmpty() const
+  {
+    return bottom.load(std::memory_order_relaxed) <= top.load(std::memory_order_relaxed);
+  }
+
+private:
+
+  static constexpr int64 indexMask = capacity - 1;
+
+  std::atomic<ItemType> items[capacity];
+
+  // Keep those shared variables on separate cache lines to avoid false sharing.
+  alignas(CACHE_LINE_SIZE) std::atomic<int64> top = 0;
+  alignas(CACHE_LINE_SIZE) std::atomic<int64> bottom = 0;
+};
+
+// Multiple producers, multiple consumers queue without a size limit.
+// Grows by fixed size segments, so items are never moved or dropped. One emptied segment is kept for reuse.
+template<typename ItemType, int64 segmentSize>
+class SegmentedQueue
+{
+  static_assert(segmentSize > 0, "segmentSize must be greater than zero");
+
 public:
 
-  MPSCStaticQueue() = default;
-  MPSCStaticQueue(const MPSCStaticQueue& other) = delete;
-  MPSCStaticQueue(MPSCStaticQueue&& other) = delete;
-  ~MPSCStaticQueue() = default;
+  SegmentedQueue() = default;
+  SegmentedQueue(const SegmentedQueue& other) = delete;
+  SegmentedQueue(SegmentedQueue&& other) = delete;
+  ~SegmentedQueue()
+  {
+    while (headSegment)
+    {
+      Segment* next = headSegment->next;
+      delete headSegment;
+      headSegment = next;
+    }
+    delete spareSegment;
+  }
 
   void enqueue(ItemType&& item)
   {
-    TRACE_SCOPE();
+    std::lock_guard<std::mutex> lock{ mutex };
+
+    if (!tailSegment || tailSegment->indexToWrite == segmentSize)
     {
-      std::lock_guard<std::mutex> lock{ producerMutex };
+      Segment* newSegment = spareSegment ? spareSegment : new Segment();
+      spareSegment = nullptr;
+      newSegment->indexToRead = 0;
+      newSegment->indexToWrite = 0;
+      newSegment->next = nullptr;
 
-      const int64 nextIndexToWrite = (indexToWrite + 1) % queueSize;
-      while (nextIndexToWrite == cachedIndexToRead)
+      if (tailSegment)
+      {
+        tailSegment->next = newSegment;
+      }
+      else
       {
-        cachedIndexToRead = indexToRead;
+        headSegment = newSegment;
       }
-      items[indexToWrite] = std::move(item);
-      indexToWrite = nextIndexToWrite;
+      tailSegment = newSegment;
     }
+
+    tailSegment->items[tailSegment->indexToWrite++] = std::move(item);
+    size.store(size.load(std::memory_order_relaxed) + 1, std::memory_order_release);
   }
 
-  bool tryDequeue(ItemType& outItem)
+  void enqueue(ItemType* items, int64 itemCount)
   {
-    if (indexToRead == cachedIndexToWrite)
+    std::lock_guard<std::mutex> lock{ mutex };
+
+    for (int64 itemIndex = 0; itemIndex < itemCount;)
     {
-      cachedIndexToWrite = indexToWrite;
-      if (indexToRead == cachedIndexToWrite)
+      if (!tailSegment || tailSegment->indexToWrite == segmentSize)
       {
-        return false;
+        Segment* newSegment = spareSegment ? spareSegment : new Segment();
+        spareSegment = nullptr;
+        newSegment->indexToRead = 0;
+        newSegment->indexToWrite = 0;
+        newSegment->next = nullptr;
+
+        if (tailSegment)
+        {
+          tailSegment->next = newSegment;
+        }
+        else
+        {
+          headSegment = newSegment;
+        }
+        tailSegment = newSegment;
       }
+
+      const int64 copyCount = std::min(itemCount - itemIndex, segmentSize - tailSegment->indexToWrite);
+      std::move(items + itemIndex, items + itemIndex + copyCount, tailSegment->items + tailSegment->indexToWrite);
+      tailSegment->indexToWrite += copyCount;
+      itemIndex += copyCount;
+    }
+
+    size.store(size.load(std::memory_order_relaxed) + itemCount, std::memory_order_release);
+  }
+
+  bool tryDequeue(ItemType& outItem)
+  {
+    // Avoid taking the lock when there is obviously nothing to dequeue.
+    if (size.load(std::memory_order_acquire) == 0)
+    {
+      return false;
     }
 
-    outItem = std::move(items[indexToRead]);
-    indexToRead++;
+    std::lock_guard<std::mutex> lock{ mutex };
+
+    if (!headSegment || headSegment->indexToRead == headSegment->indexToWrite)
+    {
+      return false;
+    }
+
+    outItem = std::move(headSegment->items[headSegment->indexToRead++]);
+    size.store(size.load(std::memory_order_relaxed) - 1, std::memory_order_release);
+
+    if (headSegment->indexToRead == segmentSize)
+    {
+      Segment* emptySegment = headSegment;
+      headSegment = headSegment->next;
+      if (!headSegment)
+      {
+        tailSegment = nullptr;
+      }
+
+      if (spareSegment)
+      {
+        delete emptySegment;
+      }
+      else
+      {
+        spareSegment = emptySegment;
+      }
+    }
 
     return true;
   }
 
+  int64 getSize() const { return size.load(std::memory_order_relaxed); }
+
 private:
 
-  ItemType items[queueSize];
+  struct Segment
+  {
+    ItemType items[segmentSize];
+    int64 indexToRead = 0;
+    int64 indexToWrite = 0;
+    Segment* next = nullptr;
+  };
+
+  Segment* headSegment = nullptr;
+  Segment* tailSegment = nullptr;
+  Segment* spareSegment = nullptr;
+  std::mutex mutex;
+
+  alignas(CACHE_LINE_SIZE) std::atomic<int64> size = 0; // Keep on separate cache line to avoid false sharing.
+};
+
+// Multiple producers, single consumer queue. Producers claim slots of a fixed size ring with tickets and publish them
+// through per slot sequence numbers, without locks. When the ring is full, items spill over to a growable locked queue
+// instead of waiting for the consumer. Items of one producer are dequeued in the order they were enqueued.
+template<typename ItemType, int64 ringCapacity>
+class MPSCQueue
+{
+  static_assert(ringCapacity > 0 && (ringCapacity & (ringCapacity - 1)) == 0, "ringCapacity must be a power of two");
+
+public:
+
+  MPSCQueue()
+  {
+    for (int64 slotIndex = 0; slotIndex < ringCapacity; ++slotIndex)
+    {
+      slots[slotIndex].sequence.store(slotIndex, std::memory_order_relaxed);
+    }
+  }
+  MPSCQueue(const MPSCQueue& other) = delete;
+  MPSCQueue(MPSCQueue&& other) = delete;
+  ~MPSCQueue() = default;
+
+  void enqueue(ItemType&& item)
+  {
+    TRACE_SCOPE();
+
+    // Once something spilled, keep spilling until the consumer catches up so that the producer order is kept.
+    if (spilledQueue.getSize() == 0)
+    {
+      int64 ticket = nextTicket.load(std::memory_order_relaxed);
+      while (true)
+      {
+        Slot& slot = slots[ticket & (ringCapacity - 1)];
+        const int64 sequence = slot.sequence.load(std::memory_order_acquire);
+        if (sequence == ticket)
+        {
+          if (nextTicket.compare_exchange_weak(ticket, ticket + 1, std::memory_order_relaxed))
+          {
+            slot.item = std::move(item);
+            slot.sequence.store(ticket + 1, std::memory_order_release);
+            return;
+          }
+        }
+        else if (sequence < ticket)
+        {
+          break; // The consumer didn't free the slot from the previous round yet, the ring is full.
+        }
+        else
+        {
+          ticket = nextTicket.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+    spilledCount.fetch_add(1, std::memory_order_relaxed);
+    spilledQueue.enqueue(std::move(item));
+  }
+
+  bool tryDequeue(ItemType& outItem)
+  {
+    Slot& slot = slots[indexToRead & (ringCapacity - 1)];
+    if (slot.sequence.load(std::memory_order_acquire) == indexToRead + 1)
+    {
+      outItem = std::move(slot.item);
+      slot.sequence.store(indexToRead + ringCapacity, std::memory_order_release);
+      ++indexToRead;
+      return true;
+    }
+
+    // Spilled items are newer than everything claimed in the ring, even if it isn't published yet.
+    if (nextTicket.load(std::memory_order_relaxed) != indexToRead)
+    {
+      return false;
+    }
+    return spilledQueue.tryDequeue(outItem);
+  }
+
+  // How many items didn't fit the ring since the queue was created.
+  int64 getSpilledCount() const { return spilledCount.load(std::memory_order_relaxed); }
+
+private:
+
+  struct Slot
+  {
+    std::atomic<int64> sequence; // Equal to the ticket when the slot is free for it, ticket + 1 once the item is published.
+    ItemType item;
+  };
+  Slot slots[ringCapacity];
 
-  alignas(CACHE_LINE_SIZE) volatile int64 indexToWrite = 0;
-  volatile int64 cachedIndexToRead = 0;
-  std::mutex producerMutex;
+  alignas(CACHE_LINE_SIZE) std::atomic<int64> nextTicket = 0;
 
-  alignas(CACHE_LINE_SIZE) volatile int64 indexToRead = 0;
-  int64 cachedIndexToWrite = 0;
+  alignas(CACHE_LINE_SIZE) int64 indexToRead = 0;
 
+  SegmentedQueue<ItemType, 64> spilledQueue;
+  std::atomic<int64> spilledCount = 0;
 };
\ No newline at end of file
@@ -0,0 +1,214 @@
+#pragma once
+
+#include <coroutine>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include "Core/Core.hpp"
+#include "Core/File.hpp"
+#include "Core/Task.hpp"
+
+// Coroutine frames are allocated from growable pools, only unusually big frames fall back to malloc.
+void* allocateCoroutineFrame(std::size_t size);
+void deallocateCoroutineFrame(void* frame, std::size_t size);
+
+// Resumes the coroutine on desiredThread through the task queues, after prerequisite is completed if there is one.
+void scheduleCoroutineResume(std::coroutine_handle<> coroutine, ThreadType desiredThread, TaskPriority priority, Ref<TaskEvent>* prerequisite);
+// Awaiting on a worker resumes on any worker, awaiting on the main thread resumes on the main thread.
+inline ThreadType getCoroutineResumeThread() { return isInMainThread() ? ThreadType::Main : ThreadType::Worker; }
+
+struct TaskEventAwaiter
+{
+  Ref<TaskEvent> event;
+
+  bool await_ready() const { return event->isComplete(); }
+  void await_suspend(std::coroutine_handle<> coroutine)
+  {
+    // The coroutine may be resumed and this awaiter destroyed before schedule returns, so pass a copy living on this stack.
+    Ref<TaskEvent> prerequisite = event;
+    scheduleCoroutineResume(coroutine, getCoroutineResumeThread(), TaskPriority::Normal, &prerequisite);
+  }
+  void await_resume() const {}
+};
+inline TaskEventAwaiter operator co_await(Ref<TaskEvent> event) { return { std::move(event) }; }
+
+struct ReadFileAsyncAwaiter
+{
+  Ref<ReadFileAsync> read;
+
+  bool await_ready() const { return read->taskEvent->isComplete(); }
+  void await_suspend(std::coroutine_handle<> coroutine)
+  {
+    Ref<TaskEvent> prerequisite = read->taskEvent;
+    scheduleCoroutineResume(coroutine, getCoroutineResumeThread(), TaskPriority::Normal, &prerequisite);
+  }
+  ReadFileAsync& await_resume() const { return *read.get(); }
+};
+inline ReadFileAsyncAwaiter operator co_await(Ref<ReadFileAsync> read) { return { std::move(read) }; }
+
+// co_await switchTo(ThreadType::Main) continues the coroutine in processMainThreadTasks(), ThreadType::Worker on a worker.
+struct SwitchToThreadAwaiter
+{
+  ThreadType desiredThread;
+  TaskPriority priority;
+
+  bool await_ready() const { return threadType == desiredThread; }
+  void await_suspend(std::coroutine_handle<> coroutine) const { scheduleCoroutineResume(coroutine, desiredThread, priority, nullptr); }
+  void await_resume() const {}
+};
+inline SwitchToThreadAwaiter switchTo(ThreadType desiredThread, TaskPriority priority = TaskPriority::Normal) { return { desiredThread, priority }; }
+
+template<typename ResultType>
+class Task;
+
+class CoroutinePromiseBase
+{
+public:
+
+  static void* operator new(std::size_t size) { return allocateCoroutineFrame(size); }
+  static void operator delete(void* frame, std::size_t size) { deallocateCoroutineFrame(frame, size); }
+
+  // Starts running right away in the calling thread.
+  std::suspend_never initial_suspend() const noexcept { return {}; }
+
+  struct FinalAwaiter
+  {
+    bool await_ready() const noexcept { return false; }
+    template<typename PromiseType>
+    void await_suspend(std::coroutine_handle<PromiseType> coroutine) const noexcept
+    {
+      CoroutinePromiseBase& promise = coroutine.promise();
+      promise.completionEvent->complete();
+      promise.release(coroutine);
+    }
+    void await_resume() const noexcept {}
+  };
+  FinalAwaiter final_suspend() const noexcept { return {}; }
+
+  void unhandled_exception() const { ensureNoEntry(); }
+
+  // The frame is destroyed when both the coroutine finished and its Task was destroyed.
+  void release(std::coroutine_handle<> coroutine)
+  {
+    if (--refCount == 0)
+    {
+      coroutine.destroy();
+    }
+  }
+
+  Ref<TaskEvent> completionEvent = TaskEvent::create();
+  std::atomic<int8> refCount = 2;
+};
+
+template<typename ResultType>
+class CoroutinePromise : public CoroutinePromiseBase
+{
+public:
+
+  Task<ResultType> get_return_object();
+
+  template<typename ValueType>
+  void return_value(ValueType&& value) { result.emplace(std::forward<ValueType>(value)); }
+
+  std::optional<ResultType> result;
+};
+template<>
+class CoroutinePromise<void> : public CoroutinePromiseBase
+{
+public:
+
+  Task<void> get_return_object();
+
+  void return_void() const {}
+};
+
+// Handle to a coroutine. The coroutine keeps running when the Task is destroyed.
+// Awaiting a Task resumes the awaiting coroutine once the awaited one finished.
+template<typename ResultType = void>
+class Task
+{
+public:
+
+  using promise_type = CoroutinePromise<ResultType>;
+
+  Task() = default;
+  Task(const Task& other) = delete;
+  Task(Task&& other) noexcept
+    : coroutine(std::exchange(other.coroutine, {}))
+  {
+  }
+  Task& operator=(const Task& rhs) = delete;
+  Task& operator=(Task&& rhs) noexcept
+  {
+    std::swap(coroutine, rhs.coroutine);
+    return *this;
+  }
+  ~Task()
+  {
+    if (coroutine)
+    {
+      coroutine.promise().release(coroutine);
+    }
+  }
+
+  bool isValid() const { return bool(coroutine); }
+  bool isComplete() const { return coroutine.promise().completionEvent->isComplete(); }
+  const Ref<TaskEvent>& getCompletionEvent() const { return coroutine.promise().completionEvent; }
+  std::add_lvalue_reference_t<ResultType> getResult() requires (!std::is_void_v<ResultType>)
+  {
+    assert(isComplete());
+    return *coroutine.promise().result;
+  }
+
+  template<bool moveResult>
+  struct Awaiter
+  {
+    std::coroutine_handle<promise_type> coroutine;
+
+    bool await_ready() const { return coroutine.promise().completionEvent->isComplete(); }
+    void await_suspend(std::coroutine_handle<> awaitingCoroutine) const
+    {
+      Ref<TaskEvent> prerequisite = coroutine.promise().completionEvent;
+      scheduleCoroutineResume(awaitingCoroutine, getCoroutineResumeThread(), TaskPriority::Normal, &prerequisite);
+    }
+    decltype(auto) await_resume() const
+    {
+      if constexpr (std::is_void_v<ResultType>)
+      {
+        return;
+      }
+      else if constexpr (moveResult)
+      {
+        return ResultType(std::move(*coroutine.promise().result));
+      }
+      else
+      {
+        return static_cast<ResultType&>(*coroutine.promise().result);
+      }
+    }
+  };
+  Awaiter<false> operator co_await() & { return { coroutine }; }
+  Awaiter<true> operator co_await() && { return { coroutine }; }
+
+private:
+
+  friend promise_type;
+
+  explicit Task(std::coroutine_handle<promise_type> inCoroutine)
+    : coroutine(inCoroutine)
+  {
+  }
+
+  std::coroutine_handle<promise_type> coroutine;
+};
+
+template<typename ResultType>
+Task<ResultType> CoroutinePromise<ResultType>::get_return_object()
+{
+  return Task<ResultType>(std::coroutine_handle<CoroutinePromise<ResultType>>::from_promise(*this));
+}
+inline Task<void> CoroutinePromise<void>::get_return_object()
+{
+  return Task<void>(std::coroutine_handle<CoroutinePromise<void>>::from_promise(*this));
+}
\ No newline at end of file
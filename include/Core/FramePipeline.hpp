@@ -0,0 +1,78 @@
+#pragma once
+
+#include <array>
+#include <functional>
+
+#include "Core/Core.hpp"
+#include "Core/Task.hpp"
+
+/**
+ * Frame pipelining. Each frame runs as simulate -> prepareRender -> submit, and up to framesInFlight frames run at once,
+ * so that frame N + 1 simulates while frame N prepares rendering and frame N - 1 is submitted.
+ * A stage never runs concurrently with the same stage of another frame, and frames pass each stage in order.
+ */
+
+constexpr int64 maxFramesInFlight = 4;
+
+struct FrameStages
+{
+  // Runs on a worker after the previous frame's simulate.
+  std::function<void(int64 frameIndex, float timeDelta)> simulate;
+  // Runs on a worker after this frame's simulate and the previous frame's prepareRender.
+  std::function<void(int64 frameIndex)> prepareRender;
+  // Runs on the main thread after this frame's prepareRender and the previous frame's submit.
+  std::function<void(int64 frameIndex)> submit;
+};
+
+class FramePipeline
+{
+public:
+
+  explicit FramePipeline(FrameStages inStages, int64 inFramesInFlight = 2);
+  FramePipeline(const FramePipeline& other) = delete;
+  FramePipeline(FramePipeline&& other) = delete;
+  ~FramePipeline();
+
+  // Schedules simulate and prepareRender of the next frame. Once framesInFlight frames are in flight, waits for the oldest one
+  // and submits it, so a frame is scheduled only after the frame framesInFlight before it was submitted. Call from the main thread.
+  void beginFrame(float timeDelta);
+  // Submits all frames in flight.
+  void flush();
+
+  int64 getFramesInFlight() const { return framesInFlight; }
+  // Index the next beginFrame call schedules.
+  int64 getNextFrameIndex() const { return nextFrameIndex; }
+  int64 getSubmittedFrameCount() const { return nextSubmitFrameIndex; }
+
+private:
+
+  void submitOldestFrame();
+
+  FrameStages stages;
+  int64 framesInFlight;
+  int64 nextFrameIndex = 0;
+  int64 nextSubmitFrameIndex = 0;
+  Ref<TaskEvent> lastSimulateEvent;
+  std::array<Ref<TaskEvent>, maxFramesInFlight> prepareRenderEvents;
+};
+
+// Storage for one item per frame in flight, for data a frame's stages hand over to each other while other frames run.
+// The slot of frame N is reused by frame N + slotCount, which FramePipeline schedules only after frame N was submitted
+// as long as slotCount is at least framesInFlight.
+template<typename ItemType, int64 slotCount = maxFramesInFlight>
+class FrameSlots
+{
+public:
+
+  ItemType& operator[](int64 frameIndex) { return slots[frameIndex % slotCount]; }
+  const ItemType& operator[](int64 frameIndex) const { return slots[frameIndex % slotCount]; }
+
+  static constexpr int64 getSlotCount() { return slotCount; }
+
+  ItemType* begin() { return slots.data(); }
+  ItemType* end() { return slots.data() + slotCount; }
+
+private:
+
+  std::array<ItemType, slotCount> slots{};
+};
@@ -18,6 +18,7 @@ DAR_ENUM_CLASS_BEGIN(PixelFormat, uint8)
   e(BC1) \
   e(int16)
 DAR_ENUM_CLASS_END(PixelFormat)
+#undef DAR_ENUM_LIST
 
 int8 toChannelCount(PixelFormat pixelFormat);
 int16 toPixelSizeInBits(PixelFormat pixelFormat);
@@ -54,7 +55,7 @@ struct Image
 
   int64 getDataSize() const;
 
-  byte* data = nullptr; // Feel free to steal this pointer. Free it by calling free() on it. Remember to set it to nullptr.
+  byte* data = nullptr; // Feel free to steal this pointer. Free it by calling freeMemory on it. Remember to set it to nullptr.
   int32 width = 0;
   int32 height = 0;
   PixelFormat pixelFormat = PixelFormat::Invalid;
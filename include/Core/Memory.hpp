@@ -1,6 +1,10 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
 
 #include "Core/Core.hpp"
 
@@ -10,48 +14,292 @@ void* alignedMalloc(std::size_t alignment, std::size_t size);
 void alignedFree(void* pointer);
 inline bool isAligned(void* ptr, size_t alignment) { return uintptr_t(ptr) % alignment == 0; }
 
+// Address space is reserved without being backed by memory, committed ranges become usable. Sizes and addresses
+// passed to commit and decommit have to be multiples of the page size.
+int64 getVirtualMemoryPageSize();
+void* reserveVirtualMemory(int64 size);
+bool tryCommitVirtualMemory(void* address, int64 size);
+void decommitVirtualMemory(void* address, int64 size);
+void releaseVirtualMemory(void* address, int64 size);
+
+// General purpose engine allocator. Small allocations come from size class bins cached per thread, large ones from a TLSF heap.
+// Neither needs a header for the alignment, small objects are naturally aligned inside their size class pages
+// and large blocks split off the gap in front of an aligned address as a free block.
+// Allocations are accounted under the subsystem tag they are made for, see getMemoryTagSnapshot.
+DAR_ENUM_CLASS_BEGIN(MemoryTag, uint8)
+#define DAR_ENUM_LIST(e) \
+  e(Untagged, = 0) \
+  e(Asset) \
+  e(Image) \
+  e(Task) \
+  e(File) \
+  e(Config) \
+  e(ImGui)
+DAR_ENUM_CLASS_END(MemoryTag)
+#undef DAR_ENUM_LIST
+constexpr int64 defaultAllocationAlignment = 16;
+void* allocateMemory(int64 size, MemoryTag tag = MemoryTag::Untagged, int64 alignment = defaultAllocationAlignment);
+// Accepts nullptr. Memory has to come from allocateMemory, the allocation's tag is counted down.
+void freeMemory(void* pointer);
+// Usable size of the allocation, at least the requested size.
+int64 getAllocationSize(const void* pointer);
+// Tag the allocation was made with.
+MemoryTag getAllocationTag(const void* pointer);
+struct MemoryAllocatorStats
+{
+  int64 committedSize;
+  int64 smallPageCount;
+  int64 smallObjectCount;         // Allocated small objects, counting the ones cached by threads for upcoming allocations.
+  int64 largeAllocatedSize;
+  int64 largeFreeSize;
+  int64 largestLargeFreeBlockSize; // Much smaller than largeFreeSize means the large heap is fragmented.
+};
+MemoryAllocatorStats getMemoryAllocatorStats();
+struct MemoryTagStats
+{
+  int64 liveSize;
+  int64 liveCount;
+  int64 allocationCount;
+  int64 highWaterMark;
+};
+struct MemoryTagSnapshot
+{
+  const MemoryTagStats& operator[](MemoryTag tag) const { return tags[int64(tag)]; }
+
+  MemoryTagStats tags[MemoryTagValueCount];
+};
+// Every thread counts its own allocations and merges the counts into the shared ones once its live size of a tag changed by 64 KB,
+// the snapshot adds the counts not merged yet. High water marks are taken on merges and snapshots, so they may miss a short peak.
+MemoryTagSnapshot getMemoryTagSnapshot();
+// Lets standard containers allocate through allocateMemory under the tag.
+template<typename ValueType, MemoryTag tag>
+struct TaggedAllocator
+{
+  using value_type = ValueType;
+  template<typename OtherType>
+  struct rebind
+  {
+    using other = TaggedAllocator<OtherType, tag>;
+  };
+
+  constexpr TaggedAllocator() = default;
+  template<typename OtherType>
+  constexpr TaggedAllocator(const TaggedAllocator<OtherType, tag>& other) {}
+
+  ValueType* allocate(std::size_t count) { return static_cast<ValueType*>(allocateMemory(count * sizeof(ValueType), tag, std::max(int64(alignof(ValueType)), defaultAllocationAlignment))); }
+  void deallocate(ValueType* pointer, std::size_t count) { freeMemory(pointer); }
+
+  template<typename OtherType>
+  bool operator==(const TaggedAllocator<OtherType, tag>& other) const { return true; }
+};
+
+constexpr int64 poolMagazineCount = 64;
+// Index of the pool magazine owned by the calling thread, -1 when all are owned by other threads.
+// Magazines are reused by new threads after their owner threads exit.
+int64 getPoolMagazineIndex();
+
+// Free objects of a pool. Every thread caches up to two batches of objects in its own magazine, the rest is kept in a shared
+// lock free stack of batches, so most allocations and deallocations don't touch shared cache lines.
+// The shared stack head carries a tag changed by every operation to prevent ABA.
+template<int64 batchSize>
+class ThreadSafeFreeList
+{
+public:
+
+  struct Item
+  {
+    Item* next;
+    Item* nextBatch; // Valid only for the first item of a batch in the shared stack.
+  };
+
+  constexpr ThreadSafeFreeList() = default;
+  ThreadSafeFreeList(const ThreadSafeFreeList& other) = delete;
+  ThreadSafeFreeList(ThreadSafeFreeList&& other) = delete;
+
+  // Adds new objects, which are never removed from the list.
+  void add(byte* objects, int64 objectSize, int64 objectCount)
+  {
+    for (int64 batchBegin = 0; batchBegin < objectCount; batchBegin += batchSize)
+    {
+      const int64 batchEnd = std::min(batchBegin + batchSize, objectCount);
+      for (int64 i = batchBegin; i < batchEnd - 1; ++i)
+      {
+        reinterpret_cast<Item*>(&objects[i * objectSize])->next = reinterpret_cast<Item*>(&objects[(i + 1) * objectSize]);
+      }
+      reinterpret_cast<Item*>(&objects[(batchEnd - 1) * objectSize])->next = nullptr;
+      pushBatch(reinterpret_cast<Item*>(&objects[batchBegin * objectSize]), batchEnd - batchBegin);
+    }
+    totalCount.fetch_add(objectCount, std::memory_order_relaxed);
+  }
+
+  void* tryPop()
+  {
+    const int64 magazineIndex = getPoolMagazineIndex();
+    if (magazineIndex < 0)
+    {
+      int64 batchCount;
+      Item* batch = tryPopBatch(batchCount);
+      if (batch && batch->next)
+      {
+        pushBatch(batch->next, batchCount - 1);
+      }
+      return batch;
+    }
+
+    Magazine& magazine = magazines[magazineIndex];
+    int64 count = magazine.count.load(std::memory_order_relaxed);
+    if (count == 0)
+    {
+      magazine.head = tryPopBatch(count);
+      if (!magazine.head)
+      {
+        return nullptr;
+      }
+    }
+
+    Item* item = magazine.head;
+    magazine.head = item->next;
+    magazine.count.store(count - 1, std::memory_order_relaxed);
+    return item;
+  }
+
+  void push(void* object)
+  {
+    Item* item = static_cast<Item*>(object);
+    const int64 magazineIndex = getPoolMagazineIndex();
+    if (magazineIndex < 0)
+    {
+      item->next = nullptr;
+      pushBatch(item, 1);
+      return;
+    }
+
+    Magazine& magazine = magazines[magazineIndex];
+    item->next = magazine.head;
+    magazine.head = item;
+    int64 count = magazine.count.load(std::memory_order_relaxed) + 1;
+    if (count >= 2 * batchSize)
+    {
+      // Keep one batch for upcoming allocations, return the other one.
+      Item* batch = magazine.head;
+      Item* batchLast = batch;
+      for (int64 i = 1; i < batchSize; ++i)
+      {
+        batchLast = batchLast->next;
+      }
+      magazine.head = batchLast->next;
+      batchLast->next = nullptr;
+      pushBatch(batch, batchSize);
+      count -= batchSize;
+    }
+    magazine.count.store(count, std::memory_order_relaxed);
+  }
+
+  bool isSharedStackEmpty() const { return unpackPointer(sharedHead.load(std::memory_order_acquire)) == nullptr; }
+
+  int64 getTotalCount() const { return totalCount.load(std::memory_order_relaxed); }
+  int64 getFreeCount() const
+  {
+    int64 freeCount = sharedCount.load(std::memory_order_relaxed);
+    for (const Magazine& magazine : magazines)
+    {
+      freeCount += magazine.count.load(std::memory_order_relaxed);
+    }
+    return freeCount;
+  }
+  // Measured when batches leave the shared stack, so objects cached in magazines count as used.
+  int64 getPeakUsedCount() const { return peakUsedCount.load(std::memory_order_relaxed); }
+
+private:
+
+  static_assert(sizeof(void*) == 8, "Tagged pointers assume 64 bit pointers with 48 significant bits.");
+  static constexpr int64 pointerBitCount = 48;
+  static constexpr uint64 pointerMask = (uint64(1) << pointerBitCount) - 1;
+  static Item* unpackPointer(uint64 tagged) { return reinterpret_cast<Item*>(tagged & pointerMask); }
+  static uint64 pack(Item* pointer, uint64 previousTagged) { return reinterpret_cast<uint64>(pointer) | (((previousTagged >> pointerBitCount) + 1) << pointerBitCount); }
+
+  void pushBatch(Item* batch, int64 count)
+  {
+    uint64 lastHead = sharedHead.load(std::memory_order_relaxed);
+    do
+    {
+      batch->nextBatch = unpackPointer(lastHead);
+    } while (!sharedHead.compare_exchange_weak(lastHead, pack(batch, lastHead), std::memory_order_release, std::memory_order_relaxed));
+    sharedCount.fetch_add(count, std::memory_order_relaxed);
+  }
+
+  Item* tryPopBatch(int64& outCount)
+  {
+    uint64 lastHead = sharedHead.load(std::memory_order_acquire);
+    Item* batch;
+    do
+    {
+      batch = unpackPointer(lastHead);
+      if (!batch)
+      {
+        return nullptr;
+      }
+      // Another thread might pop and reuse the batch meanwhile, but then the tag changes and the exchange fails.
+    } while (!sharedHead.compare_exchange_weak(lastHead, pack(batch->nextBatch, lastHead), std::memory_order_acquire, std::memory_order_acquire));
+
+    outCount = 1;
+    for (Item* item = batch->next; item; item = item->next)
+    {
+      ++outCount;
+    }
+    const int64 usedCount = totalCount.load(std::memory_order_relaxed) - (sharedCount.fetch_sub(outCount, std::memory_order_relaxed) - outCount);
+    int64 lastPeakUsedCount = peakUsedCount.load(std::memory_order_relaxed);
+    while (usedCount > lastPeakUsedCount && !peakUsedCount.compare_exchange_weak(lastPeakUsedCount, usedCount, std::memory_order_relaxed)) {}
+
+    return batch;
+  }
+
+  // Accessed only by the owning thread, except count which is read for statistics.
+  struct alignas(CACHE_LINE_SIZE) Magazine
+  {
+    Item* head = nullptr;
+    std::atomic<int64> count = 0;
+  };
+  Magazine magazines[poolMagazineCount];
+
+  alignas(CACHE_LINE_SIZE) std::atomic<uint64> sharedHead = 0;
+  alignas(CACHE_LINE_SIZE) std::atomic<int64> sharedCount = 0;
+  std::atomic<int64> totalCount = 0;
+  std::atomic<int64> peakUsedCount = 0;
+};
+
 // Allocates objects from a fixed size array. Unallocated objects are managed using a free list.
 template<typename ObjectType, int64 size>
 class FixedThreadSafePoolAllocator
 {
   static_assert(size > 0, "size must be greater than zero");
-  static_assert(sizeof(ObjectType) >= sizeof(void*), "ObjectType size has to be at least size of a pointer to allow free list management");
+  static_assert(sizeof(ObjectType) >= sizeof(ThreadSafeFreeList<1>::Item), "ObjectType size has to be at least size of two pointers to allow free list management");
 
 public:
 
   FixedThreadSafePoolAllocator()
   {
-    freeListHead.store(reinterpret_cast<FreeListItem*>(pool), std::memory_order_relaxed);
-    for (int64 i = 0; i < (size - 1); ++i)
-    {
-      FreeListItem* nextItem = reinterpret_cast<FreeListItem*>(&pool[(i + 1) * sizeof(ObjectType)]);
-      reinterpret_cast<FreeListItem*>(&pool[i * sizeof(ObjectType)])->next = nextItem;
-    }
-    reinterpret_cast<FreeListItem*>(&pool[(size - 1) * sizeof(ObjectType)])->next = nullptr;
+    freeList.add(pool, sizeof(ObjectType), size);
   }
 
   void* allocate()
   {
-    FreeListItem* lastFreeListHead;
-    do
+    void* object = freeList.tryPop();
+    if (!object)
     {
-      lastFreeListHead = freeListHead.load(std::memory_order_relaxed);
-      if (!lastFreeListHead)
+      ensureNoEntry();
+      logWarning("FixedThreadSafePoolAllocator ran out of preallocated pool objects.");
+      if (alignof(ObjectType) > alignof(std::max_align_t))
+      {
+        return alignedMalloc(alignof(ObjectType), sizeof(ObjectType));
+      }
+      else
       {
-        ensureNoEntry();
-        logWarning("FixedThreadSafePoolAllocator ran out of preallocated pool objects.");
-        if (alignof(ObjectType) > alignof(std::max_align_t))
-        {
-          return alignedMalloc(alignof(ObjectType), sizeof(ObjectType));
-        }
-        else
-        {
-          return malloc(sizeof(ObjectType));
-        }
+        return malloc(sizeof(ObjectType));
       }
-    } while (!freeListHead.compare_exchange_strong(lastFreeListHead, lastFreeListHead->next));
+    }
 
-    return lastFreeListHead;
+    return object;
   }
 
   void deallocate(ObjectType* toDeallocate)
@@ -62,24 +310,220 @@ public:
       return;
     }
 
-    FreeListItem* newFreeListHead = reinterpret_cast<FreeListItem*>(toDeallocate);
-    FreeListItem* lastFreeListHead;
-    do
+    // Objects allocated after the pool ran out don't belong to the free list.
+    byte* toDeallocateBytes = reinterpret_cast<byte*>(toDeallocate);
+    if (toDeallocateBytes < pool || toDeallocateBytes >= pool + sizeof(pool))
     {
-      lastFreeListHead = freeListHead.load(std::memory_order_relaxed);
-      newFreeListHead->next = lastFreeListHead;
-    } while(!freeListHead.compare_exchange_strong(lastFreeListHead, newFreeListHead));
+      if (alignof(ObjectType) > alignof(std::max_align_t))
+      {
+        alignedFree(toDeallocate);
+      }
+      else
+      {
+        free(toDeallocate);
+      }
+      return;
+    }
+
+    freeList.push(toDeallocate);
   }
 
 private:
 
   alignas(alignof(ObjectType)) byte pool[size * sizeof(ObjectType)]; // Is byte array to avoid default initialization of objects.
 
-  struct FreeListItem
+  ThreadSafeFreeList<32> freeList;
+};
+
+// Allocates objects from slabs of objectsPerSlab objects, adds a new slab when all objects are in use.
+// Slabs are cache line aligned and are freed only when the allocator is destroyed.
+template<typename ObjectType, int64 objectsPerSlab, MemoryTag tag = MemoryTag::Untagged>
+class ThreadSafePoolAllocator
+{
+  static_assert(objectsPerSlab > 0, "objectsPerSlab must be greater than zero");
+  static_assert(sizeof(ObjectType) >= sizeof(ThreadSafeFreeList<1>::Item), "ObjectType size has to be at least size of two pointers to allow free list management");
+
+public:
+
+  constexpr ThreadSafePoolAllocator() = default;
+  ThreadSafePoolAllocator(const ThreadSafePoolAllocator& other) = delete;
+  ThreadSafePoolAllocator(ThreadSafePoolAllocator&& other) = delete;
+  ~ThreadSafePoolAllocator()
   {
-    FreeListItem* next;
+    while (lastSlab)
+    {
+      Slab* previousSlab = lastSlab->previous;
+      freeMemory(lastSlab);
+      lastSlab = previousSlab;
+    }
+  }
+
+  void* allocate()
+  {
+    void* object = freeList.tryPop();
+    while (!object)
+    {
+      grow();
+      object = freeList.tryPop();
+    }
+    return object;
+  }
+
+  void deallocate(ObjectType* toDeallocate)
+  {
+    if (!toDeallocate)
+    {
+      logError("Tried to deallocate nullptr in a ThreadSafePoolAllocator.");
+      return;
+    }
+
+    freeList.push(toDeallocate);
+  }
+
+  int64 getCurrentCount() const { return freeList.getTotalCount() - freeList.getFreeCount(); }
+  // Counts objects cached by threads for upcoming allocations as used.
+  int64 getPeakCount() const { return freeList.getPeakUsedCount(); }
+  int64 getCapacity() const { return freeList.getTotalCount(); }
+
+private:
+
+  struct alignas(CACHE_LINE_SIZE) Slab
+  {
+    Slab* previous;
   };
-  alignas(CACHE_LINE_SIZE) std::atomic<FreeListItem*> freeListHead; // Keep on separate cache line to avoid false sharing.
+  static constexpr int64 objectAlignment = alignof(ObjectType) > CACHE_LINE_SIZE ? alignof(ObjectType) : CACHE_LINE_SIZE;
+  static constexpr int64 objectsOffset = (sizeof(Slab) + objectAlignment - 1) / objectAlignment * objectAlignment;
+
+  void grow()
+  {
+    std::lock_guard lock{ growMutex };
+    if (!freeList.isSharedStackEmpty())
+    {
+      return; // Another thread has grown the pool or objects were deallocated meanwhile.
+    }
+
+    Slab* slab = static_cast<Slab*>(allocateMemory(objectsOffset + objectsPerSlab * sizeof(ObjectType), tag, objectAlignment));
+    slab->previous = lastSlab;
+    lastSlab = slab;
+
+    freeList.add(reinterpret_cast<byte*>(slab) + objectsOffset, sizeof(ObjectType), objectsPerSlab);
+  }
+
+  ThreadSafeFreeList<32> freeList;
+  std::mutex growMutex;
+  Slab* lastSlab = nullptr;
+};
+
+// Linear allocator for short lived temporary memory. Allocating is a pointer bump, memory is released by rewinding to a marker.
+// When the current block is full, a new one is chained after it. Blocks are kept and reused after rewinding.
+class ScratchArena
+{
+public:
+
+  static constexpr int64 defaultBlockSize = 4 * 1024 * 1024;
+
+  explicit ScratchArena(int64 inBlockSize = defaultBlockSize)
+    : blockSize(inBlockSize)
+  {
+  }
+  ScratchArena(const ScratchArena& other) = delete;
+  ScratchArena(ScratchArena&& other) = delete;
+  ~ScratchArena();
+
+  struct Marker
+  {
+    void* block;
+    byte* position;
+  };
+
+  void* allocate(int64 size, int64 alignment = alignof(std::max_align_t))
+  {
+    byte* alignedPosition = reinterpret_cast<byte*>((uintptr_t(position) + alignment - 1) & ~uintptr_t(alignment - 1));
+    if (position && alignedPosition + size <= blockEnd)
+    {
+      position = alignedPosition + size;
+      return alignedPosition;
+    }
+    return allocateFromNextBlock(size, alignment);
+  }
+  template<typename ItemType>
+  ItemType* allocate(int64 count) { return static_cast<ItemType*>(allocate(count * sizeof(ItemType), alignof(ItemType))); }
+  // Only the last allocation is freed right away, so that growing containers don't waste the arena, the rest waits for a rewind.
+  void deallocate(void* pointer, int64 size)
+  {
+    if (static_cast<byte*>(pointer) + size == position)
+    {
+      position = static_cast<byte*>(pointer);
+    }
+  }
+
+  Marker getMarker() const { return { currentBlock, position }; }
+  // Frees everything allocated after the marker was taken.
+  void rewind(const Marker& marker);
+
+  // Bytes in all blocks, including the ones kept for reuse.
+  int64 getCapacity() const { return capacity; }
+  int64 getBlockCount() const { return blockCount; }
+
+private:
+
+  struct Block
+  {
+    Block* next;
+    byte* end;
+  };
+
+  void* allocateFromNextBlock(int64 size, int64 alignment);
+
+  Block* firstBlock = nullptr;
+  Block* currentBlock = nullptr;
+  byte* position = nullptr;
+  byte* blockEnd = nullptr;
+  int64 blockSize;
+  int64 capacity = 0;
+  int64 blockCount = 0;
+};
+
+// Arena of the calling thread. Task functions get it in TaskThreadContext::scratchArena, rewound after every task.
+ScratchArena& getThreadScratchArena();
+
+// Rewinds the arena to where it was when the scope was entered.
+class ScratchArenaScope
+{
+public:
+
+  explicit ScratchArenaScope(ScratchArena& inArena)
+    : arena(inArena)
+    , marker(inArena.getMarker())
+  {
+  }
+  ScratchArenaScope(const ScratchArenaScope& other) = delete;
+  ScratchArenaScope(ScratchArenaScope&& other) = delete;
+  ~ScratchArenaScope() { arena.rewind(marker); }
+
+private:
+
+  ScratchArena& arena;
+  ScratchArena::Marker marker;
+};
+
+// Lets std::pmr containers allocate from a ScratchArena.
+class ScratchArenaResource : public std::pmr::memory_resource
+{
+public:
+
+  explicit ScratchArenaResource(ScratchArena& inArena)
+    : arena(inArena)
+  {
+  }
+
+private:
+
+  void* do_allocate(std::size_t size, std::size_t alignment) override { return arena.allocate(int64(size), int64(alignment)); }
+  void do_deallocate(void* pointer, std::size_t size, std::size_t alignment) override { arena.deallocate(pointer, int64(size)); }
+  bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+  ScratchArena& arena;
 };
 
 // Value type must implement ref() and unref() methods.
@@ -167,3 +611,72 @@ private:
 
   ValueType* ptr = nullptr;
 };
+
+class TaskEvent;
+
+struct FrameAllocatorStats
+{
+  int64 frameCapacity;
+  int64 lastFrameSize;        // Bytes requested in the last retired frame, including allocations that didn't fit.
+  int64 highWaterMark;        // Maximum of lastFrameSize over all retired frames, size frameCapacity by this.
+  int64 overflowedFrameCount;
+  int64 overflowCount;        // Allocations that returned nullptr because the frame was full.
+};
+
+// Linear allocator for data living until the end of a frame, like draw lists, culling results or debug text.
+// Keeps frameCount (at least 2) buffers so that the next frames can allocate while earlier ones are still in use. Any thread allocates
+// from the current buffer with a single atomic add, a buffer is released at once when it is reused after its fence retired.
+class FrameAllocator
+{
+public:
+
+  // Allocations are aligned to at least this.
+  static constexpr int64 minAlignment = 16;
+
+  FrameAllocator(int64 inFrameCount, int64 inFrameCapacity);
+  FrameAllocator(const FrameAllocator& other) = delete;
+  FrameAllocator(FrameAllocator&& other) = delete;
+  ~FrameAllocator();
+
+  // Returns nullptr when the current frame's buffer is full, the overflow is reported by nextFrame.
+  void* allocate(int64 size, int64 alignment = minAlignment)
+  {
+    Frame& frame = frames[currentFrameIndex.load(std::memory_order_acquire)];
+    // Bigger alignments are reserved with padding, so that the bump stays a single atomic add.
+    const int64 alignedSize = (size + minAlignment - 1) & ~(minAlignment - 1);
+    const int64 reservedSize = alignment > minAlignment ? alignedSize + alignment - minAlignment : alignedSize;
+    const int64 offset = frame.usedSize.fetch_add(reservedSize, std::memory_order_relaxed);
+    if (offset + reservedSize > frameCapacity)
+    {
+      frame.overflowCount.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    return reinterpret_cast<void*>((uintptr_t(frame.data + offset) + alignment - 1) & ~uintptr_t(alignment - 1));
+  }
+  template<typename ItemType>
+  ItemType* allocate(int64 count) { return static_cast<ItemType*>(allocate(count * sizeof(ItemType), std::max(int64(alignof(ItemType)), minAlignment))); }
+
+  // Ends the current frame, its buffer is reused once retireFence is completed. Then moves to the next buffer,
+  // waiting for the fence of the frame that used it before. Call from one thread, usually the main thread once per frame.
+  void nextFrame(Ref<TaskEvent> retireFence);
+
+  // Call from the thread calling nextFrame.
+  FrameAllocatorStats getStats() const { return stats; }
+  int64 getFrameCount() const { return frameCount; }
+
+private:
+
+  struct alignas(CACHE_LINE_SIZE) Frame
+  {
+    byte* data = nullptr;
+    std::atomic<int64> usedSize = 0;
+    std::atomic<int64> overflowCount = 0;
+    Ref<TaskEvent> retireFence;
+  };
+
+  std::unique_ptr<Frame[]> frames;
+  int64 frameCount;
+  int64 frameCapacity;
+  std::atomic<int64> currentFrameIndex = 0;
+  FrameAllocatorStats stats = {};
+};
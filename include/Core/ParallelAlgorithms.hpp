@@ -0,0 +1,316 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <functional>
+#include <span>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "Core/Core.hpp"
+#include "Core/Task.hpp"
+
+/**
+ * Parallel algorithms built on parallelFor. Like parallelFor they can be called from any thread, including from within tasks.
+ * Algorithms that need per block state split the range into a fixed number of blocks, a few per thread,
+ * so that the results don't depend on which thread processed which block.
+ */
+
+// Number of blocks for elementCount elements, each at least minBlockSize elements long except when there are fewer elements.
+inline int64 getParallelBlockCount(int64 elementCount, int64 minBlockSize)
+{
+  constexpr int64 blocksPerThread = 4;
+  const int64 maxBlockCount = (getWorkerCount() + 1) * blocksPerThread;
+  return std::clamp((elementCount + minBlockSize - 1) / minBlockSize, int64(1), maxBlockCount);
+}
+// Calls function(blockIndex, blockBegin, blockEnd) for every block of [0, elementCount) split into blockCount blocks.
+template<typename FunctionType>
+void parallelForBlocks(int64 elementCount, int64 blockCount, FunctionType&& function)
+{
+  parallelFor(0, blockCount, [elementCount, blockCount, &function](int64 rangeBegin, int64 rangeEnd, int64 threadIndex)
+  {
+    for (int64 blockIndex = rangeBegin; blockIndex < rangeEnd; ++blockIndex)
+    {
+      function(blockIndex, elementCount * blockIndex / blockCount, elementCount * (blockIndex + 1) / blockCount);
+    }
+  });
+}
+
+// Calls function(value) for every value.
+template<typename ValueType, typename FunctionType>
+  requires std::is_invocable_v<FunctionType&, ValueType&>
+void parallelForEach(std::span<ValueType> values, FunctionType&& function, int64 grainSize = 1024)
+{
+  parallelFor(0, int64(values.size()), [values, &function](int64 rangeBegin, int64 rangeEnd, int64 threadIndex)
+  {
+    for (int64 i = rangeBegin; i < rangeEnd; ++i)
+    {
+      function(values[i]);
+    }
+  }, grainSize);
+}
+
+// Folds values into identity with reduceOperation, which has to be associative and accept both (ResultType, ValueType) and (ResultType, ResultType).
+// The order in which partial results are combined only depends on the worker count, so floating point results are repeatable.
+template<typename ValueType, typename ResultType, typename ReduceOperationType = std::plus<>>
+ResultType parallelReduce(std::span<ValueType> values, ResultType identity, ReduceOperationType reduceOperation = {}, int64 minBlockSize = 16384)
+{
+  const int64 blockCount = getParallelBlockCount(int64(values.size()), minBlockSize);
+  std::vector<ResultType> partialResults(blockCount, identity);
+  parallelForBlocks(int64(values.size()), blockCount, [values, &partialResults, &reduceOperation](int64 blockIndex, int64 blockBegin, int64 blockEnd)
+  {
+    ResultType partialResult = partialResults[blockIndex];
+    for (int64 i = blockBegin; i < blockEnd; ++i)
+    {
+      partialResult = reduceOperation(std::move(partialResult), values[i]);
+    }
+    partialResults[blockIndex] = std::move(partialResult);
+  });
+
+  ResultType result = std::move(identity);
+  for (ResultType& partialResult : partialResults)
+  {
+    result = reduceOperation(std::move(result), std::move(partialResult));
+  }
+  return result;
+}
+
+// output[i] = input[0] op input[1] op ... op input[i]. output may be the same span as input, scanOperation has to be associative.
+template<typename ValueType, typename ScanOperationType = std::plus<>>
+void parallelInclusiveScan(std::type_identity_t<std::span<const ValueType>> input, std::span<ValueType> output, ScanOperationType scanOperation = {}, int64 minBlockSize = 16384)
+{
+  assert(output.size() >= input.size());
+
+  const int64 elementCount = int64(input.size());
+  if (elementCount == 0)
+  {
+    return;
+  }
+
+  // Scan each block on its own, then add the totals of preceding blocks to all but the first block.
+  const int64 blockCount = getParallelBlockCount(elementCount, minBlockSize);
+  std::vector<ValueType> blockTotals(blockCount);
+  parallelForBlocks(elementCount, blockCount, [input, output, &blockTotals, &scanOperation](int64 blockIndex, int64 blockBegin, int64 blockEnd)
+  {
+    ValueType total = input[blockBegin];
+    output[blockBegin] = total;
+    for (int64 i = blockBegin + 1; i < blockEnd; ++i)
+    {
+      total = scanOperation(total, input[i]);
+      output[i] = total;
+    }
+    blockTotals[blockIndex] = total;
+  });
+  if (blockCount == 1)
+  {
+    return;
+  }
+
+  for (int64 blockIndex = 1; blockIndex < blockCount; ++blockIndex)
+  {
+    blockTotals[blockIndex] = scanOperation(blockTotals[blockIndex - 1], blockTotals[blockIndex]);
+  }
+  parallelForBlocks(elementCount, blockCount, [output, &blockTotals, &scanOperation](int64 blockIndex, int64 blockBegin, int64 blockEnd)
+  {
+    if (blockIndex == 0)
+    {
+      return;
+    }
+
+    const ValueType& offset = blockTotals[blockIndex - 1];
+    for (int64 i = blockBegin; i < blockEnd; ++i)
+    {
+      output[i] = scanOperation(offset, output[i]);
+    }
+  });
+}
+
+// Stable, moves values satisfying predicate to the front and returns their count. ValueType has to be default constructible.
+template<typename ValueType, typename PredicateType>
+  requires std::is_invocable_r_v<bool, PredicateType&, const ValueType&>
+int64 parallelPartition(std::span<ValueType> values, PredicateType&& predicate, int64 minBlockSize = 16384)
+{
+  const int64 elementCount = int64(values.size());
+  const int64 blockCount = getParallelBlockCount(elementCount, minBlockSize);
+  if (blockCount == 1)
+  {
+    return std::stable_partition(values.begin(), values.end(), predicate) - values.begin();
+  }
+
+  // Count per block, then every block scatters its values right where they end up.
+  std::vector<int64> blockTrueCounts(blockCount);
+  parallelForBlocks(elementCount, blockCount, [values, &blockTrueCounts, &predicate](int64 blockIndex, int64 blockBegin, int64 blockEnd)
+  {
+    int64 trueCount = 0;
+    for (int64 i = blockBegin; i < blockEnd; ++i)
+    {
+      trueCount += predicate(std::as_const(values[i])) ? 1 : 0;
+    }
+    blockTrueCounts[blockIndex] = trueCount;
+  });
+
+  std::vector<int64> blockTrueOffsets(blockCount);
+  int64 totalTrueCount = 0;
+  for (int64 blockIndex = 0; blockIndex < blockCount; ++blockIndex)
+  {
+    blockTrueOffsets[blockIndex] = totalTrueCount;
+    totalTrueCount += blockTrueCounts[blockIndex];
+  }
+
+  std::vector<ValueType> buffer(elementCount);
+  parallelForBlocks(elementCount, blockCount, [values, &buffer, &blockTrueOffsets, totalTrueCount, &predicate](int64 blockIndex, int64 blockBegin, int64 blockEnd)
+  {
+    int64 trueIndex = blockTrueOffsets[blockIndex];
+    int64 falseIndex = totalTrueCount + blockBegin - blockTrueOffsets[blockIndex];
+    for (int64 i = blockBegin; i < blockEnd; ++i)
+    {
+      buffer[predicate(std::as_const(values[i])) ? trueIndex++ : falseIndex++] = std::move(values[i]);
+    }
+  });
+  parallelFor(0, elementCount, [values, &buffer](int64 rangeBegin, int64 rangeEnd, int64 threadIndex)
+  {
+    std::move(buffer.begin() + rangeBegin, buffer.begin() + rangeEnd, values.begin() + rangeBegin);
+  }, minBlockSize);
+
+  return totalTrueCount;
+}
+
+template<typename ValueType>
+concept RadixSortable = (std::is_integral_v<ValueType> && !std::is_same_v<ValueType, bool>) || std::is_same_v<ValueType, float> || std::is_same_v<ValueType, double>;
+
+// Maps the value to an unsigned key with the same ordering. Negative floats have all bits flipped, positive ones just the sign bit.
+template<RadixSortable ValueType>
+auto toRadixKey(ValueType value)
+{
+  using KeyType = std::make_unsigned_t<std::conditional_t<std::is_floating_point_v<ValueType>, std::conditional_t<sizeof(ValueType) == 4, int32, int64>, ValueType>>;
+  constexpr KeyType signBit = KeyType(1) << (sizeof(KeyType) * 8 - 1);
+  if constexpr (std::is_floating_point_v<ValueType>)
+  {
+    const KeyType bits = std::bit_cast<KeyType>(value);
+    return KeyType(bits & signBit ? ~bits : bits | signBit);
+  }
+  else if constexpr (std::is_signed_v<ValueType>)
+  {
+    return KeyType(KeyType(value) ^ signBit);
+  }
+  else
+  {
+    return value;
+  }
+}
+
+// Sorts integers and floats ascending with a parallel LSD radix sort, 8 bits per pass. Falls back to std::sort for small spans.
+template<RadixSortable ValueType>
+void parallelSort(std::span<ValueType> values, int64 minBlockSize = 65536)
+{
+  const int64 elementCount = int64(values.size());
+  const int64 blockCount = getParallelBlockCount(elementCount, minBlockSize);
+  if (blockCount == 1)
+  {
+    std::sort(values.begin(), values.end());
+    return;
+  }
+
+  constexpr int64 digitCount = 256;
+  std::vector<ValueType> buffer(elementCount);
+  std::vector<int64> blockOffsets(blockCount * digitCount);
+  std::span<ValueType> source = values;
+  std::span<ValueType> destination = buffer;
+  for (int64 shift = 0; shift < int64(sizeof(ValueType) * 8); shift += 8)
+  {
+    parallelForBlocks(elementCount, blockCount, [source, shift, &blockOffsets](int64 blockIndex, int64 blockBegin, int64 blockEnd)
+    {
+      int64* digitCounts = &blockOffsets[blockIndex * digitCount];
+      std::fill_n(digitCounts, digitCount, int64(0));
+      for (int64 i = blockBegin; i < blockEnd; ++i)
+      {
+        ++digitCounts[(toRadixKey(source[i]) >> shift) & 0xFF];
+      }
+    });
+
+    // All values having the same digit is common for the high bytes of small integers, the pass wouldn't move anything.
+    bool isPassNeeded = true;
+    for (int64 digit = 0; digit < digitCount; ++digit)
+    {
+      int64 digitTotal = 0;
+      for (int64 blockIndex = 0; blockIndex < blockCount; ++blockIndex)
+      {
+        digitTotal += blockOffsets[blockIndex * digitCount + digit];
+      }
+      if (digitTotal == elementCount)
+      {
+        isPassNeeded = false;
+        break;
+      }
+    }
+    if (!isPassNeeded)
+    {
+      continue;
+    }
+
+    // Digit major, block minor exclusive scan keeps the sort stable.
+    int64 offset = 0;
+    for (int64 digit = 0; digit < digitCount; ++digit)
+    {
+      for (int64 blockIndex = 0; blockIndex < blockCount; ++blockIndex)
+      {
+        const int64 count = blockOffsets[blockIndex * digitCount + digit];
+        blockOffsets[blockIndex * digitCount + digit] = offset;
+        offset += count;
+      }
+    }
+
+    parallelForBlocks(elementCount, blockCount, [source, destination, shift, &blockOffsets](int64 blockIndex, int64 blockBegin, int64 blockEnd)
+    {
+      int64* digitOffsets = &blockOffsets[blockIndex * digitCount];
+      for (int64 i = blockBegin; i < blockEnd; ++i)
+      {
+        destination[digitOffsets[(toRadixKey(source[i]) >> shift) & 0xFF]++] = source[i];
+      }
+    });
+    std::swap(source, destination);
+  }
+
+  if (source.data() != values.data())
+  {
+    parallelFor(0, elementCount, [source, values](int64 rangeBegin, int64 rangeEnd, int64 threadIndex)
+    {
+      std::copy(source.begin() + rangeBegin, source.begin() + rangeEnd, values.begin() + rangeBegin);
+    }, minBlockSize);
+  }
+}
+
+// Sorts with a comparator. Blocks are sorted in parallel, then neighbouring runs are merged pairwise in parallel passes.
+template<typename ValueType, typename CompareType>
+  requires std::is_invocable_r_v<bool, CompareType&, const ValueType&, const ValueType&>
+void parallelSort(std::span<ValueType> values, CompareType&& compare, int64 minBlockSize = 16384)
+{
+  const int64 elementCount = int64(values.size());
+  const int64 blockCount = getParallelBlockCount(elementCount, minBlockSize);
+  if (blockCount == 1)
+  {
+    std::sort(values.begin(), values.end(), compare);
+    return;
+  }
+
+  parallelForBlocks(elementCount, blockCount, [values, &compare](int64 blockIndex, int64 blockBegin, int64 blockEnd)
+  {
+    std::sort(values.begin() + blockBegin, values.begin() + blockEnd, compare);
+  });
+
+  for (int64 runBlockCount = 1; runBlockCount < blockCount; runBlockCount *= 2)
+  {
+    const int64 mergeCount = (blockCount + 2 * runBlockCount - 1) / (2 * runBlockCount);
+    parallelFor(0, mergeCount, [values, elementCount, blockCount, runBlockCount, &compare](int64 rangeBegin, int64 rangeEnd, int64 threadIndex)
+    {
+      for (int64 mergeIndex = rangeBegin; mergeIndex < rangeEnd; ++mergeIndex)
+      {
+        const int64 firstBlock = mergeIndex * 2 * runBlockCount;
+        const int64 middleBlock = std::min(firstBlock + runBlockCount, blockCount);
+        const int64 endBlock = std::min(firstBlock + 2 * runBlockCount, blockCount);
+        std::inplace_merge(values.begin() + elementCount * firstBlock / blockCount, values.begin() + elementCount * middleBlock / blockCount, values.begin() + elementCount * endBlock / blockCount, compare);
+      }
+    });
+  }
+}
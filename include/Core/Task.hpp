@@ -2,6 +2,10 @@
 
 #include <atomic>
 #include <functional>
+#include <memory>
+#include <span>
+#include <type_traits>
+#include <vector>
 
 #include "Core/Core.hpp"
 #include "Core/Concurrency.hpp"
@@ -15,10 +19,35 @@
 struct TaskThreadContext
 {
   int64 index = 0; // Used in case of multiple thread per type, for example taskworker threads. Otherwise 0. Also used in parallel for, where the calling thread is 0.
+  ScratchArena* scratchArena = nullptr; // Arena of the executing thread, rewound when the task returns.
 };
 
 using TaskFunction = void (*)(void* taskParameter, const TaskThreadContext& threadContext);
 
+// Workers always take tasks from higher priority lanes first, except that every few tasks they look at the lowest lane first
+// so that Background tasks don't starve.
+enum class TaskPriority : int8
+{
+  Critical = 0, // Frame critical work, somebody is most likely waiting for it.
+  Normal,
+  Background    // Long running work, e.g. asset loading.
+};
+constexpr int64 taskPriorityCount = 3;
+
+// Moves source payload to uninitialized destination.
+using TaskPayloadMoveFunction = void (*)(void* destination, void* source);
+// Destroys the payload after the task ran, or when the event is freed without running it.
+using TaskPayloadDestroyFunction = void (*)(void* payload);
+// Payloads up to this size are stored inside the TaskEvent, see the templated schedule.
+constexpr int64 taskInlinePayloadSize = 64;
+constexpr int64 taskInlinePayloadAlignment = 16;
+
+enum class TaskWaitMode : uint8
+{
+  Help = 0, // Execute queued tasks while waiting, workers run worker tasks, the main thread runs main thread tasks.
+  Block     // Just sleep until the event is completed.
+};
+
 /**
  * Usually represents task completion event.
  * Has prerequisites that have to be completed before it can start executing.
@@ -36,14 +65,16 @@ public:
 
   void complete();
   bool isComplete() const { return subsequents.isComplete; }
-  void waitForCompletion() const;
+  // Sleeps only when there is nothing to help with.
+  void waitForCompletion(TaskWaitMode mode = TaskWaitMode::Help) const;
 
 private:
 
   // Used internally by TaskManager when scheduling a task.
-  static Ref<TaskEvent> create(TaskFunction function, void* data, ThreadType desiredThread);
+  static Ref<TaskEvent> create(TaskFunction function, void* data, ThreadType desiredThread, TaskPriority priority);
+  static Ref<TaskEvent> create(TaskFunction function, TaskPayloadMoveFunction movePayload, TaskPayloadDestroyFunction destroyPayload, void* payload, ThreadType desiredThread, TaskPriority priority);
 
-  TaskEvent(TaskFunction function, void* data, ThreadType desiredThread);
+  TaskEvent(TaskFunction function, void* data, ThreadType desiredThread, TaskPriority priority);
   TaskEvent() = default;
   TaskEvent(const TaskEvent& other) = delete;
   TaskEvent(TaskEvent&& other) = delete;
@@ -53,7 +84,8 @@ private:
   void unref();
 
   void addPrerequisite();
-  void setPrerequisites(int8 prerequisites) { prerequisiteCount = prerequisites; }
+  // Events without a function complete themselves when their last prerequisite is removed.
+  void setPrerequisites(int32 prerequisites) { prerequisiteCount = prerequisites; }
   void removePrerequisite();
 
   bool tryAddSubsequent(Ref<TaskEvent>&& taskEvent) { return subsequents.tryAdd(std::move(taskEvent)); }
@@ -70,6 +102,9 @@ private:
     bool tryAdd(Ref<TaskEvent>&& taskEvent);
     bool tryAdd(const Ref<TaskEvent>& taskEvent) { return tryAdd(Ref<TaskEvent>(taskEvent)); }
 
+    // Releases subsequents of an event freed without completing, they never run.
+    ~SubsequentList();
+
     void complete();
 
     struct Node
@@ -77,11 +112,13 @@ private:
       Ref<TaskEvent> taskEvent;
       Node* next = nullptr;
     };
-    static FixedThreadSafePoolAllocator<Node, 2048> nodeAllocator;
+    static ThreadSafePoolAllocator<Node, 2048, MemoryTag::Task> nodeAllocator;
     static void recycle(Node* node);
+    // head after complete(), nothing can be added anymore.
+    static Node* getCompletedHead() { return reinterpret_cast<Node*>(alignof(Node)); }
 
     std::atomic<Node*> head = nullptr;
-    volatile bool isComplete = false;
+    std::atomic<bool> isComplete = false;
   };
   SubsequentList subsequents;
 
@@ -89,19 +126,246 @@ private:
   TaskFunction function = nullptr;
   void* data = nullptr;
   ThreadType desiredThread = ThreadType::Unknown;
+  TaskPriority priority = TaskPriority::Normal;
+
+  // Threads sleeping on subsequents.isComplete, complete() wakes them only when there are some.
+  mutable std::atomic<int16> waiterCount = 0;
+
+  std::atomic<int32> refCount = 0;
+  std::atomic<int32> prerequisiteCount = 0;
+
+  // Declared by the scheduler, used by the budgeted processMainThreadTasks. 0 means unknown.
+  int32 estimatedCostMicroseconds = 0;
 
-  // Initialized only when waitForCompletion() was called.
-  mutable std::atomic<void*> waitableEvent = nullptr;
+  // Performance counter value when the task was queued, for the latency telemetry. Fits the padding before inlinePayload.
+  int64 scheduleTicks = 0;
+  // Cleared once the payload was destroyed after execution.
+  TaskPayloadDestroyFunction destroyPayload = nullptr;
 
-  std::atomic<int16> refCount = 0;
-  std::atomic<int16> prerequisiteCount = 0;
+  // data points here for tasks scheduled with an inline payload.
+  alignas(taskInlinePayloadAlignment) byte inlinePayload[taskInlinePayloadSize];
+};
+
+Ref<TaskEvent> schedule(TaskFunction task, void* taskData, ThreadType desiredThread, TaskPriority priority = TaskPriority::Normal);
+struct TaskDesc
+{
+  TaskFunction function;
+  void* data;
+  ThreadType desiredThread = ThreadType::Worker;
+  TaskPriority priority = TaskPriority::Normal;
+  int32 estimatedCostMicroseconds = 0; // See processMainThreadTasks(budgetMicroseconds).
 };
+Ref<TaskEvent> schedule(const TaskDesc& desc, Ref<TaskEvent>* prerequisites = nullptr, int32 prerequisiteCount = 0);
+// Schedules independent tasks with one queue operation per priority lane and a single wake-up of parked workers.
+// Returns an event completed when all the tasks are done, or nothing if shouldCreateCompletionEvent is false.
+Ref<TaskEvent> scheduleBatch(std::span<const TaskDesc> tasks, bool shouldCreateCompletionEvent = true);
+// Maximum prerequisites of one join event. Wider joins are built as a tree of join events, so that thousands of completing
+// prerequisites don't all decrement the same counter. schedule with more prerequisites than this waits on such a tree.
+constexpr int64 taskJoinFanIn = 64;
+// Returns an event completed when all prerequisites are completed.
+Ref<TaskEvent> createJoinEvent(Ref<TaskEvent>* prerequisites, int64 prerequisiteCount);
+Ref<TaskEvent> schedule(TaskFunction task, void* taskData, ThreadType desiredThread, Ref<TaskEvent>* prerequisites, int32 prerequisiteCount, TaskPriority priority = TaskPriority::Normal);
+// The payload is moved into the TaskEvent, task is then called with a pointer to it. Used by the templated schedule.
+Ref<TaskEvent> schedule(TaskFunction task, TaskPayloadMoveFunction movePayload, TaskPayloadDestroyFunction destroyPayload, void* payload, ThreadType desiredThread, Ref<TaskEvent>* prerequisites, int32 prerequisiteCount, TaskPriority priority);
 
-Ref<TaskEvent> schedule(TaskFunction task, void* taskData, ThreadType desiredThread);
-Ref<TaskEvent> schedule(TaskFunction task, void* taskData, ThreadType desiredThread, Ref<TaskEvent>* prerequisites, int8 prerequisiteCount);
+template<typename FunctionType>
+void executeInlineTaskPayload(void* payload, const TaskThreadContext& threadContext)
+{
+  (*static_cast<FunctionType*>(payload))(threadContext);
+}
+template<typename FunctionType>
+void destroyInlineTaskPayload(void* payload)
+{
+  static_cast<FunctionType*>(payload)->~FunctionType();
+}
+template<typename FunctionType>
+void executeHeapTaskPayload(void* payload, const TaskThreadContext& threadContext)
+{
+  (**static_cast<FunctionType**>(payload))(threadContext);
+}
+template<typename FunctionType>
+void destroyHeapTaskPayload(void* payload)
+{
+  delete *static_cast<FunctionType**>(payload);
+}
+template<typename PayloadType>
+void moveTaskPayload(void* destination, void* source)
+{
+  new (destination) PayloadType(std::move(*static_cast<PayloadType*>(source)));
+}
+// Stores function in a payload and passes it to scheduleFunction(task, movePayload, destroyPayload, payload), which schedules it with one of the
+// payload overloads. Captures are stored inside the TaskEvent when they fit taskInlinePayloadSize, on the heap otherwise.
+template<typename FunctionType, typename ScheduleFunctionType>
+Ref<TaskEvent> scheduleTaskPayload(FunctionType&& function, const ScheduleFunctionType& scheduleFunction)
+{
+  using PayloadType = std::decay_t<FunctionType>;
+  if constexpr (sizeof(PayloadType) <= taskInlinePayloadSize && alignof(PayloadType) <= taskInlinePayloadAlignment)
+  {
+    // Copies or moves the function as the caller passed it, the TaskEvent then always moves from this local.
+    PayloadType payload(std::forward<FunctionType>(function));
+    return scheduleFunction(&executeInlineTaskPayload<PayloadType>, &moveTaskPayload<PayloadType>, &destroyInlineTaskPayload<PayloadType>, &payload);
+  }
+  else
+  {
+    PayloadType* payload = new PayloadType(std::forward<FunctionType>(function));
+    return scheduleFunction(&executeHeapTaskPayload<PayloadType>, &moveTaskPayload<PayloadType*>, &destroyHeapTaskPayload<PayloadType>, &payload);
+  }
+}
+// Schedules function(threadContext). Lvalues are copied, rvalues moved.
+template<typename FunctionType>
+  requires std::is_invocable_v<std::decay_t<FunctionType>&, const TaskThreadContext&>
+Ref<TaskEvent> schedule(FunctionType&& function, ThreadType desiredThread, Ref<TaskEvent>* prerequisites, int32 prerequisiteCount, TaskPriority priority = TaskPriority::Normal)
+{
+  return scheduleTaskPayload(std::forward<FunctionType>(function), [=](TaskFunction task, TaskPayloadMoveFunction movePayload, TaskPayloadDestroyFunction destroyPayload, void* payload)
+  {
+    return schedule(task, movePayload, destroyPayload, payload, desiredThread, prerequisites, prerequisiteCount, priority);
+  });
+}
+template<typename FunctionType>
+  requires std::is_invocable_v<std::decay_t<FunctionType>&, const TaskThreadContext&>
+Ref<TaskEvent> schedule(FunctionType&& function, ThreadType desiredThread, TaskPriority priority = TaskPriority::Normal)
+{
+  return schedule(std::forward<FunctionType>(function), desiredThread, nullptr, 0, priority);
+}
+// Calls function for every index in [beginValue, endValue). threadIndex is 0 for non worker threads and worker index + 1 for workers.
+// Can be called from any thread, including from within tasks and other parallelFor bodies.
 void parallelFor(int64 beginValue, int64 endValue, const std::function<void(int64 iterationIndex, int64 threadIndex)>& function);
+using ParallelForRangeFunction = void (*)(int64 rangeBegin, int64 rangeEnd, int64 threadIndex, void* functionContext);
+void parallelFor(int64 beginValue, int64 endValue, int64 grainSize, ParallelForRangeFunction function, void* functionContext);
+// Calls function(rangeBegin, rangeEnd, threadIndex) for chunks covering [beginValue, endValue), each at least grainSize iterations
+// long except the last one. Chunks are claimed in batches that shrink towards the end of the range.
+template<typename FunctionType>
+  requires std::is_invocable_v<FunctionType&, int64, int64, int64>
+void parallelFor(int64 beginValue, int64 endValue, FunctionType&& function, int64 grainSize = 1)
+{
+  parallelFor(beginValue, endValue, grainSize, [](int64 rangeBegin, int64 rangeEnd, int64 threadIndex, void* functionContext)
+  {
+    (*static_cast<std::remove_reference_t<FunctionType>*>(functionContext))(rangeBegin, rangeEnd, threadIndex);
+  }, const_cast<void*>(static_cast<const void*>(&function)));
+}
 int64 getWorkerCount();
 void processMainThreadTasks();
+// Stops once the next task's estimated cost doesn't fit the remaining budget, the rest is carried over to the next call.
+// At least one task is executed per call. Tasks without a declared cost are estimated by the average duration of their function.
+void processMainThreadTasks(int64 budgetMicroseconds);
+// Accounting of the last budgeted processMainThreadTasks call.
+struct MainThreadTaskBudget
+{
+  int64 budgetMicroseconds;
+  int64 usedMicroseconds;
+  int64 estimatedMicroseconds; // Sum of the estimates of executed tasks, compare with usedMicroseconds to tune the declared costs.
+  int64 executedTaskCount;
+  bool wasBudgetExhausted;     // Some tasks were carried over to the next call.
+};
+MainThreadTaskBudget getMainThreadTaskBudget();
+
+// Delayed tasks wait in a hierarchical timer wheel without any OS objects and are enqueued like any other task once due.
+// Time is measured in ticks of taskTimerTickMicroseconds, frames by the frame index passed to advanceTaskTimers.
+constexpr int64 taskTimerTickMicroseconds = 1000;
+Ref<TaskEvent> scheduleAfter(int64 delayMicroseconds, TaskFunction task, void* taskData, ThreadType desiredThread, TaskPriority priority = TaskPriority::Normal);
+Ref<TaskEvent> scheduleAfter(int64 delayMicroseconds, TaskFunction task, TaskPayloadMoveFunction movePayload, TaskPayloadDestroyFunction destroyPayload, void* payload, ThreadType desiredThread, TaskPriority priority);
+// Frames that were already advanced to are due right away.
+Ref<TaskEvent> scheduleAtFrame(int64 frameIndex, TaskFunction task, void* taskData, ThreadType desiredThread, TaskPriority priority = TaskPriority::Normal);
+Ref<TaskEvent> scheduleAtFrame(int64 frameIndex, TaskFunction task, TaskPayloadMoveFunction movePayload, TaskPayloadDestroyFunction destroyPayload, void* payload, ThreadType desiredThread, TaskPriority priority);
+template<typename FunctionType>
+  requires std::is_invocable_v<std::decay_t<FunctionType>&, const TaskThreadContext&>
+Ref<TaskEvent> scheduleAfter(int64 delayMicroseconds, FunctionType&& function, ThreadType desiredThread, TaskPriority priority = TaskPriority::Normal)
+{
+  return scheduleTaskPayload(std::forward<FunctionType>(function), [=](TaskFunction task, TaskPayloadMoveFunction movePayload, TaskPayloadDestroyFunction destroyPayload, void* payload)
+  {
+    return scheduleAfter(delayMicroseconds, task, movePayload, destroyPayload, payload, desiredThread, priority);
+  });
+}
+template<typename FunctionType>
+  requires std::is_invocable_v<std::decay_t<FunctionType>&, const TaskThreadContext&>
+Ref<TaskEvent> scheduleAtFrame(int64 frameIndex, FunctionType&& function, ThreadType desiredThread, TaskPriority priority = TaskPriority::Normal)
+{
+  return scheduleTaskPayload(std::forward<FunctionType>(function), [=](TaskFunction task, TaskPayloadMoveFunction movePayload, TaskPayloadDestroyFunction destroyPayload, void* payload)
+  {
+    return scheduleAtFrame(frameIndex, task, movePayload, destroyPayload, payload, desiredThread, priority);
+  });
+}
+// Enqueues the delayed tasks that became due. Called by the game loop at the beginning of every frame, frame indices only grow.
+void advanceTaskTimers(int64 frameIndex);
+// Frame index of the last advanceTaskTimers call, -1 before the first one.
+int64 getTaskTimerFrameIndex();
+
+// What happens when a task is scheduled while more than softCapacity tasks wait in the shared worker queue.
+enum class TaskQueueFullPolicy : uint8
+{
+  Grow = 0,  // Queue the task anyway, the queue grows.
+  RunInline, // Execute the task in the scheduling thread.
+  Block      // Block the scheduling thread until workers catch up. Worker threads run the task inline instead, as blocking them could deadlock.
+};
+void setTaskQueueBackpressure(TaskQueueFullPolicy policy, int64 softCapacity);
+// How many times a task was scheduled while the shared worker queue was over its soft capacity.
+int64 getTaskQueueFullCount();
+
+struct TaskPoolUsage
+{
+  int64 taskEventCount;
+  int64 taskEventPeakCount;
+  int64 taskEventCapacity;
+  int64 subsequentNodeCount;
+  int64 subsequentNodePeakCount;
+  int64 subsequentNodeCapacity;
+};
+TaskPoolUsage getTaskPoolUsage();
+
+// How worker threads are pinned. The main thread is pinned to its current physical core, which is kept free of workers.
+enum class WorkerPlacement : uint8
+{
+  Unpinned = 0,      // Workers may run on any logical processor, the main thread isn't pinned.
+  PhysicalCores,     // One worker per physical core, free to use all of its SMT siblings.
+  LogicalProcessors  // One worker per logical processor.
+};
+struct WorkerConfig
+{
+  int64 workerCount = 0; // 0 means one worker per placement slot. Workers beyond the available slots are unpinned.
+  WorkerPlacement placement = WorkerPlacement::PhysicalCores;
+  // A worker out of tasks spins for spinMicroseconds, then gives up its time slice yieldCount times and only then parks.
+  // Parked workers cost a kernel call to wake up, spinning ones burn CPU time.
+  int64 spinMicroseconds = 50;
+  int64 yieldCount = 8;
+};
+// Restarts the workers if the task system is running and the worker count or placement changed.
+// Main thread only, tasks mustn't be executing on workers then.
+void setWorkerConfig(const WorkerConfig& config);
+WorkerConfig getWorkerConfig();
+
+// Bucket 0 counts latencies under 1 us, bucket i latencies in [2^(i-1), 2^i) us and the last bucket everything longer.
+constexpr int64 taskLatencyBucketCount = 24;
+struct TaskLatencyHistogram
+{
+  int64 counts[taskLatencyBucketCount];
+  int64 totalMicroseconds;
+  int64 maxMicroseconds;
+};
+struct TaskFunctionTelemetry
+{
+  TaskFunction function; // nullptr for the entry collecting functions which didn't fit the telemetry table.
+  int64 executedCount;
+  TaskLatencyHistogram scheduleToStart; // From being queued, after the prerequisites completed.
+  TaskLatencyHistogram startToEnd;
+};
+struct TaskThreadTelemetry
+{
+  int64 executedTaskCount;
+  int64 busyMicroseconds;        // Executing tasks, including nested tasks executed while waiting inside a task.
+  int64 idleMicroseconds;        // Looking for tasks. Not tracked for the main thread.
+  int64 parkedMicroseconds;      // Sleeping until tasks are available. Not tracked for the main thread.
+  int64 localQueueHighWaterMark; // Deepest local queue lane. Not tracked for the main thread.
+};
+struct TaskTelemetry
+{
+  std::vector<TaskThreadTelemetry> workers;
+  TaskThreadTelemetry mainThread;
+  int64 globalQueueHighWaterMark;
+  std::vector<TaskFunctionTelemetry> functions; // Only functions which were executed since the last reset.
+};
+// Counters are always on. Mustn't be called while setWorkerConfig restarts the workers.
+TaskTelemetry getTaskTelemetry();
+void resetTaskTelemetry();
 
 class TaskSystemInitializer
 {
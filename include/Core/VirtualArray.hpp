@@ -0,0 +1,161 @@
+#pragma once
+
+#include <algorithm>
+#include <new>
+#include <utility>
+
+#include "Core/Core.hpp"
+#include "Core/Memory.hpp"
+
+// Array with address space for maxCount elements reserved up front. Memory is committed page by page as the array grows,
+// so elements never move, growing copies nothing and pointers to elements stay valid until the elements are removed.
+template<typename ElementType>
+class VirtualArray
+{
+public:
+
+  constexpr VirtualArray() = default;
+  explicit VirtualArray(int64 inMaxCount)
+  {
+    const int64 pageSize = getVirtualMemoryPageSize();
+    const int64 sizeToReserve = (inMaxCount * int64(sizeof(ElementType)) + pageSize - 1) / pageSize * pageSize;
+    elements = static_cast<ElementType*>(reserveVirtualMemory(sizeToReserve));
+    if (!elements)
+    {
+      logError("Failed to reserve %lld bytes for a virtual array.", sizeToReserve);
+      return;
+    }
+    maxCount = inMaxCount;
+    reservedSize = sizeToReserve;
+  }
+  VirtualArray(const VirtualArray& other) = delete;
+  VirtualArray(VirtualArray&& other) noexcept
+  {
+    swap(*this, other);
+  }
+  ~VirtualArray()
+  {
+    clear();
+    if (elements)
+    {
+      releaseVirtualMemory(elements, reservedSize);
+    }
+  }
+
+  VirtualArray& operator=(const VirtualArray& other) = delete;
+  VirtualArray& operator=(VirtualArray&& other) noexcept
+  {
+    swap(*this, other);
+    return *this;
+  }
+
+  friend void swap(VirtualArray& first, VirtualArray& second)
+  {
+    std::swap(first.elements, second.elements);
+    std::swap(first.count, second.count);
+    std::swap(first.maxCount, second.maxCount);
+    std::swap(first.committedSize, second.committedSize);
+    std::swap(first.reservedSize, second.reservedSize);
+  }
+
+  // Returns nullptr without constructing the element when the array is full.
+  template<typename... ArgumentTypes>
+  ElementType* tryEmplaceBack(ArgumentTypes&&... arguments)
+  {
+    if (!tryCommit(count + 1))
+    {
+      return nullptr;
+    }
+    ElementType* element = new (elements + count) ElementType(std::forward<ArgumentTypes>(arguments)...);
+    ++count;
+    return element;
+  }
+  void popBack()
+  {
+    assert(count > 0);
+    elements[--count].~ElementType();
+  }
+  // Default constructs added elements. Removing elements keeps their memory committed, see shrinkToFit.
+  // Returns false without changing the array when newCount doesn't fit.
+  bool tryResize(int64 newCount)
+  {
+    if (!tryCommit(newCount))
+    {
+      return false;
+    }
+    for (; count < newCount; ++count)
+    {
+      new (elements + count) ElementType();
+    }
+    while (count > newCount)
+    {
+      popBack();
+    }
+    return true;
+  }
+  void clear()
+  {
+    while (count > 0)
+    {
+      popBack();
+    }
+  }
+  // Decommits pages not used by the elements.
+  void shrinkToFit()
+  {
+    const int64 pageSize = getVirtualMemoryPageSize();
+    const int64 usedSize = (count * int64(sizeof(ElementType)) + pageSize - 1) / pageSize * pageSize;
+    if (usedSize < committedSize)
+    {
+      decommitVirtualMemory(reinterpret_cast<byte*>(elements) + usedSize, committedSize - usedSize);
+      committedSize = usedSize;
+    }
+  }
+
+  ElementType& operator[](int64 index) { assert(index >= 0 && index < count); return elements[index]; }
+  const ElementType& operator[](int64 index) const { assert(index >= 0 && index < count); return elements[index]; }
+
+  ElementType* begin() { return elements; }
+  ElementType* end() { return elements + count; }
+  const ElementType* begin() const { return elements; }
+  const ElementType* end() const { return elements + count; }
+
+  ElementType* getData() { return elements; }
+  int64 getCount() const { return count; }
+  int64 getMaxCount() const { return maxCount; }
+  bool isEmpty() const { return count == 0; }
+  int64 getCommittedSize() const { return committedSize; }
+
+private:
+
+  // Commits at least double of the committed memory at once, growing by a page at a time would mean a system call every few elements.
+  bool tryCommit(int64 requiredCount)
+  {
+    if (requiredCount > maxCount)
+    {
+      logError("Virtual array of at most %lld elements can't grow to %lld elements.", maxCount, requiredCount);
+      return false;
+    }
+    const int64 requiredSize = requiredCount * int64(sizeof(ElementType));
+    if (requiredSize <= committedSize)
+    {
+      return true;
+    }
+
+    const int64 pageSize = getVirtualMemoryPageSize();
+    const int64 newCommittedSize = std::min((std::max(requiredSize, 2 * committedSize) + pageSize - 1) / pageSize * pageSize, reservedSize);
+    if (!tryCommitVirtualMemory(reinterpret_cast<byte*>(elements) + committedSize, newCommittedSize - committedSize))
+    {
+      logError("Failed to commit %lld bytes for a virtual array.", newCommittedSize - committedSize);
+      return false;
+    }
+    committedSize = newCommittedSize;
+    return true;
+  }
+
+  ElementType* elements = nullptr;
+  int64 count = 0;
+  int64 maxCount = 0;
+  int64 committedSize = 0;
+  int64 reservedSize = 0;
+};
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Core/Core.hpp"
+#include "Core/FramePipeline.hpp"
 #include "Core/Math.hpp"
 
 #include <functional>
@@ -31,5 +32,7 @@ private:
 };
 
 void runGameLoop(std::function<void(int64 frameIndex, float timeDelta)> frameCallback);
+// Runs the frame stages through a FramePipeline, see FramePipeline.hpp. Frames in flight are submitted before returning.
+void runPipelinedGameLoop(FrameStages stages, int64 framesInFlight = 2);
 
 bool tryChooseFolderDialog(HWND window, const wchar_t* title, wchar_t* path);
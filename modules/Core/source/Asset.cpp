@@ -9,6 +9,7 @@
 #include "Core/String.hpp"
 #include "Core/Config.hpp"
 #include "Core/Math.hpp"
+#include "Core/VirtualArray.hpp"
 
 const char* toString(AssetType type)
 {
@@ -368,15 +369,20 @@ void defaultInitialiazeMetaProperties(const AssetMetaPropertyReflection* reflect
   }
 }
 
+// Only address space is reserved up front, the limits are far beyond any content tree.
+constexpr int64 maxAssetSubdirectoryCount = 1024 * 1024;
+constexpr int64 maxAssetFileCount = 1024 * 1024;
+
 class AssetDirectory
 {
 public:
 
   std::wstring name;
   std::wstring path;
-  std::vector<AssetDirectory> directories;
-  std::vector<std::wstring> assetFileNames;
-  std::vector<Asset*> assets; // Indices correspond to assetFileNames indices, is nullptr for not loaded assets.
+  // Never reallocated, so AssetDirectoryRefs and asset pointers stay valid while directories are added.
+  VirtualArray<AssetDirectory> directories{ maxAssetSubdirectoryCount };
+  VirtualArray<std::wstring> assetFileNames{ maxAssetFileCount };
+  VirtualArray<Asset*> assets{ maxAssetFileCount }; // Indices correspond to assetFileNames indices, is nullptr for not loaded assets.
 
   void loadAssetsIncludingSubdirectories()
   {
@@ -384,7 +390,7 @@ public:
 
     ensureTrue(isInMainThread());
 
-    for (int32 assetIndex = 0; assetIndex < assets.size(); assetIndex++)
+    for (int32 assetIndex = 0; assetIndex < assets.getCount(); assetIndex++)
     {
       Asset* asset = assets[assetIndex];
       asset->ref();
@@ -509,11 +515,16 @@ static bool tryTraverseDirectory(wchar_t* wildcardPathBuffer, int64 wildcardPath
       swprintf(wildcardPathBuffer + wildcardPathLength - 1, MAX_PATH, L"%s\\*", findData->cFileName);
       const int64 subdirectoryWildcardPathLength = wildcardPathLength + wcslen(findData->cFileName) + 1;
 
-      AssetDirectory& directory = parentDirectory->directories.emplace_back();
-      directory.name = findData->cFileName;
-      directory.path = std::wstring(wildcardPathBuffer, wildcardPathBuffer + subdirectoryWildcardPathLength - 2);
+      AssetDirectory* directory = parentDirectory->directories.tryEmplaceBack();
+      if (!directory)
+      {
+        logError("Skipping asset directory %S, its parent has too many subdirectories.", findData->cFileName);
+        continue;
+      }
+      directory->name = findData->cFileName;
+      directory->path = std::wstring(wildcardPathBuffer, wildcardPathBuffer + subdirectoryWildcardPathLength - 2);
 
-      tryTraverseDirectory(wildcardPathBuffer, subdirectoryWildcardPathLength, &directory, findData);
+      tryTraverseDirectory(wildcardPathBuffer, subdirectoryWildcardPathLength, directory, findData);
     }
     else
     {
@@ -554,7 +565,7 @@ static bool tryTraverseDirectory(wchar_t* wildcardPathBuffer, int64 wildcardPath
       ensure(tryReadEntireFile(metaFilePath, assetMetaFileData));
       // Used for second parse as the parse changes the data.
       // TODO: do custom non-intrusive parsing for the assetType to avoid doing this copy.
-      std::vector<byte> assetMetaFileDataCopy = assetMetaFileData;
+      std::vector<byte, TaggedAllocator<byte, MemoryTag::Config>> assetMetaFileDataCopy{ assetMetaFileData.begin(), assetMetaFileData.end() };
 
       swprintf(metaFilePathExtension, MAX_PATH - pathLength - fileNameLength, L"%s", fileExtension);
       
@@ -562,7 +573,12 @@ static bool tryTraverseDirectory(wchar_t* wildcardPathBuffer, int64 wildcardPath
       wchar_t* assetPath = new wchar_t[metaFilePathLength + 1];
       swprintf(assetPath, metaFilePathLength + 1, L"%s", metaFilePath);
 
-      parentDirectory->assetFileNames.emplace_back(findData->cFileName);
+      if (!parentDirectory->assetFileNames.tryEmplaceBack(findData->cFileName))
+      {
+        logError("Skipping asset %S, its directory has too many assets.", assetPath);
+        delete[] assetPath;
+        continue;
+      }
 
       AssetType assetType = AssetType::Unknown;
       char* assetMetaData = reinterpret_cast<char*>(assetMetaFileData.data());
@@ -591,8 +607,15 @@ static bool tryTraverseDirectory(wchar_t* wildcardPathBuffer, int64 wildcardPath
         #define ASSET_TYPE_CONSTRUCT(name) \
           case AssetType::name: { \
             TRACE_SCOPE("allocate " #name); \
-            name* asset = (name*) malloc(sizeof(name)); \
-            parentDirectory->assets.emplace_back(asset); \
+            name* asset = (name*) allocateMemory(sizeof(name), MemoryTag::Asset, alignof(name)); \
+            if (!parentDirectory->assets.tryEmplaceBack(asset)) \
+            { \
+              logError("Skipping asset %S, its directory has too many assets.", assetPath); \
+              freeMemory(asset); \
+              delete[] assetPath; \
+              parentDirectory->assetFileNames.popBack(); \
+              continue; \
+            } \
             assetBase = asset; \
             assetBase->path = assetPath; \
             assetBase->assetType = assetType; \
@@ -755,7 +778,7 @@ Asset* internalFindAsset(AssetDirectory* directory, const wchar_t* path)
   // Length can be without the file extension.
   const int64 fileNameLength = lengthUntilFirstSlash;
   const wchar_t* fileName = subPath;
-  for (uint64 assetIndex = 0; assetIndex < lastDirectory->assetFileNames.size(); ++assetIndex)
+  for (int64 assetIndex = 0; assetIndex < lastDirectory->assetFileNames.getCount(); ++assetIndex)
   {
     const std::wstring assetFileName = lastDirectory->assetFileNames[assetIndex];
 
@@ -776,7 +799,7 @@ Asset* internalFindAsset(AssetDirectory* directory, const wchar_t* path)
 
 void Config::initialize(const byte* fileData, int64 fileDataLength)
 {
-  std::vector<char> fileDataCopy;
+  std::vector<char, TaggedAllocator<char, MemoryTag::Config>> fileDataCopy;
   fileDataCopy.insert(fileDataCopy.begin(), fileData, fileData + fileDataLength);
   tryParseConfig(fileDataCopy.data(), fileDataLength, [this](const ConfigKeyValueNode& node) -> bool {
     std::string value{node.value, static_cast<uint64>(node.valueLength)};
@@ -985,9 +1008,13 @@ void StaticMesh::initialize(const byte* fileData, int64 fileDataLength)
     }
   };
 
-  std::vector<Vec3f> positions;
-  std::vector<Vec2f> textureCoordinates;
-  std::vector<uint32> indices;
+  // The parsed data is needed only until the buffers are created.
+  ScratchArena& scratchArena = getThreadScratchArena();
+  ScratchArenaScope scratchArenaScope{ scratchArena };
+  ScratchArenaResource scratchArenaResource{ scratchArena };
+  std::pmr::vector<Vec3f> positions{ &scratchArenaResource };
+  std::pmr::vector<Vec2f> textureCoordinates{ &scratchArenaResource };
+  std::pmr::vector<uint32> indices{ &scratchArenaResource };
   {
     TRACE_SCOPE("reserveBufferMemory");
     // TODO: get the reserve size from a vertexCount meta property
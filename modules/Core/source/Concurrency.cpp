@@ -1,5 +1,279 @@
-#define DAR_MODULE "Concurrency"
-
-#include "Core/Concurrency.hpp"
-
-thread_local ThreadType threadType = ThreadType::Unknown;
+#define DAR_MODULE_NAME "Concurrency"
+
+#include "Core/Concurrency.hpp"
+
+#include <algorithm>
+
+#if !PLATFORM_WINDOWS
+  #include <sched.h>
+#endif
+
+thread_local ThreadType threadType = ThreadType::Unknown;
+
+static void sortAndCountCpuTopology(CpuTopology& topology)
+{
+  std::sort(topology.logicalProcessors.begin(), topology.logicalProcessors.end(), [](const CpuTopology::LogicalProcessor& left, const CpuTopology::LogicalProcessor& right)
+  {
+    if (left.cacheDomainIndex != right.cacheDomainIndex)
+    {
+      return left.cacheDomainIndex < right.cacheDomainIndex;
+    }
+    if (left.coreIndex != right.coreIndex)
+    {
+      return left.coreIndex < right.coreIndex;
+    }
+    return left.id < right.id;
+  });
+
+  // Logical processors outside the process affinity were removed, number the remaining cores and cache domains densely.
+  topology.coreCount = 0;
+  topology.cacheDomainCount = 0;
+  int32 previousCoreIndex = -1;
+  int32 previousCacheDomainIndex = -1;
+  for (CpuTopology::LogicalProcessor& logicalProcessor : topology.logicalProcessors)
+  {
+    if (logicalProcessor.cacheDomainIndex != previousCacheDomainIndex)
+    {
+      previousCacheDomainIndex = logicalProcessor.cacheDomainIndex;
+      previousCoreIndex = -1;
+      ++topology.cacheDomainCount;
+    }
+    if (logicalProcessor.coreIndex != previousCoreIndex)
+    {
+      previousCoreIndex = logicalProcessor.coreIndex;
+      ++topology.coreCount;
+    }
+    logicalProcessor.cacheDomainIndex = topology.cacheDomainCount - 1;
+    logicalProcessor.coreIndex = topology.coreCount - 1;
+  }
+}
+
+#if PLATFORM_WINDOWS
+
+bool tryDetectCpuTopology(CpuTopology& outTopology)
+{
+  TRACE_SCOPE();
+
+  outTopology = {};
+
+  DWORD bufferLength = 0;
+  GetLogicalProcessorInformationEx(RelationAll, nullptr, &bufferLength);
+  if (GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+  {
+    logError("GetLogicalProcessorInformationEx failed to report buffer length.");
+    return false;
+  }
+  std::vector<byte> buffer(bufferLength);
+  if (!GetLogicalProcessorInformationEx(RelationAll, reinterpret_cast<SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(buffer.data()), &bufferLength))
+  {
+    logError("GetLogicalProcessorInformationEx failed.");
+    return false;
+  }
+
+  std::vector<GROUP_AFFINITY> cacheDomains;
+  for (DWORD offset = 0; offset < bufferLength;)
+  {
+    const SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX& information = *reinterpret_cast<SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(buffer.data() + offset);
+    offset += information.Size;
+
+    if (information.Relationship == RelationProcessorCore)
+    {
+      const int32 coreIndex = outTopology.coreCount++;
+      for (WORD groupIndex = 0; groupIndex < information.Processor.GroupCount; ++groupIndex)
+      {
+        const GROUP_AFFINITY& groupMask = information.Processor.GroupMask[groupIndex];
+        for (int32 number = 0; number < 64; ++number)
+        {
+          if (groupMask.Mask & (KAFFINITY(1) << number))
+          {
+            outTopology.logicalProcessors.push_back({ int32(groupMask.Group) * 64 + number, coreIndex, -1 });
+          }
+        }
+      }
+    }
+    else if (information.Relationship == RelationCache && information.Cache.Level == 3)
+    {
+      cacheDomains.push_back(information.Cache.GroupMask);
+    }
+  }
+
+  // The process affinity mask applies to the one group the process runs in, which isn't necessarily group 0.
+  USHORT processGroupCount = 1;
+  USHORT processGroup = 0;
+  DWORD_PTR processAffinityMask;
+  DWORD_PTR systemAffinityMask;
+  const bool isProcessInSingleGroup = GetProcessGroupAffinity(GetCurrentProcess(), &processGroupCount, &processGroup) && processGroupCount == 1
+    && GetProcessAffinityMask(GetCurrentProcess(), &processAffinityMask, &systemAffinityMask) && processAffinityMask != 0;
+  for (CpuTopology::LogicalProcessor& logicalProcessor : outTopology.logicalProcessors)
+  {
+    logicalProcessor.cacheDomainIndex = 0; // Without L3 all logical processors are in one domain.
+    for (int32 cacheDomainIndex = 0; cacheDomainIndex < int32(cacheDomains.size()); ++cacheDomainIndex)
+    {
+      const GROUP_AFFINITY& cacheDomain = cacheDomains[cacheDomainIndex];
+      if (cacheDomain.Group == logicalProcessor.id / 64 && (cacheDomain.Mask & (KAFFINITY(1) << (logicalProcessor.id % 64))))
+      {
+        logicalProcessor.cacheDomainIndex = cacheDomainIndex;
+        break;
+      }
+    }
+  }
+  if (isProcessInSingleGroup)
+  {
+    std::erase_if(outTopology.logicalProcessors, [processAffinityMask, processGroup](const CpuTopology::LogicalProcessor& logicalProcessor)
+    {
+      const int32 number = logicalProcessor.id - int32(processGroup) * 64;
+      return number < 0 || number >= 64 || !(processAffinityMask & (DWORD_PTR(1) << number));
+    });
+  }
+
+  sortAndCountCpuTopology(outTopology);
+  return !outTopology.logicalProcessors.empty();
+}
+int32 getCurrentLogicalProcessorId()
+{
+  PROCESSOR_NUMBER processorNumber;
+  GetCurrentProcessorNumberEx(&processorNumber);
+  return int32(processorNumber.Group) * 64 + processorNumber.Number;
+}
+bool trySetCurrentThreadAffinity(const int32* logicalProcessorIds, int64 logicalProcessorCount)
+{
+  ensureTrue(logicalProcessorCount > 0, false);
+
+  GROUP_AFFINITY affinity = {};
+  affinity.Group = WORD(logicalProcessorIds[0] / 64);
+  for (int64 i = 0; i < logicalProcessorCount; ++i)
+  {
+    ensureTrue(logicalProcessorIds[i] / 64 == affinity.Group, false);
+    affinity.Mask |= KAFFINITY(1) << (logicalProcessorIds[i] % 64);
+  }
+
+  return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr);
+}
+void resetCurrentThreadAffinity()
+{
+  DWORD_PTR processAffinityMask;
+  DWORD_PTR systemAffinityMask;
+  if (GetProcessAffinityMask(GetCurrentProcess(), &processAffinityMask, &systemAffinityMask) && processAffinityMask != 0)
+  {
+    SetThreadAffinityMask(GetCurrentThread(), processAffinityMask);
+  }
+}
+
+#else
+
+static bool tryReadCpuValue(int32 cpu, const char* relativePath, int32& outValue)
+{
+  char path[256];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/%s", cpu, relativePath);
+  FILE* file = fopen(path, "r");
+  if (!file)
+  {
+    return false;
+  }
+  const bool wasRead = fscanf(file, "%d", &outValue) == 1;
+  fclose(file);
+  return wasRead;
+}
+static cpu_set_t processAffinity;
+static bool isProcessAffinityInitialized = false;
+bool tryDetectCpuTopology(CpuTopology& outTopology)
+{
+  TRACE_SCOPE();
+
+  outTopology = {};
+
+  cpu_set_t allowedCpus;
+  if (sched_getaffinity(0, sizeof(allowedCpus), &allowedCpus) != 0)
+  {
+    logError("sched_getaffinity failed.");
+    return false;
+  }
+  if (!isProcessAffinityInitialized)
+  {
+    processAffinity = allowedCpus;
+    isProcessAffinityInitialized = true;
+  }
+
+  // Cores are identified by package and core id, cache domains by the L3 (or L2 when there is no L3) cache id.
+  std::vector<std::pair<int32, int32>> coreKeys;
+  std::vector<int32> cacheKeys;
+  for (int32 cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+  {
+    if (!CPU_ISSET(cpu, &allowedCpus))
+    {
+      continue;
+    }
+
+    int32 packageId = 0;
+    int32 coreId = cpu;
+    int32 cacheId = 0;
+    tryReadCpuValue(cpu, "topology/physical_package_id", packageId);
+    tryReadCpuValue(cpu, "topology/core_id", coreId);
+    if (!tryReadCpuValue(cpu, "cache/index3/id", cacheId))
+    {
+      tryReadCpuValue(cpu, "cache/index2/id", cacheId);
+    }
+
+    const std::pair<int32, int32> coreKey{ packageId, coreId };
+    auto coreIterator = std::find(coreKeys.begin(), coreKeys.end(), coreKey);
+    if (coreIterator == coreKeys.end())
+    {
+      coreIterator = coreKeys.insert(coreKeys.end(), coreKey);
+    }
+    const int32 cacheKey = packageId * 65536 + cacheId;
+    auto cacheIterator = std::find(cacheKeys.begin(), cacheKeys.end(), cacheKey);
+    if (cacheIterator == cacheKeys.end())
+    {
+      cacheIterator = cacheKeys.insert(cacheKeys.end(), cacheKey);
+    }
+
+    outTopology.logicalProcessors.push_back({ cpu, int32(coreIterator - coreKeys.begin()), int32(cacheIterator - cacheKeys.begin()) });
+  }
+
+  sortAndCountCpuTopology(outTopology);
+  return !outTopology.logicalProcessors.empty();
+}
+int32 getCurrentLogicalProcessorId()
+{
+  return sched_getcpu();
+}
+bool trySetCurrentThreadAffinity(const int32* logicalProcessorIds, int64 logicalProcessorCount)
+{
+  ensureTrue(logicalProcessorCount > 0, false);
+
+  cpu_set_t affinity;
+  CPU_ZERO(&affinity);
+  for (int64 i = 0; i < logicalProcessorCount; ++i)
+  {
+    CPU_SET(logicalProcessorIds[i], &affinity);
+  }
+
+  return sched_setaffinity(0, sizeof(affinity), &affinity) == 0;
+}
+void resetCurrentThreadAffinity()
+{
+  if (isProcessAffinityInitialized)
+  {
+    sched_setaffinity(0, sizeof(processAffinity), &processAffinity);
+  }
+}
+
+#endif
+
+void logCpuTopology(const CpuTopology& topology)
+{
+  logInfo("CPU topology: %lld logical processors, %d physical cores, %d cache domains.", int64(topology.logicalProcessors.size()), topology.coreCount, topology.cacheDomainCount);
+  for (int32 cacheDomainIndex = 0; cacheDomainIndex < topology.cacheDomainCount; ++cacheDomainIndex)
+  {
+    char logicalProcessorList[512] = {};
+    int64 length = 0;
+    for (const CpuTopology::LogicalProcessor& logicalProcessor : topology.logicalProcessors)
+    {
+      if (logicalProcessor.cacheDomainIndex == cacheDomainIndex && length < int64(sizeof(logicalProcessorList)) - 16)
+      {
+        length += snprintf(logicalProcessorList + length, sizeof(logicalProcessorList) - length, " %d(core %d)", logicalProcessor.id, logicalProcessor.coreIndex);
+      }
+    }
+    logInfo("  Cache domain %d:%s", cacheDomainIndex, logicalProcessorList);
+  }
+}
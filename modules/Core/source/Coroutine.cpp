@@ -0,0 +1,66 @@
+#define DAR_MODULE_NAME "Coroutine"
+
+#include "Core/Coroutine.hpp"
+
+template<int64 blockSize>
+struct alignas(__STDCPP_DEFAULT_NEW_ALIGNMENT__) CoroutineFrameBlock
+{
+  byte data[blockSize];
+};
+static ThreadSafePoolAllocator<CoroutineFrameBlock<256>, 256, MemoryTag::Task> smallCoroutineFrameAllocator;
+static ThreadSafePoolAllocator<CoroutineFrameBlock<1024>, 128, MemoryTag::Task> mediumCoroutineFrameAllocator;
+static ThreadSafePoolAllocator<CoroutineFrameBlock<4096>, 32, MemoryTag::Task> largeCoroutineFrameAllocator;
+
+void* allocateCoroutineFrame(std::size_t size)
+{
+  if (size <= sizeof(CoroutineFrameBlock<256>))
+  {
+    return smallCoroutineFrameAllocator.allocate();
+  }
+  if (size <= sizeof(CoroutineFrameBlock<1024>))
+  {
+    return mediumCoroutineFrameAllocator.allocate();
+  }
+  if (size <= sizeof(CoroutineFrameBlock<4096>))
+  {
+    return largeCoroutineFrameAllocator.allocate();
+  }
+
+  logWarning("Coroutine frame of size %zu doesn't fit any pool.", size);
+  return allocateMemory(int64(size), MemoryTag::Task);
+}
+void deallocateCoroutineFrame(void* frame, std::size_t size)
+{
+  if (size <= sizeof(CoroutineFrameBlock<256>))
+  {
+    smallCoroutineFrameAllocator.deallocate(static_cast<CoroutineFrameBlock<256>*>(frame));
+  }
+  else if (size <= sizeof(CoroutineFrameBlock<1024>))
+  {
+    mediumCoroutineFrameAllocator.deallocate(static_cast<CoroutineFrameBlock<1024>*>(frame));
+  }
+  else if (size <= sizeof(CoroutineFrameBlock<4096>))
+  {
+    largeCoroutineFrameAllocator.deallocate(static_cast<CoroutineFrameBlock<4096>*>(frame));
+  }
+  else
+  {
+    freeMemory(frame);
+  }
+}
+
+static void resumeCoroutineTask(void* coroutineAddress, const TaskThreadContext& threadContext)
+{
+  std::coroutine_handle<>::from_address(coroutineAddress).resume();
+}
+void scheduleCoroutineResume(std::coroutine_handle<> coroutine, ThreadType desiredThread, TaskPriority priority, Ref<TaskEvent>* prerequisite)
+{
+  if (prerequisite)
+  {
+    schedule(&resumeCoroutineTask, coroutine.address(), desiredThread, prerequisite, 1, priority);
+  }
+  else
+  {
+    schedule(&resumeCoroutineTask, coroutine.address(), desiredThread, priority);
+  }
+}
\ No newline at end of file
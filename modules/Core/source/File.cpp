@@ -178,19 +178,13 @@ ReadFileAsync::Buffer::Buffer(Buffer&& other)
 }
 ReadFileAsync::Buffer::~Buffer()
 {
-  if(data)
-  {
-    free(data);
-    data = nullptr;
-  }
+  freeMemory(data);
+  data = nullptr;
 }
 void ReadFileAsync::Buffer::initialize(int64 inSize)
 {
-  if(data)
-  {
-    free(data);
-  }
-  data = (byte*)malloc(inSize);
+  freeMemory(data);
+  data = static_cast<byte*>(allocateMemory(inSize, MemoryTag::File));
   size = inSize;
 }
 Ref<ReadFileAsync> ReadFileAsync::create()
@@ -0,0 +1,74 @@
+#define DAR_MODULE_NAME "FramePipeline"
+
+#include "Core/FramePipeline.hpp"
+
+#include <algorithm>
+
+FramePipeline::FramePipeline(FrameStages inStages, int64 inFramesInFlight)
+  : stages(std::move(inStages))
+  , framesInFlight(std::clamp(inFramesInFlight, int64(1), maxFramesInFlight))
+{
+  assert(stages.simulate && stages.prepareRender && stages.submit);
+  if (framesInFlight != inFramesInFlight)
+  {
+    logWarning("%lld frames in flight requested, using %lld.", inFramesInFlight, framesInFlight);
+  }
+}
+FramePipeline::~FramePipeline()
+{
+  flush();
+}
+void FramePipeline::beginFrame(float timeDelta)
+{
+  TRACE_SCOPE();
+
+  const int64 frameIndex = nextFrameIndex++;
+
+  Ref<TaskEvent> simulateEvent = schedule([this, frameIndex, timeDelta](const TaskThreadContext&)
+  {
+    TRACE_SCOPE("simulateFrame");
+    stages.simulate(frameIndex, timeDelta);
+  }, ThreadType::Worker, lastSimulateEvent.isValid() ? &lastSimulateEvent : nullptr, lastSimulateEvent.isValid() ? 1 : 0, TaskPriority::Critical);
+
+  Ref<TaskEvent> prepareRenderPrerequisites[2] = { simulateEvent };
+  int32 prepareRenderPrerequisiteCount = 1;
+  Ref<TaskEvent>& previousPrepareRenderEvent = prepareRenderEvents[(frameIndex + maxFramesInFlight - 1) % maxFramesInFlight];
+  if (previousPrepareRenderEvent.isValid())
+  {
+    prepareRenderPrerequisites[prepareRenderPrerequisiteCount++] = previousPrepareRenderEvent;
+  }
+  prepareRenderEvents[frameIndex % maxFramesInFlight] = schedule([this, frameIndex](const TaskThreadContext&)
+  {
+    TRACE_SCOPE("prepareRenderFrame");
+    stages.prepareRender(frameIndex);
+  }, ThreadType::Worker, prepareRenderPrerequisites, prepareRenderPrerequisiteCount, TaskPriority::Critical);
+
+  lastSimulateEvent = std::move(simulateEvent);
+
+  while (nextFrameIndex - nextSubmitFrameIndex >= framesInFlight)
+  {
+    submitOldestFrame();
+  }
+}
+void FramePipeline::flush()
+{
+  TRACE_SCOPE();
+
+  while (nextSubmitFrameIndex < nextFrameIndex)
+  {
+    submitOldestFrame();
+  }
+}
+void FramePipeline::submitOldestFrame()
+{
+  const int64 frameIndex = nextSubmitFrameIndex++;
+  Ref<TaskEvent>& prepareRenderEvent = prepareRenderEvents[frameIndex % maxFramesInFlight];
+  {
+    TRACE_SCOPE("waitForPrepareRenderFrame");
+    prepareRenderEvent->waitForCompletion();
+  }
+  {
+    TRACE_SCOPE("submitFrame");
+    stages.submit(frameIndex);
+  }
+}
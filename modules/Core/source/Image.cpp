@@ -2,6 +2,7 @@
 
 #include "Core/Core.hpp"
 #include "Core/Math.hpp"
+#include "Core/Memory.hpp"
 #include "Core/File.hpp"
 #include "Core/String.hpp"
 
@@ -76,10 +77,7 @@ Image::Image(Image&& other) noexcept
 
 Image::~Image()
 {
-  if (data)
-  {
-    free(data);
-  }
+  freeMemory(data);
 }
 
 Image& Image::operator=(Image&& other) noexcept
@@ -151,7 +149,7 @@ Image ImageEncoder::ToBC1Parallel(const Image& source, int64 quality)
   destinationTexture.dwPitch = source.width;
   destinationTexture.format = CMP_FORMAT_BC1;
   destinationTexture.dwDataSize = CMP_CalculateBufferSize(&destinationTexture);
-  destinationTexture.pData = (CMP_BYTE*)malloc(destinationTexture.dwDataSize);
+  destinationTexture.pData = static_cast<CMP_BYTE*>(allocateMemory(destinationTexture.dwDataSize, MemoryTag::Image));
 
   CMP_CompressOptions options{};
   options.dwSize = sizeof(options);
@@ -160,6 +158,7 @@ Image ImageEncoder::ToBC1Parallel(const Image& source, int64 quality)
 
   if (CMP_ConvertTexture(&sourceTexture, &destinationTexture, &options, nullptr) != CMP_OK)
   {
+    freeMemory(destinationTexture.pData);
     return Image{};
   }
   
@@ -365,7 +364,7 @@ Image JpegReader::read(const byte* jpegData, int64 jpegDataSize, PixelFormat out
 
   Image image;
   const int64 dataSize = (width * height * toPixelSizeInBits(outputPixelFormat)) / 8;
-  image.data = static_cast<byte*>(malloc(dataSize));
+  image.data = static_cast<byte*>(allocateMemory(dataSize, MemoryTag::Image));
   image.width = width;
   image.height = height;
   image.pixelFormat = outputPixelFormat;
@@ -449,7 +448,7 @@ Image WebpReader::read(const byte* data, int64 dataSize, PixelFormat outputPixel
   int outputStride = (width * toPixelSizeInBits(outputPixelFormat)) / 8;
 
   Image image;
-  image.data = (byte*)malloc(height * outputStride);
+  image.data = static_cast<byte*>(allocateMemory(height * outputStride, MemoryTag::Image));
   image.width = width;
   image.height = height;
   image.pixelFormat = outputPixelFormat;
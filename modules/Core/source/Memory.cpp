@@ -2,6 +2,15 @@
 
 #include "Core/Memory.hpp"
 #include "Core/Math.hpp"
+#include "Core/Task.hpp"
+
+#include <bit>
+#include <vector>
+
+#if !PLATFORM_WINDOWS
+  #include <sys/mman.h>
+  #include <unistd.h>
+#endif
 
 void* alignedMalloc(std::size_t alignment, std::size_t size)
 {
@@ -21,4 +30,824 @@ void alignedFree(void* pointer)
     return;
   }
   free(reinterpret_cast<void*>(*(reinterpret_cast<uintptr_t*>(pointer) - 1)));
+}
+
+static_assert(poolMagazineCount == 64, "Magazine ownership is tracked in a 64 bit mask.");
+static std::atomic<uint64> ownedPoolMagazines = 0;
+struct PoolMagazineOwnership
+{
+  PoolMagazineOwnership()
+  {
+    uint64 lastOwnedPoolMagazines = ownedPoolMagazines.load(std::memory_order_relaxed);
+    while (lastOwnedPoolMagazines != ~uint64(0))
+    {
+      const int64 freeIndex = std::countr_one(lastOwnedPoolMagazines);
+      if (ownedPoolMagazines.compare_exchange_weak(lastOwnedPoolMagazines, lastOwnedPoolMagazines | (uint64(1) << freeIndex), std::memory_order_acquire))
+      {
+        index = freeIndex;
+        return;
+      }
+    }
+  }
+  ~PoolMagazineOwnership()
+  {
+    if (index >= 0)
+    {
+      ownedPoolMagazines.fetch_and(~(uint64(1) << index), std::memory_order_release);
+    }
+  }
+
+  int64 index = -1;
+};
+int64 getPoolMagazineIndex()
+{
+  thread_local PoolMagazineOwnership ownership;
+  return ownership.index;
+}
+
+int64 getVirtualMemoryPageSize()
+{
+  static const int64 pageSize = []() -> int64 {
+#if PLATFORM_WINDOWS
+    SYSTEM_INFO systemInfo;
+    GetSystemInfo(&systemInfo);
+    return systemInfo.dwPageSize;
+#else
+    return sysconf(_SC_PAGESIZE);
+#endif
+  }();
+  return pageSize;
+}
+void* reserveVirtualMemory(int64 size)
+{
+#if PLATFORM_WINDOWS
+  return VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_NOACCESS);
+#else
+  void* address = mmap(nullptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return address != MAP_FAILED ? address : nullptr;
+#endif
+}
+bool tryCommitVirtualMemory(void* address, int64 size)
+{
+#if PLATFORM_WINDOWS
+  return VirtualAlloc(address, size, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+#else
+  return mprotect(address, size, PROT_READ | PROT_WRITE) == 0;
+#endif
+}
+void decommitVirtualMemory(void* address, int64 size)
+{
+#if PLATFORM_WINDOWS
+  VirtualFree(address, size, MEM_DECOMMIT);
+#else
+  madvise(address, size, MADV_DONTNEED);
+  mprotect(address, size, PROT_NONE);
+#endif
+}
+void releaseVirtualMemory(void* address, int64 size)
+{
+#if PLATFORM_WINDOWS
+  VirtualFree(address, 0, MEM_RELEASE);
+#else
+  munmap(address, size);
+#endif
+}
+
+// Size classes go by 16 bytes up to 128 bytes, then by four steps per power of two up to 8 KB.
+constexpr int64 maxSmallSize = 8 * 1024;
+constexpr int64 smallClassCount = 32;
+static constexpr int64 getSmallClassIndex(int64 size)
+{
+  if (size <= 128)
+  {
+    return (size - 1) / 16;
+  }
+  const int64 exponent = std::bit_width(uint64(size - 1));
+  const int64 base = int64(1) << (exponent - 1);
+  return 8 + (exponent - 8) * 4 + (size - 1 - base) / (base / 4);
+}
+static constexpr int64 getSmallClassSize(int64 classIndex)
+{
+  if (classIndex < 8)
+  {
+    return (classIndex + 1) * 16;
+  }
+  const int64 base = int64(128) << ((classIndex - 8) / 4);
+  return base + ((classIndex - 8) % 4 + 1) * (base / 4);
+}
+static_assert(getSmallClassIndex(maxSmallSize) == smallClassCount - 1 && getSmallClassSize(smallClassCount - 1) == maxSmallSize);
+static_assert(getSmallClassIndex(129) == 8 && getSmallClassSize(8) == 160);
+
+// All engine allocations live in one reserved arena of 64 KB pages. A byte per page tells whether the page belongs to the large heap
+// or to which size class, so freeing needs nothing stored next to the allocation. Memory tags of small objects are kept in a table
+// with a byte per 16 bytes of the arena, committed along with the small pages, large blocks keep theirs in the block header.
+class EngineAllocator
+{
+public:
+
+  EngineAllocator()
+  {
+    byte* reservation = static_cast<byte*>(reserveVirtualMemory(arenaSize + pageSize));
+    if (!reservation)
+    {
+      logError("Failed to reserve %lld bytes for the engine allocator.", arenaSize);
+      return;
+    }
+    arenaBegin = reinterpret_cast<byte*>((uintptr_t(reservation) + pageSize - 1) & ~uintptr_t(pageSize - 1));
+    pageKinds = reinterpret_cast<uint8*>(arenaBegin);
+    nextPageIndex = pageKindsPageCount;
+    if (!tryCommitVirtualMemory(pageKinds, pageKindsPageCount * pageSize))
+    {
+      logError("Failed to commit the engine allocator page table.");
+      arenaBegin = nullptr;
+      return;
+    }
+    committedSize = pageKindsPageCount * pageSize;
+    smallObjectTags = static_cast<uint8*>(reserveVirtualMemory(arenaSize / smallObjectTagGranularity));
+    if (!smallObjectTags)
+    {
+      logError("Failed to reserve the engine allocator memory tag table.");
+      arenaBegin = nullptr;
+      return;
+    }
+    for (int64 classIndex = 0; classIndex < smallClassCount; ++classIndex)
+    {
+      smallClasses[classIndex].size = getSmallClassSize(classIndex);
+    }
+  }
+  EngineAllocator(const EngineAllocator& other) = delete;
+  EngineAllocator(EngineAllocator&& other) = delete;
+
+  void* allocate(int64 size, int64 alignment, MemoryTag tag)
+  {
+    assert(std::has_single_bit(uint64(alignment)));
+    if (!arenaBegin)
+    {
+      return nullptr;
+    }
+
+    size = std::max(size, int64(1));
+    alignment = std::max(alignment, defaultAllocationAlignment);
+    if (size <= maxSmallSize && alignment <= maxSmallSize)
+    {
+      int64 classIndex = getSmallClassIndex(std::max(size, alignment));
+      while (smallClasses[classIndex].size % alignment != 0)
+      {
+        ++classIndex;
+      }
+      void* object = allocateSmall(smallClasses[classIndex]);
+      if (object)
+      {
+        smallObjectTags[(static_cast<byte*>(object) - arenaBegin) / smallObjectTagGranularity] = uint8(tag);
+      }
+      return object;
+    }
+
+    return allocateLarge(size, alignment, tag);
+  }
+  void free(void* pointer)
+  {
+    const uint8 pageKind = getPageKind(pointer);
+    if (pageKind >= pageKindSmall)
+    {
+      smallClasses[pageKind - pageKindSmall].freeList.push(pointer);
+    }
+    else if (pageKind == pageKindLarge)
+    {
+      freeLarge(reinterpret_cast<LargeBlock*>(static_cast<byte*>(pointer) - largeBlockHeaderSize));
+    }
+    else
+    {
+      logError("Tried to free %p, which wasn't allocated by the engine allocator.", pointer);
+    }
+  }
+  int64 getSize(const void* pointer) const
+  {
+    const uint8 pageKind = getPageKind(pointer);
+    if (pageKind >= pageKindSmall)
+    {
+      return smallClasses[pageKind - pageKindSmall].size;
+    }
+    else if (pageKind == pageKindLarge)
+    {
+      return reinterpret_cast<const LargeBlock*>(static_cast<const byte*>(pointer) - largeBlockHeaderSize)->getSize() - largeBlockHeaderSize;
+    }
+    logError("Tried to get size of %p, which wasn't allocated by the engine allocator.", pointer);
+    return 0;
+  }
+  MemoryTag getTag(const void* pointer) const
+  {
+    const uint8 pageKind = getPageKind(pointer);
+    if (pageKind >= pageKindSmall)
+    {
+      return MemoryTag(smallObjectTags[(static_cast<const byte*>(pointer) - arenaBegin) / smallObjectTagGranularity]);
+    }
+    else if (pageKind == pageKindLarge)
+    {
+      return reinterpret_cast<const LargeBlock*>(static_cast<const byte*>(pointer) - largeBlockHeaderSize)->getTag();
+    }
+    logError("Tried to get tag of %p, which wasn't allocated by the engine allocator.", pointer);
+    return MemoryTag::Untagged;
+  }
+  MemoryAllocatorStats getStats()
+  {
+    MemoryAllocatorStats stats{};
+    stats.committedSize = committedSize.load(std::memory_order_relaxed);
+    stats.smallPageCount = smallPageCount.load(std::memory_order_relaxed);
+    for (const SmallClass& smallClass : smallClasses)
+    {
+      stats.smallObjectCount += smallClass.freeList.getTotalCount() - smallClass.freeList.getFreeCount();
+    }
+
+    std::scoped_lock lock(largeMutex);
+    stats.largeAllocatedSize = largeAllocatedSize;
+    stats.largeFreeSize = largeFreeSize;
+    if (firstLevelBitmap)
+    {
+      const int64 firstLevel = std::bit_width(firstLevelBitmap) - 1;
+      const int64 secondLevel = std::bit_width(secondLevelBitmaps[firstLevel]) - 1;
+      for (LargeBlock* block = freeLargeBlocks[firstLevel][secondLevel]; block; block = block->nextFree)
+      {
+        stats.largestLargeFreeBlockSize = std::max(stats.largestLargeFreeBlockSize, block->getSize() - largeBlockHeaderSize);
+      }
+    }
+    return stats;
+  }
+
+private:
+
+  static constexpr int64 pageSize = 64 * 1024;
+  static constexpr int64 arenaSize = 64ll * 1024 * 1024 * 1024;
+  static constexpr int64 pageCount = arenaSize / pageSize;
+  static constexpr int64 pageKindsPageCount = pageCount / pageSize;
+  static constexpr uint8 pageKindUnused = 0;
+  static constexpr uint8 pageKindLarge = 1;
+  static constexpr uint8 pageKindSmall = 2;
+  static constexpr int64 smallObjectTagGranularity = 16; // The smallest size class, no two objects share a tag.
+
+  uint8 getPageKind(const void* pointer) const
+  {
+    const uintptr_t offset = uintptr_t(pointer) - uintptr_t(arenaBegin);
+    if (!arenaBegin || offset >= uintptr_t(nextPageIndex.load(std::memory_order_relaxed) * pageSize))
+    {
+      return pageKindUnused;
+    }
+    return pageKinds[offset / pageSize];
+  }
+
+  byte* tryAllocatePages(int64 count, uint8 pageKind)
+  {
+    const int64 pageIndex = nextPageIndex.fetch_add(count, std::memory_order_relaxed);
+    if (pageIndex + count > pageCount)
+    {
+      logError("Engine allocator ran out of its %lld bytes address space.", arenaSize);
+      return nullptr;
+    }
+    byte* pages = arenaBegin + pageIndex * pageSize;
+    if (!tryCommitVirtualMemory(pages, count * pageSize))
+    {
+      logError("Failed to commit %lld bytes for the engine allocator.", count * pageSize);
+      return nullptr;
+    }
+    committedSize.fetch_add(count * pageSize, std::memory_order_relaxed);
+    memset(pageKinds + pageIndex, pageKind, count);
+    return pages;
+  }
+
+  bool tryCommitSmallObjectTags(byte* page)
+  {
+    // Commits whole system pages around the page's tags, which might be shared with neighbouring pages and already committed.
+    const int64 systemPageSize = getVirtualMemoryPageSize();
+    const int64 tagsBegin = (page - arenaBegin) / smallObjectTagGranularity;
+    const int64 commitBegin = tagsBegin / systemPageSize * systemPageSize;
+    const int64 commitEnd = (tagsBegin + pageSize / smallObjectTagGranularity + systemPageSize - 1) / systemPageSize * systemPageSize;
+    if (!tryCommitVirtualMemory(smallObjectTags + commitBegin, commitEnd - commitBegin))
+    {
+      logError("Failed to commit the engine allocator memory tags.");
+      return false;
+    }
+    return true;
+  }
+
+  // Threads cache freed objects of each class in their free list magazines.
+  struct SmallClass
+  {
+    ThreadSafeFreeList<32> freeList;
+    std::mutex growMutex;
+    int64 size = 0;
+  };
+
+  void* allocateSmall(SmallClass& smallClass)
+  {
+    void* object = smallClass.freeList.tryPop();
+    while (!object)
+    {
+      std::scoped_lock lock(smallClass.growMutex);
+      object = smallClass.freeList.tryPop();
+      if (!object)
+      {
+        byte* page = tryAllocatePages(1, uint8(pageKindSmall + (&smallClass - smallClasses)));
+        if (!page || !tryCommitSmallObjectTags(page))
+        {
+          return nullptr;
+        }
+        smallPageCount.fetch_add(1, std::memory_order_relaxed);
+        smallClass.freeList.add(page, smallClass.size, pageSize / smallClass.size);
+        object = smallClass.freeList.tryPop();
+      }
+    }
+    return object;
+  }
+
+  // Large allocations use two level segregated fit, blocks of a size range are found through two bitmaps in constant time.
+  // A block starts with the header, free blocks keep their free list links in the payload.
+  struct LargeBlock
+  {
+    static constexpr int64 tagShift = 56;
+    static constexpr uint64 tagMask = ~uint64(0) << tagShift;
+
+    LargeBlock* previousPhysical;
+    uint64 sizeAndFreeBit; // The top byte holds the memory tag of used blocks.
+    LargeBlock* nextFree;
+    LargeBlock* previousFree;
+
+    int64 getSize() const { return int64(sizeAndFreeBit & ~tagMask & ~uint64(1)); }
+    MemoryTag getTag() const { return MemoryTag(sizeAndFreeBit >> tagShift); }
+    bool isFree() const { return sizeAndFreeBit & 1; }
+    LargeBlock* getNextPhysical() { return reinterpret_cast<LargeBlock*>(reinterpret_cast<byte*>(this) + getSize()); }
+  };
+  static constexpr int64 largeBlockHeaderSize = 16;
+  static constexpr int64 minLargeBlockSize = sizeof(LargeBlock);
+  static constexpr int64 minLargeChunkSize = 64 * 1024 * 1024;
+  static constexpr int64 secondLevelBitCount = 4;
+  static constexpr int64 secondLevelCount = int64(1) << secondLevelBitCount;
+  static constexpr int64 firstLevelCount = 64;
+
+  static void mapLargeSize(int64 size, int64& outFirstLevel, int64& outSecondLevel)
+  {
+    outFirstLevel = std::bit_width(uint64(size)) - 1;
+    outSecondLevel = (size >> (outFirstLevel - secondLevelBitCount)) - secondLevelCount;
+  }
+
+  void insertFreeLargeBlock(LargeBlock* block)
+  {
+    int64 firstLevel, secondLevel;
+    mapLargeSize(block->getSize(), firstLevel, secondLevel);
+    LargeBlock*& head = freeLargeBlocks[firstLevel][secondLevel];
+    block->sizeAndFreeBit |= 1;
+    block->nextFree = head;
+    block->previousFree = nullptr;
+    if (head)
+    {
+      head->previousFree = block;
+    }
+    head = block;
+    firstLevelBitmap |= uint64(1) << firstLevel;
+    secondLevelBitmaps[firstLevel] |= uint32(1) << secondLevel;
+    largeFreeSize += block->getSize();
+  }
+  void removeFreeLargeBlock(LargeBlock* block)
+  {
+    int64 firstLevel, secondLevel;
+    mapLargeSize(block->getSize(), firstLevel, secondLevel);
+    if (block->previousFree)
+    {
+      block->previousFree->nextFree = block->nextFree;
+    }
+    else
+    {
+      freeLargeBlocks[firstLevel][secondLevel] = block->nextFree;
+      if (!block->nextFree)
+      {
+        secondLevelBitmaps[firstLevel] &= ~(uint32(1) << secondLevel);
+        if (!secondLevelBitmaps[firstLevel])
+        {
+          firstLevelBitmap &= ~(uint64(1) << firstLevel);
+        }
+      }
+    }
+    if (block->nextFree)
+    {
+      block->nextFree->previousFree = block->previousFree;
+    }
+    block->sizeAndFreeBit &= ~uint64(1);
+    largeFreeSize -= block->getSize();
+  }
+  // Any block of the returned list fits the size, which is rounded up to the next list first.
+  LargeBlock* findFreeLargeBlock(int64 size)
+  {
+    int64 firstLevel = std::bit_width(uint64(size)) - 1;
+    size += (int64(1) << (firstLevel - secondLevelBitCount)) - 1;
+    int64 secondLevel;
+    mapLargeSize(size, firstLevel, secondLevel);
+
+    uint32 secondLevelBitmap = secondLevelBitmaps[firstLevel] & (~uint32(0) << secondLevel);
+    if (!secondLevelBitmap)
+    {
+      const uint64 firstLevelBitmapAbove = firstLevel + 1 < firstLevelCount ? firstLevelBitmap & (~uint64(0) << (firstLevel + 1)) : 0;
+      if (!firstLevelBitmapAbove)
+      {
+        return nullptr;
+      }
+      firstLevel = std::countr_zero(firstLevelBitmapAbove);
+      secondLevelBitmap = secondLevelBitmaps[firstLevel];
+    }
+    return freeLargeBlocks[firstLevel][std::countr_zero(secondLevelBitmap)];
+  }
+  // Splits off the part of the block beyond size as a free block. The next block has to be in use, which holds for the
+  // neighbours of free blocks as they are always coalesced.
+  void splitLargeBlock(LargeBlock* block, int64 size)
+  {
+    const int64 remainderSize = block->getSize() - size;
+    if (remainderSize < minLargeBlockSize)
+    {
+      return;
+    }
+    LargeBlock* nextBlock = block->getNextPhysical();
+    block->sizeAndFreeBit = size | (block->sizeAndFreeBit & 1);
+    LargeBlock* remainder = block->getNextPhysical();
+    remainder->previousPhysical = block;
+    remainder->sizeAndFreeBit = remainderSize;
+    nextBlock->previousPhysical = remainder;
+    insertFreeLargeBlock(remainder);
+  }
+  bool tryAddLargeChunk(int64 blockSize)
+  {
+    // Leaves room for rounding the size up to the next free list when searching.
+    const int64 chunkSize = std::max(blockSize + (blockSize >> secondLevelBitCount) + largeBlockHeaderSize, minLargeChunkSize);
+    const int64 chunkPageCount = (chunkSize + pageSize - 1) / pageSize;
+    byte* chunk = tryAllocatePages(chunkPageCount, pageKindLarge);
+    if (!chunk)
+    {
+      return false;
+    }
+
+    // The chunk ends with a header of a block that is always in use, so that no block is coalesced past the chunk.
+    LargeBlock* block = reinterpret_cast<LargeBlock*>(chunk);
+    block->previousPhysical = nullptr;
+    block->sizeAndFreeBit = chunkPageCount * pageSize - largeBlockHeaderSize;
+    LargeBlock* sentinel = block->getNextPhysical();
+    sentinel->previousPhysical = block;
+    sentinel->sizeAndFreeBit = largeBlockHeaderSize;
+    insertFreeLargeBlock(block);
+    return true;
+  }
+
+  void* allocateLarge(int64 size, int64 alignment, MemoryTag tag)
+  {
+    const int64 blockSize = std::max(((size + 15) & ~int64(15)) + largeBlockHeaderSize, minLargeBlockSize);
+    // A block with enough room to move the payload to an aligned address and split off the gap in front of it as a free block.
+    const int64 searchSize = alignment > defaultAllocationAlignment ? blockSize + alignment + minLargeBlockSize : blockSize;
+
+    std::scoped_lock lock(largeMutex);
+    LargeBlock* block = findFreeLargeBlock(searchSize);
+    if (!block)
+    {
+      if (!tryAddLargeChunk(searchSize))
+      {
+        return nullptr;
+      }
+      block = findFreeLargeBlock(searchSize);
+      assert(block);
+    }
+    removeFreeLargeBlock(block);
+
+    byte* payload = reinterpret_cast<byte*>(block) + largeBlockHeaderSize;
+    byte* alignedPayload = reinterpret_cast<byte*>((uintptr_t(payload) + alignment - 1) & ~uintptr_t(alignment - 1));
+    if (alignedPayload != payload)
+    {
+      if (alignedPayload - payload < minLargeBlockSize)
+      {
+        alignedPayload += alignment;
+      }
+      const int64 gapSize = alignedPayload - payload;
+      LargeBlock* nextBlock = block->getNextPhysical();
+      LargeBlock* alignedBlock = reinterpret_cast<LargeBlock*>(alignedPayload - largeBlockHeaderSize);
+      alignedBlock->previousPhysical = block;
+      alignedBlock->sizeAndFreeBit = block->getSize() - gapSize;
+      nextBlock->previousPhysical = alignedBlock;
+      block->sizeAndFreeBit = gapSize;
+      insertFreeLargeBlock(block);
+      block = alignedBlock;
+    }
+    splitLargeBlock(block, blockSize);
+    block->sizeAndFreeBit |= uint64(tag) << LargeBlock::tagShift;
+
+    largeAllocatedSize += block->getSize() - largeBlockHeaderSize;
+    return alignedPayload;
+  }
+  void freeLarge(LargeBlock* block)
+  {
+    std::scoped_lock lock(largeMutex);
+    largeAllocatedSize -= block->getSize() - largeBlockHeaderSize;
+    block->sizeAndFreeBit &= ~LargeBlock::tagMask;
+
+    LargeBlock* previousBlock = block->previousPhysical;
+    if (previousBlock && previousBlock->isFree())
+    {
+      removeFreeLargeBlock(previousBlock);
+      previousBlock->sizeAndFreeBit += block->getSize();
+      block = previousBlock;
+    }
+    LargeBlock* nextBlock = block->getNextPhysical();
+    if (nextBlock->isFree())
+    {
+      removeFreeLargeBlock(nextBlock);
+      block->sizeAndFreeBit += nextBlock->getSize();
+      nextBlock = block->getNextPhysical();
+    }
+    nextBlock->previousPhysical = block;
+    insertFreeLargeBlock(block);
+  }
+
+  byte* arenaBegin = nullptr;
+  uint8* pageKinds = nullptr;
+  uint8* smallObjectTags = nullptr;
+  std::atomic<int64> nextPageIndex = 0;
+  std::atomic<int64> committedSize = 0;
+  std::atomic<int64> smallPageCount = 0;
+
+  SmallClass smallClasses[smallClassCount];
+
+  std::mutex largeMutex;
+  uint64 firstLevelBitmap = 0;
+  uint32 secondLevelBitmaps[firstLevelCount] = {};
+  LargeBlock* freeLargeBlocks[firstLevelCount][secondLevelCount] = {};
+  int64 largeAllocatedSize = 0;
+  int64 largeFreeSize = 0;
+};
+// Never destroyed, memory may be freed by static and thread local destructors running in any order.
+static EngineAllocator& getEngineAllocator()
+{
+  static EngineAllocator& allocator = *new EngineAllocator;
+  return allocator;
+}
+
+DAR_ENUM_IMPLEMENT(MemoryTag);
+
+constexpr int64 memoryTagMergeSize = 64 * 1024;
+
+struct MemoryTagCounters
+{
+  std::atomic<int64> liveSize = 0;
+  std::atomic<int64> liveCount = 0;
+  std::atomic<int64> allocationCount = 0;
+};
+// Written only by the owning thread, read by snapshots.
+struct ThreadMemoryTagCounters
+{
+  MemoryTagCounters tags[MemoryTagValueCount];
+  bool isRegistered = false;
+  bool isUnregistered = false; // The thread is exiting, its counters aren't seen by snapshots anymore.
+};
+static thread_local ThreadMemoryTagCounters threadMemoryTagCounters;
+
+struct MemoryTagRegistry
+{
+  std::mutex mutex;
+  std::vector<ThreadMemoryTagCounters*> threadCounters;
+  MemoryTagCounters mergedTags[MemoryTagValueCount];
+  std::atomic<int64> highWaterMarks[MemoryTagValueCount] = {};
+};
+// Never destroyed, threads may exit after static destructors.
+static MemoryTagRegistry& getMemoryTagRegistry()
+{
+  static MemoryTagRegistry& registry = *new MemoryTagRegistry;
+  return registry;
+}
+static void updateMemoryTagHighWaterMark(MemoryTagRegistry& registry, int64 tagIndex, int64 liveSize)
+{
+  std::atomic<int64>& highWaterMark = registry.highWaterMarks[tagIndex];
+  int64 lastHighWaterMark = highWaterMark.load(std::memory_order_relaxed);
+  while (liveSize > lastHighWaterMark && !highWaterMark.compare_exchange_weak(lastHighWaterMark, liveSize, std::memory_order_relaxed)) {}
+}
+static void mergeMemoryTagCounters(MemoryTagCounters& threadCounters, int64 tagIndex)
+{
+  MemoryTagRegistry& registry = getMemoryTagRegistry();
+  MemoryTagCounters& mergedCounters = registry.mergedTags[tagIndex];
+
+  // Cleared before merging, so a racing snapshot misses the counts for a moment instead of counting them twice.
+  const int64 liveSize = threadCounters.liveSize.load(std::memory_order_relaxed);
+  const int64 liveCount = threadCounters.liveCount.load(std::memory_order_relaxed);
+  const int64 allocationCount = threadCounters.allocationCount.load(std::memory_order_relaxed);
+  threadCounters.liveSize.store(0, std::memory_order_relaxed);
+  threadCounters.liveCount.store(0, std::memory_order_relaxed);
+  threadCounters.allocationCount.store(0, std::memory_order_relaxed);
+
+  const int64 mergedLiveSize = mergedCounters.liveSize.fetch_add(liveSize, std::memory_order_relaxed) + liveSize;
+  mergedCounters.liveCount.fetch_add(liveCount, std::memory_order_relaxed);
+  mergedCounters.allocationCount.fetch_add(allocationCount, std::memory_order_relaxed);
+  updateMemoryTagHighWaterMark(registry, tagIndex, mergedLiveSize);
+}
+struct MemoryTagCountersRegistration
+{
+  MemoryTagCountersRegistration()
+  {
+    MemoryTagRegistry& registry = getMemoryTagRegistry();
+    std::scoped_lock lock(registry.mutex);
+    registry.threadCounters.push_back(&threadMemoryTagCounters);
+  }
+  ~MemoryTagCountersRegistration()
+  {
+    MemoryTagRegistry& registry = getMemoryTagRegistry();
+    std::scoped_lock lock(registry.mutex);
+    for (int64 tagIndex = 0; tagIndex < MemoryTagValueCount; ++tagIndex)
+    {
+      mergeMemoryTagCounters(threadMemoryTagCounters.tags[tagIndex], tagIndex);
+    }
+    std::erase(registry.threadCounters, &threadMemoryTagCounters);
+    threadMemoryTagCounters.isUnregistered = true;
+  }
+};
+static void countTaggedMemory(MemoryTag tag, int64 sizeChange, int64 countChange)
+{
+  ThreadMemoryTagCounters& counters = threadMemoryTagCounters;
+  if (!counters.isRegistered)
+  {
+    counters.isRegistered = true;
+    thread_local MemoryTagCountersRegistration registration;
+  }
+
+  MemoryTagCounters& tagCounters = counters.tags[int64(tag)];
+  const int64 liveSize = tagCounters.liveSize.load(std::memory_order_relaxed) + sizeChange;
+  tagCounters.liveSize.store(liveSize, std::memory_order_relaxed);
+  tagCounters.liveCount.store(tagCounters.liveCount.load(std::memory_order_relaxed) + countChange, std::memory_order_relaxed);
+  if (countChange > 0)
+  {
+    tagCounters.allocationCount.store(tagCounters.allocationCount.load(std::memory_order_relaxed) + countChange, std::memory_order_relaxed);
+  }
+  if (liveSize >= memoryTagMergeSize || liveSize <= -memoryTagMergeSize || counters.isUnregistered)
+  {
+    mergeMemoryTagCounters(tagCounters, int64(tag));
+  }
+}
+MemoryTagSnapshot getMemoryTagSnapshot()
+{
+  MemoryTagRegistry& registry = getMemoryTagRegistry();
+  MemoryTagSnapshot snapshot{};
+  const auto addCounters = [](MemoryTagStats& stats, const MemoryTagCounters& counters) {
+    stats.liveSize += counters.liveSize.load(std::memory_order_relaxed);
+    stats.liveCount += counters.liveCount.load(std::memory_order_relaxed);
+    stats.allocationCount += counters.allocationCount.load(std::memory_order_relaxed);
+  };
+
+  std::scoped_lock lock(registry.mutex);
+  for (int64 tagIndex = 0; tagIndex < MemoryTagValueCount; ++tagIndex)
+  {
+    MemoryTagStats& stats = snapshot.tags[tagIndex];
+    addCounters(stats, registry.mergedTags[tagIndex]);
+    for (const ThreadMemoryTagCounters* threadCounters : registry.threadCounters)
+    {
+      addCounters(stats, threadCounters->tags[tagIndex]);
+    }
+    updateMemoryTagHighWaterMark(registry, tagIndex, stats.liveSize);
+    stats.highWaterMark = registry.highWaterMarks[tagIndex].load(std::memory_order_relaxed);
+  }
+  return snapshot;
+}
+
+void* allocateMemory(int64 size, MemoryTag tag, int64 alignment)
+{
+  EngineAllocator& allocator = getEngineAllocator();
+  void* pointer = allocator.allocate(size, alignment, tag);
+  if (!pointer)
+  {
+    logError("Failed to allocate %lld bytes aligned to %lld for %s.", size, alignment, toString(tag));
+    return nullptr;
+  }
+  countTaggedMemory(tag, allocator.getSize(pointer), 1);
+  return pointer;
+}
+void freeMemory(void* pointer)
+{
+  if (pointer)
+  {
+    EngineAllocator& allocator = getEngineAllocator();
+    countTaggedMemory(allocator.getTag(pointer), -allocator.getSize(pointer), -1);
+    allocator.free(pointer);
+  }
+}
+int64 getAllocationSize(const void* pointer)
+{
+  return getEngineAllocator().getSize(pointer);
+}
+MemoryTag getAllocationTag(const void* pointer)
+{
+  return getEngineAllocator().getTag(pointer);
+}
+MemoryAllocatorStats getMemoryAllocatorStats()
+{
+  return getEngineAllocator().getStats();
+}
+
+ScratchArena::~ScratchArena()
+{
+  while (firstBlock)
+  {
+    Block* nextBlock = firstBlock->next;
+    free(firstBlock);
+    firstBlock = nextBlock;
+  }
+}
+void ScratchArena::rewind(const Marker& marker)
+{
+  currentBlock = static_cast<Block*>(marker.block);
+  position = marker.position;
+  blockEnd = currentBlock ? currentBlock->end : nullptr;
+}
+void* ScratchArena::allocateFromNextBlock(int64 size, int64 alignment)
+{
+  Block** nextBlockLink = currentBlock ? &currentBlock->next : &firstBlock;
+  Block* nextBlock = *nextBlockLink;
+  const auto getAlignedStart = [alignment](Block* block) {
+    return reinterpret_cast<byte*>((uintptr_t(block + 1) + alignment - 1) & ~uintptr_t(alignment - 1));
+  };
+
+  // Blocks kept from before are reused unless the allocation doesn't fit, a bigger block is inserted in front of them then.
+  if (!nextBlock || getAlignedStart(nextBlock) + size > nextBlock->end)
+  {
+    const int64 newBlockSize = std::max(blockSize, int64(sizeof(Block)) + size + alignment);
+    Block* newBlock = static_cast<Block*>(malloc(newBlockSize));
+    if (!newBlock)
+    {
+      logError("Failed to allocate %lld bytes scratch arena block.", newBlockSize);
+      return nullptr;
+    }
+    newBlock->next = nextBlock;
+    newBlock->end = reinterpret_cast<byte*>(newBlock) + newBlockSize;
+    *nextBlockLink = newBlock;
+    nextBlock = newBlock;
+    capacity += newBlockSize;
+    ++blockCount;
+  }
+
+  currentBlock = nextBlock;
+  blockEnd = nextBlock->end;
+  byte* alignedPosition = getAlignedStart(nextBlock);
+  position = alignedPosition + size;
+  return alignedPosition;
+}
+ScratchArena& getThreadScratchArena()
+{
+  thread_local ScratchArena arena;
+  return arena;
+}
+
+FrameAllocator::FrameAllocator(int64 inFrameCount, int64 inFrameCapacity)
+  : frames(std::make_unique<Frame[]>(inFrameCount))
+  , frameCount(inFrameCount)
+  , frameCapacity((inFrameCapacity + minAlignment - 1) & ~(minAlignment - 1))
+{
+  // With a single buffer the ended frame would be reused right away, waiting on the fence it was just given.
+  assert(frameCount >= 2);
+  for (int64 frameIndex = 0; frameIndex < frameCount; ++frameIndex)
+  {
+    frames[frameIndex].data = static_cast<byte*>(alignedMalloc(CACHE_LINE_SIZE, frameCapacity));
+  }
+  stats.frameCapacity = frameCapacity;
+}
+FrameAllocator::~FrameAllocator()
+{
+  for (int64 frameIndex = 0; frameIndex < frameCount; ++frameIndex)
+  {
+    Frame& frame = frames[frameIndex];
+    if (frame.retireFence.isValid())
+    {
+      frame.retireFence->waitForCompletion(TaskWaitMode::Block);
+    }
+    alignedFree(frame.data);
+  }
+}
+void FrameAllocator::nextFrame(Ref<TaskEvent> retireFence)
+{
+  TRACE_SCOPE();
+
+  const int64 endedFrameIndex = currentFrameIndex.load(std::memory_order_relaxed);
+  frames[endedFrameIndex].retireFence = std::move(retireFence);
+
+  const int64 nextFrameIndex = (endedFrameIndex + 1) % frameCount;
+  Frame& reusedFrame = frames[nextFrameIndex];
+  if (reusedFrame.retireFence.isValid())
+  {
+    TRACE_SCOPE("waitForFrameFence");
+    // Blocks, helping could run main thread tasks in the middle of the frame switch.
+    reusedFrame.retireFence->waitForCompletion(TaskWaitMode::Block);
+    reusedFrame.retireFence = nullptr;
+  }
+
+  // Allocations racing with the switch still go to the ended frame, so take its numbers only after the next frame was made current.
+  reusedFrame.usedSize.store(0, std::memory_order_relaxed);
+  reusedFrame.overflowCount.store(0, std::memory_order_relaxed);
+  currentFrameIndex.store(nextFrameIndex, std::memory_order_release);
+
+  const Frame& endedFrame = frames[endedFrameIndex];
+  stats.lastFrameSize = endedFrame.usedSize.load(std::memory_order_relaxed);
+  stats.highWaterMark = std::max(stats.highWaterMark, stats.lastFrameSize);
+  const int64 overflowCount = endedFrame.overflowCount.load(std::memory_order_relaxed);
+  if (overflowCount > 0)
+  {
+    logWarning("Frame allocator overflowed, %lld allocations failed. The frame needed %lld bytes of %lld bytes capacity.", overflowCount, stats.lastFrameSize, frameCapacity);
+    ++stats.overflowedFrameCount;
+    stats.overflowCount += overflowCount;
+  }
 }
\ No newline at end of file
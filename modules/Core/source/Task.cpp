@@ -3,6 +3,43 @@
 #include "Core/Task.hpp"
 
 #include <intrin.h>
+#include <bit>
+#include <condition_variable>
+#include <memory>
+
+// Hierarchical timer wheel. A slot of level L spans 64^L ticks, tasks move to lower levels as their due tick approaches,
+// so inserting and advancing cost the same no matter how far in the future a task is due.
+class TaskTimerWheel
+{
+public:
+
+  // Returns false if the task is already due.
+  bool tryInsert(int64 dueTick, Ref<TaskEvent>&& task);
+  // Moves to tick and appends the tasks that became due.
+  void advance(int64 tick, std::vector<Ref<TaskEvent>>& outDueTasks);
+
+  int64 getCurrentTick() const { return currentTick; }
+
+private:
+
+  struct Entry
+  {
+    int64 dueTick;
+    Ref<TaskEvent> task;
+  };
+
+  void insert(Entry&& entry);
+
+  static constexpr int64 slotBits = 6;
+  static constexpr int64 slotCount = int64(1) << slotBits;
+  static constexpr int64 levelCount = 4;
+  // Tasks due later than this wait in the last level and are reinserted each time their slot comes up.
+  static constexpr int64 maxDelta = (int64(1) << (slotBits * levelCount)) - 1;
+
+  std::vector<Entry> slots[levelCount][slotCount];
+  int64 currentTick = 0;
+  int64 entryCount = 0;
+};
 
 // Main class of the task system. User code will mostly interact with this exclusively.
 class TaskManager
@@ -14,60 +51,166 @@ public:
   TaskManager(TaskManager&& other) = delete;
   ~TaskManager();
 
-  // Initializes with threadCount == max(processorCount - 1, 1);
+  // Initializes using the current worker config.
   void initialize();
-  void initialize(int threadCount);
   void deinitialize();
 
-  Ref<TaskEvent> schedule(TaskFunction task, void* taskData, ThreadType desiredThread);
-  Ref<TaskEvent> schedule(TaskFunction task, void* taskData, ThreadType desiredThread, Ref<TaskEvent>* prerequisites, int8 prerequisiteCount);
+  Ref<TaskEvent> schedule(TaskFunction task, void* taskData, ThreadType desiredThread, TaskPriority priority);
+  Ref<TaskEvent> schedule(TaskFunction task, void* taskData, ThreadType desiredThread, Ref<TaskEvent>* prerequisites, int32 prerequisiteCount, TaskPriority priority);
+  Ref<TaskEvent> schedule(TaskFunction task, TaskPayloadMoveFunction movePayload, TaskPayloadDestroyFunction destroyPayload, void* payload, ThreadType desiredThread, Ref<TaskEvent>* prerequisites, int32 prerequisiteCount, TaskPriority priority);
+  Ref<TaskEvent> schedule(const TaskDesc& desc, Ref<TaskEvent>* prerequisites, int32 prerequisiteCount);
+  Ref<TaskEvent> scheduleBatch(std::span<const TaskDesc> tasks, bool shouldCreateCompletionEvent);
+  Ref<TaskEvent> createJoinEvent(Ref<TaskEvent>* prerequisites, int64 prerequisiteCount);
 
   // endValue means 1 past end
-  void parallelFor(int64 beginValue, int64 endValue, const std::function<void(int64 iterationIndex, int64 threadIndex)>& function);
+  void parallelFor(int64 beginValue, int64 endValue, int64 grainSize, ParallelForRangeFunction function, void* functionContext);
 
   // Process tasks meant for the main thread.
   void processMainThreadTasks();
+  void processMainThreadTasks(int64 budgetMicroseconds);
+  MainThreadTaskBudget getMainThreadTaskBudget() const { return mainThreadTaskBudget; }
+
+  Ref<TaskEvent> scheduleAfter(int64 delayMicroseconds, TaskFunction task, void* taskData, ThreadType desiredThread, TaskPriority priority) { return scheduleAfter(delayMicroseconds, TaskEvent::create(task, taskData, desiredThread, priority)); }
+  Ref<TaskEvent> scheduleAfter(int64 delayMicroseconds, TaskFunction task, TaskPayloadMoveFunction movePayload, TaskPayloadDestroyFunction destroyPayload, void* payload, ThreadType desiredThread, TaskPriority priority) { return scheduleAfter(delayMicroseconds, TaskEvent::create(task, movePayload, destroyPayload, payload, desiredThread, priority)); }
+  Ref<TaskEvent> scheduleAtFrame(int64 frameIndex, TaskFunction task, void* taskData, ThreadType desiredThread, TaskPriority priority) { return scheduleAtFrame(frameIndex, TaskEvent::create(task, taskData, desiredThread, priority)); }
+  Ref<TaskEvent> scheduleAtFrame(int64 frameIndex, TaskFunction task, TaskPayloadMoveFunction movePayload, TaskPayloadDestroyFunction destroyPayload, void* payload, ThreadType desiredThread, TaskPriority priority) { return scheduleAtFrame(frameIndex, TaskEvent::create(task, movePayload, destroyPayload, payload, desiredThread, priority)); }
+  void advanceTimers(int64 frameIndex);
+  int64 getTimerFrameIndex();
+
+  void waitForCompletion(const TaskEvent& event, TaskWaitMode mode);
+  // Wakes threads which sleep in help mode waiting for the event.
+  void wakeHelpingWaiters(const TaskEvent& event);
 
   int64 getWorkerCount() { return static_cast<int64>(threads.size()); }
 
+  void setWorkerConfig(const WorkerConfig& config);
+  WorkerConfig getWorkerConfig() const { return workerConfig; }
+
+  void setBackpressure(TaskQueueFullPolicy policy, int64 softCapacity);
+  int64 getQueueFullCount() const { return queueFullCount.load(std::memory_order_relaxed); }
+
+  TaskPoolUsage getPoolUsage() const;
+
+  TaskTelemetry getTelemetry() const;
+  void resetTelemetry();
+
 private:
 
   friend class TaskEvent;
-  // Schedule task that's ready for execution.
-  void enqueue(TaskFunction function, void* data, ThreadType desiredThread, Ref<TaskEvent> completionEvent);
-  void enqueueToMain(TaskFunction task, void* taskData, Ref<TaskEvent>&& completionEvent);
-  void enqueueToWorker(TaskFunction task, void* taskData, Ref<TaskEvent>&& completionEvent);
+  // Schedule task that's ready for execution. The task event carries the function and data.
+  void enqueue(TaskEvent* task);
+  void enqueueToMain(TaskEvent* task);
+  void enqueueToWorker(TaskEvent* task);
+  Ref<TaskEvent> schedule(Ref<TaskEvent>&& task, Ref<TaskEvent>* prerequisites, int32 prerequisiteCount);
+  Ref<TaskEvent> scheduleAfter(int64 delayMicroseconds, Ref<TaskEvent>&& task);
+  Ref<TaskEvent> scheduleAtFrame(int64 frameIndex, Ref<TaskEvent>&& task);
+
+  // Queue items are TaskEvent pointers holding a reference, released after the task is executed.
+  // Only tasks coming from non worker threads go here, worker threads push to their local queues unless those are full.
+  // There is one queue per TaskPriority.
+  SegmentedQueue<TaskEvent*, 1024> globalQueues[taskPriorityCount];
+
+  // Backpressure applied when globalQueue grows over the soft capacity.
+  TaskQueueFullPolicy queueFullPolicy = TaskQueueFullPolicy::Grow;
+  int64 queueSoftCapacity = 4096;
+  std::atomic<int64> queueFullCount = 0;
+  std::atomic<int64> blockedProducerCount = 0;
+  std::mutex blockedProducersMutex;
+  std::condition_variable blockedProducersCondition;
+
+  // Written by the owning thread, read by telemetry snapshots. Times are in performance counter ticks.
+  struct ThreadCounters
+  {
+    std::atomic<int64> executedTaskCount = 0;
+    std::atomic<int64> busyTicks = 0;
+    std::atomic<int64> parkedTicks = 0;
+    std::atomic<int64> startTicks = 0;
+    std::atomic<int64> localQueueHighWaterMark = 0;
+  };
 
-  struct Task
+  // Thread waiting for an event in help mode, sleeps when there is nothing to help with. Woken by the event completion
+  // or by producers of tasks the thread can execute.
+  struct HelpingWaiter
   {
-    TaskFunction function;
-    void* data;
-    Ref<TaskEvent> completionEvent;
+    std::atomic<const TaskEvent*> event = nullptr; // Set while sleeping.
+    std::atomic<uint32> wakeCount = 0;
   };
 
-  struct TaskQueue
+  // Tasks scheduled from the worker are pushed to its local queues. Idle workers steal from each other.
+  using LocalTaskQueue = WorkStealingQueue<TaskEvent*, 1024>;
+  struct Worker
   {
-    Task tasks[255];
-    void* semaphore = nullptr;
+    LocalTaskQueue localQueues[taskPriorityCount];
+    HelpingWaiter helpingWaiter;
+    int64 tasksUntilStarvationCheck = starvationCheckInterval;
+    std::vector<int32> logicalProcessorIds; // Affinity applied when the worker starts, empty if unpinned.
+    alignas(CACHE_LINE_SIZE) ThreadCounters counters;
+  };
+  std::unique_ptr<Worker[]> workers;
+  static thread_local Worker* currentWorker; // Set only for worker threads.
+
+  // How many tasks a worker executes before it looks at the lowest priority lane first.
+  static constexpr int64 starvationCheckInterval = 16;
 
-    // Keep those shared variables on separate cache lines to avoid false sharing.
-    alignas(CACHE_LINE_SIZE) std::atomic<int64> taskIndexToRead = 0;
-    volatile int64 cachedTaskIndexToWrite = 0;
+  MPSCQueue<Ref<TaskEvent>, 256> mainTaskQueues[taskPriorityCount];
 
-    alignas(CACHE_LINE_SIZE) std::atomic<int64> taskIndexToWrite = 0;
-    volatile int64 cachedTaskIndexToRead = 0;
-    std::mutex writerMutex;
-  } workerQueue;
+  ThreadCounters mainThreadCounters;
+  HelpingWaiter mainThreadHelpingWaiter;
 
-  MPSCStaticQueue<Task, 256> mainTaskQueue;
+  // Dequeued by the budgeted processMainThreadTasks but didn't fit the budget, first in their lanes next time.
+  Ref<TaskEvent> deferredMainTasks[taskPriorityCount];
+  int64 mainTasksUntilStarvationCheck = starvationCheckInterval;
+  MainThreadTaskBudget mainThreadTaskBudget = {};
+  std::atomic<int64> globalQueueHighWaterMark = 0;
+
+  // Delayed tasks. Ticks of timeTimers are taskTimerTickMicroseconds long and count from timerStartTicks,
+  // ticks of frameTimers are frame index + 1 so that tick 0 means no frame was advanced to yet.
+  std::mutex timersMutex;
+  TaskTimerWheel timeTimers;
+  TaskTimerWheel frameTimers;
+  int64 timerStartTicks = 0;
+  int64 timerTickLength = 1; // In performance counter ticks.
+  static thread_local int64 executionDepth; // Nested executions are already counted as busy time of the outer one.
+
+  struct LatencyCounters
+  {
+    std::atomic<int64> counts[taskLatencyBucketCount] = {};
+    std::atomic<int64> totalTicks = 0;
+    std::atomic<int64> maxTicks = 0;
+  };
+  struct FunctionCounters
+  {
+    std::atomic<TaskFunction> function = nullptr;
+    std::atomic<int64> executedCount = 0;
+    LatencyCounters scheduleToStart;
+    LatencyCounters startToEnd;
+  };
+  // Open addressing table keyed by the function, entries are never removed. The last entry collects functions that didn't fit.
+  static constexpr int64 functionCountersCapacity = 256;
+  FunctionCounters functionCounters[functionCountersCapacity];
+  FunctionCounters& findFunctionCounters(TaskFunction function);
+  void recordLatency(LatencyCounters& counters, int64 ticks);
+  TaskLatencyHistogram getLatencyHistogram(const LatencyCounters& counters) const;
+  TaskThreadTelemetry getThreadTelemetry(const ThreadCounters& counters, int64 nowTicks) const;
+
+  int64 performanceCounterFrequency = 1;
 
   static constexpr int threadCountMax = 64;
-  static constexpr uint8 invalidTaskIndex = 255;
+
+  WorkerConfig workerConfig;
+  CpuTopology cpuTopology;
+  bool isCpuTopologyDetected = false;
 
   std::vector<void*> threads;
   std::vector<TaskThreadContext> threadContexts;
 
-  void* parallelForFinishedEvent;
+  void* semaphore = nullptr; // Wakes up parked workers, released only when some worker is parked.
+  // Parked workers which weren't signaled yet.
+  alignas(CACHE_LINE_SIZE) std::atomic<int64> parkedWorkerCount = 0;
+  std::atomic<int64> sleepingHelpingWorkerCount = 0;
+  std::atomic<int64> spinBudgetTicks = 0;
+  std::atomic<int64> yieldCount = 0;
+
 
   volatile bool threadsShouldStop = false;
 
@@ -76,36 +219,158 @@ private:
   static unsigned long workerThreadMain(void* parameter);
 
   bool isInitialized() const;
+  // Pins the main thread and returns the logical processors available for each worker slot.
+  std::vector<std::vector<int32>> placeThreads(WorkerPlacement placement);
 
   void processAllTasks(const TaskThreadContext& threadContext);
+  // Spins, yields and finally parks until there may be tasks to execute.
+  void waitForWork();
+  bool hasQueuedWorkerTasks() const;
+  bool tryUnpark();
+  void wakeParkedWorkers(int64 taskCount);
+  void wakeHelpingWaiter(HelpingWaiter& waiter);
+  bool tryDequeue(Worker& worker, int64 workerIndex, TaskEvent*& outTask);
+  bool tryDequeue(Worker& worker, int64 workerIndex, TaskPriority priority, TaskEvent*& outTask);
+  bool tryDequeueFromGlobalQueue(TaskPriority priority, TaskEvent*& outTask);
+  int64 getGlobalQueueSize() const;
+  // Returns true if the task was already executed as a result of the backpressure.
+  bool applyBackpressure(TaskEvent* task);
+  bool trySteal(int64 thiefIndex, TaskPriority priority, TaskEvent*& outTask);
+  void execute(TaskEvent* task, const TaskThreadContext& threadContext);
+  // Runs the task function and completes the event, references are left to the caller.
+  void run(TaskEvent& task, const TaskThreadContext& threadContext);
+  bool tryExecuteMainThreadTask(const TaskThreadContext& threadContext);
+  bool tryDequeueMainThreadTask(Ref<TaskEvent>& outTask);
+  bool tryDequeueMainThreadTask(TaskPriority priority, Ref<TaskEvent>& outTask);
+  int64 getEstimatedCostTicks(const TaskEvent& task);
 };
 TaskManager taskManager;
+thread_local TaskManager::Worker* TaskManager::currentWorker = nullptr;
+thread_local int64 TaskManager::executionDepth = 0;
+
+static int64 readPerformanceCounter()
+{
+  LARGE_INTEGER counterValue;
+  QueryPerformanceCounter(&counterValue);
+  return counterValue.QuadPart;
+}
+static void updateHighWaterMark(std::atomic<int64>& highWaterMark, int64 value)
+{
+  int64 currentHighWaterMark = highWaterMark.load(std::memory_order_relaxed);
+  while (value > currentHighWaterMark && !highWaterMark.compare_exchange_weak(currentHighWaterMark, value, std::memory_order_relaxed)) {}
+}
 
 TaskSystemInitializer::TaskSystemInitializer() { taskManager.initialize(); }
 TaskSystemInitializer::~TaskSystemInitializer() { taskManager.deinitialize(); }
 
-Ref<TaskEvent> schedule(TaskFunction task, void* taskData, ThreadType desiredThread)
+Ref<TaskEvent> schedule(TaskFunction task, void* taskData, ThreadType desiredThread, TaskPriority priority)
+{
+  return taskManager.schedule(task, taskData, desiredThread, priority);
+}
+Ref<TaskEvent> schedule(const TaskDesc& desc, Ref<TaskEvent>* prerequisites, int32 prerequisiteCount)
+{
+  return taskManager.schedule(desc, prerequisites, prerequisiteCount);
+}
+Ref<TaskEvent> scheduleBatch(std::span<const TaskDesc> tasks, bool shouldCreateCompletionEvent)
+{
+  return taskManager.scheduleBatch(tasks, shouldCreateCompletionEvent);
+}
+Ref<TaskEvent> createJoinEvent(Ref<TaskEvent>* prerequisites, int64 prerequisiteCount)
+{
+  return taskManager.createJoinEvent(prerequisites, prerequisiteCount);
+}
+Ref<TaskEvent> schedule(TaskFunction task, void* taskData, ThreadType desiredThread, Ref<TaskEvent>* prerequisites, int32 prerequisiteCount, TaskPriority priority)
+{
+  return taskManager.schedule(task, taskData, desiredThread, prerequisites, prerequisiteCount, priority);
+}
+Ref<TaskEvent> schedule(TaskFunction task, TaskPayloadMoveFunction movePayload, TaskPayloadDestroyFunction destroyPayload, void* payload, ThreadType desiredThread, Ref<TaskEvent>* prerequisites, int32 prerequisiteCount, TaskPriority priority)
 {
-  return taskManager.schedule(task, taskData, desiredThread);
+  return taskManager.schedule(task, movePayload, destroyPayload, payload, desiredThread, prerequisites, prerequisiteCount, priority);
 }
-Ref<TaskEvent> schedule(TaskFunction task, void* taskData, ThreadType desiredThread, Ref<TaskEvent>* prerequisites, int8 prerequisiteCount)
+void parallelFor(int64 beginValue, int64 endValue, int64 grainSize, ParallelForRangeFunction function, void* functionContext)
 {
-  return taskManager.schedule(task, taskData, desiredThread, prerequisites, prerequisiteCount);
+  taskManager.parallelFor(beginValue, endValue, grainSize, function, functionContext);
 }
 void parallelFor(int64 beginValue, int64 endValue, const std::function<void(int64 iterationIndex, int64 threadIndex)>& function)
 {
-  taskManager.parallelFor(beginValue, endValue, function);
+  parallelFor(beginValue, endValue, [&function](int64 rangeBegin, int64 rangeEnd, int64 threadIndex)
+  {
+    for (int64 i = rangeBegin; i < rangeEnd; ++i)
+    {
+      function(i, threadIndex);
+    }
+  });
 }
 int64 getWorkerCount()
 {
   return taskManager.getWorkerCount();
 }
+Ref<TaskEvent> scheduleAfter(int64 delayMicroseconds, TaskFunction task, void* taskData, ThreadType desiredThread, TaskPriority priority)
+{
+  return taskManager.scheduleAfter(delayMicroseconds, task, taskData, desiredThread, priority);
+}
+Ref<TaskEvent> scheduleAfter(int64 delayMicroseconds, TaskFunction task, TaskPayloadMoveFunction movePayload, TaskPayloadDestroyFunction destroyPayload, void* payload, ThreadType desiredThread, TaskPriority priority)
+{
+  return taskManager.scheduleAfter(delayMicroseconds, task, movePayload, destroyPayload, payload, desiredThread, priority);
+}
+Ref<TaskEvent> scheduleAtFrame(int64 frameIndex, TaskFunction task, void* taskData, ThreadType desiredThread, TaskPriority priority)
+{
+  return taskManager.scheduleAtFrame(frameIndex, task, taskData, desiredThread, priority);
+}
+Ref<TaskEvent> scheduleAtFrame(int64 frameIndex, TaskFunction task, TaskPayloadMoveFunction movePayload, TaskPayloadDestroyFunction destroyPayload, void* payload, ThreadType desiredThread, TaskPriority priority)
+{
+  return taskManager.scheduleAtFrame(frameIndex, task, movePayload, destroyPayload, payload, desiredThread, priority);
+}
+void advanceTaskTimers(int64 frameIndex)
+{
+  taskManager.advanceTimers(frameIndex);
+}
+int64 getTaskTimerFrameIndex()
+{
+  return taskManager.getTimerFrameIndex();
+}
+void setTaskQueueBackpressure(TaskQueueFullPolicy policy, int64 softCapacity)
+{
+  taskManager.setBackpressure(policy, softCapacity);
+}
+int64 getTaskQueueFullCount()
+{
+  return taskManager.getQueueFullCount();
+}
 void processMainThreadTasks()
 {
   return taskManager.processMainThreadTasks();
 }
+void processMainThreadTasks(int64 budgetMicroseconds)
+{
+  return taskManager.processMainThreadTasks(budgetMicroseconds);
+}
+MainThreadTaskBudget getMainThreadTaskBudget()
+{
+  return taskManager.getMainThreadTaskBudget();
+}
+TaskPoolUsage getTaskPoolUsage()
+{
+  return taskManager.getPoolUsage();
+}
+void setWorkerConfig(const WorkerConfig& config)
+{
+  taskManager.setWorkerConfig(config);
+}
+WorkerConfig getWorkerConfig()
+{
+  return taskManager.getWorkerConfig();
+}
+TaskTelemetry getTaskTelemetry()
+{
+  return taskManager.getTelemetry();
+}
+void resetTaskTelemetry()
+{
+  taskManager.resetTelemetry();
+}
 
-FixedThreadSafePoolAllocator<TaskEvent::SubsequentList::Node, 2048> TaskEvent::SubsequentList::nodeAllocator;
+ThreadSafePoolAllocator<TaskEvent::SubsequentList::Node, 2048, MemoryTag::Task> TaskEvent::SubsequentList::nodeAllocator;
 bool TaskEvent::SubsequentList::tryAdd(Ref<TaskEvent>&& taskEvent)
 {
   if (isComplete)
@@ -116,30 +381,29 @@ bool TaskEvent::SubsequentList::tryAdd(Ref<TaskEvent>&& taskEvent)
   Node* newHead = new (nodeAllocator.allocate()) Node();
   newHead->taskEvent = std::move(taskEvent);
 
-  do 
+  // Checking isComplete isn't enough, complete() may drain the list between the check and the push.
+  Node* previousHead = head.load(std::memory_order_acquire);
+  do
   {
-    Node* previousHead = head.load(std::memory_order_acquire);
-    newHead->next = previousHead;
-    if (head.compare_exchange_strong(previousHead, newHead))
+    if (previousHead == getCompletedHead())
     {
-      return true;
+      recycle(newHead);
+      return false;
     }
-  } while (!isComplete);
-
-  recycle(newHead);
+    newHead->next = previousHead;
+  } while (!head.compare_exchange_weak(previousHead, newHead, std::memory_order_acq_rel, std::memory_order_acquire));
 
-  return false;
+  return true;
 }
 void TaskEvent::SubsequentList::complete()
 {
   isComplete = true;
 
-  Node* previousHead;
-  do
+  Node* previousHead = head.exchange(getCompletedHead(), std::memory_order_acq_rel);
+  if (previousHead == getCompletedHead())
   {
-    previousHead = head.load(std::memory_order_acquire);
-  } while (!head.compare_exchange_strong(previousHead, nullptr));
-
+    return;
+  }
   while (previousHead)
   {
     previousHead->taskEvent->removePrerequisite();
@@ -148,33 +412,56 @@ void TaskEvent::SubsequentList::complete()
     recycle(toDelete);
   }
 }
+TaskEvent::SubsequentList::~SubsequentList()
+{
+  Node* node = head.load(std::memory_order_acquire);
+  if (node == getCompletedHead())
+  {
+    return;
+  }
+  while (node)
+  {
+    Node* next = node->next;
+    recycle(node);
+    node = next;
+  }
+}
 void TaskEvent::SubsequentList::recycle(Node* node)
 {
   node->~Node();
   nodeAllocator.deallocate(node);
 }
 
-static FixedThreadSafePoolAllocator<TaskEvent, 1024> taskEventAllocator;
+static ThreadSafePoolAllocator<TaskEvent, 1024, MemoryTag::Task> taskEventAllocator;
 Ref<TaskEvent> TaskEvent::create() 
 { 
   return Ref<TaskEvent>(new (taskEventAllocator.allocate()) TaskEvent()); 
 }
-Ref<TaskEvent> TaskEvent::create(TaskFunction function, void* data, ThreadType desiredThread) 
+Ref<TaskEvent> TaskEvent::create(TaskFunction function, void* data, ThreadType desiredThread, TaskPriority priority) 
+{
+  return Ref<TaskEvent>(new (taskEventAllocator.allocate()) TaskEvent(function, data, desiredThread, priority)); 
+}
+Ref<TaskEvent> TaskEvent::create(TaskFunction function, TaskPayloadMoveFunction movePayload, TaskPayloadDestroyFunction destroyPayload, void* payload, ThreadType desiredThread, TaskPriority priority)
 {
-  return Ref<TaskEvent>(new (taskEventAllocator.allocate()) TaskEvent(function, data, desiredThread)); 
+  TaskEvent* taskEvent = new (taskEventAllocator.allocate()) TaskEvent(function, nullptr, desiredThread, priority);
+  movePayload(taskEvent->inlinePayload, payload);
+  taskEvent->data = taskEvent->inlinePayload;
+  taskEvent->destroyPayload = destroyPayload;
+  return Ref<TaskEvent>(taskEvent);
 }
-TaskEvent::TaskEvent(TaskFunction inFunction, void* inData, ThreadType inDesiredThread)
+TaskEvent::TaskEvent(TaskFunction inFunction, void* inData, ThreadType inDesiredThread, TaskPriority inPriority)
   : function(inFunction)
   , data(inData)
   , desiredThread(inDesiredThread)
+  , priority(inPriority)
 {
 }
 TaskEvent::~TaskEvent()
 {
-  if(waitableEvent)
+  assert(waiterCount == 0);
+  if (destroyPayload)
   {
-    CloseHandle(waitableEvent);
-    waitableEvent = nullptr;
+    destroyPayload(data); // Never executed.
   }
 }
 void TaskEvent::ref()
@@ -183,7 +470,7 @@ void TaskEvent::ref()
 }
 void TaskEvent::unref()
 {
-  const int8 newCount = --refCount;
+  const int32 newCount = --refCount;
   assert(newCount >= 0);
   if (newCount == 0)
   {
@@ -193,72 +480,179 @@ void TaskEvent::unref()
 }
 void TaskEvent::complete()
 {
-  // Have to signal waitableEvent before completing subsequents, 
-  // otherwise waitForCompletion could close the handle before we signal it.
-  if(waitableEvent)
+  subsequents.complete();
+
+  // Waiters increment waiterCount before checking isComplete, so either they see the event completed or we see them here.
+  if (waiterCount > 0)
+  {
+    WakeByAddressAll(&subsequents.isComplete);
+    taskManager.wakeHelpingWaiters(*this);
+  }
+}
+void TaskEvent::waitForCompletion(TaskWaitMode mode) const
+{
+  taskManager.waitForCompletion(*this, mode);
+}
+void TaskEvent::addPrerequisite()
+{
+  ++prerequisiteCount;
+}
+void TaskEvent::removePrerequisite()
+{
+  const int32 newCount = --prerequisiteCount;
+  assert(newCount >= 0);
+  if (newCount == 0)
   {
-    ensure(SetEvent(waitableEvent));
+    if (function)
+    {
+      taskManager.enqueue(this);
+    }
+    else
+    {
+      complete();
+    }
   }
+}
 
-  subsequents.complete();
+TaskPoolUsage TaskManager::getPoolUsage() const
+{
+  TaskPoolUsage usage;
+  usage.taskEventCount = taskEventAllocator.getCurrentCount();
+  usage.taskEventPeakCount = taskEventAllocator.getPeakCount();
+  usage.taskEventCapacity = taskEventAllocator.getCapacity();
+  usage.subsequentNodeCount = TaskEvent::SubsequentList::nodeAllocator.getCurrentCount();
+  usage.subsequentNodePeakCount = TaskEvent::SubsequentList::nodeAllocator.getPeakCount();
+  usage.subsequentNodeCapacity = TaskEvent::SubsequentList::nodeAllocator.getCapacity();
+  return usage;
 }
-void TaskEvent::waitForCompletion() const
+TaskTelemetry TaskManager::getTelemetry() const
 {
-  if(isComplete())
+  const int64 nowTicks = readPerformanceCounter();
+
+  TaskTelemetry telemetry;
+  telemetry.workers.reserve(threads.size());
+  for (int64 workerIndex = 0; workerIndex < int64(threads.size()); ++workerIndex)
   {
-    return;
+    telemetry.workers.push_back(getThreadTelemetry(workers[workerIndex].counters, nowTicks));
+  }
+  telemetry.mainThread = getThreadTelemetry(mainThreadCounters, nowTicks);
+  telemetry.mainThread.idleMicroseconds = 0;
+  telemetry.globalQueueHighWaterMark = globalQueueHighWaterMark.load(std::memory_order_relaxed);
+
+  for (const FunctionCounters& counters : functionCounters)
+  {
+    const int64 executedCount = counters.executedCount.load(std::memory_order_relaxed);
+    if (executedCount == 0)
+    {
+      continue;
+    }
+
+    TaskFunctionTelemetry& functionTelemetry = telemetry.functions.emplace_back();
+    functionTelemetry.function = counters.function.load(std::memory_order_relaxed);
+    functionTelemetry.executedCount = executedCount;
+    functionTelemetry.scheduleToStart = getLatencyHistogram(counters.scheduleToStart);
+    functionTelemetry.startToEnd = getLatencyHistogram(counters.startToEnd);
   }
 
-  if(!waitableEvent)
+  return telemetry;
+}
+void TaskManager::resetTelemetry()
+{
+  const int64 nowTicks = readPerformanceCounter();
+
+  auto resetThreadCounters = [nowTicks](ThreadCounters& counters)
+  {
+    counters.executedTaskCount = 0;
+    counters.busyTicks = 0;
+    counters.parkedTicks = 0;
+    counters.startTicks = nowTicks;
+    counters.localQueueHighWaterMark = 0;
+  };
+  for (int64 workerIndex = 0; workerIndex < int64(threads.size()); ++workerIndex)
   {
-    void* waitableEventLocal = CreateEvent(nullptr, false, false, nullptr);
+    resetThreadCounters(workers[workerIndex].counters);
+  }
+  resetThreadCounters(mainThreadCounters);
+  globalQueueHighWaterMark = 0;
 
-    void* nullPointer = nullptr;
-    if(!waitableEvent.compare_exchange_strong(nullPointer, waitableEventLocal))
+  // Functions keep their entries so that concurrent lookups stay valid.
+  for (FunctionCounters& counters : functionCounters)
+  {
+    counters.executedCount = 0;
+    for (LatencyCounters* latencyCounters : { &counters.scheduleToStart, &counters.startToEnd })
     {
-      if(waitableEventLocal)
+      for (std::atomic<int64>& count : latencyCounters->counts)
       {
-        CloseHandle(waitableEventLocal);
+        count = 0;
       }
+      latencyCounters->totalTicks = 0;
+      latencyCounters->maxTicks = 0;
     }
-
-    if(!ensure(waitableEvent != nullptr))
+  }
+}
+TaskManager::FunctionCounters& TaskManager::findFunctionCounters(TaskFunction function)
+{
+  constexpr int64 probedCount = functionCountersCapacity - 1;
+  const int64 startIndex = int64((uint64(function) >> 4) * 0x9E3779B97F4A7C15ull >> 56) % probedCount;
+  for (int64 offset = 0; offset < probedCount; ++offset)
+  {
+    FunctionCounters& counters = functionCounters[(startIndex + offset) % probedCount];
+    TaskFunction entryFunction = counters.function.load(std::memory_order_relaxed);
+    if (entryFunction == function)
     {
-      logWarning("TaskEvent::waitForCompletion failed to create waitable event. Have to resort to busy wait.");
-      while(!isComplete());
-      return;
+      return counters;
     }
-
-    // The task could had been completed before we created the event.
-    if(isComplete())
+    if (!entryFunction && (counters.function.compare_exchange_strong(entryFunction, function, std::memory_order_relaxed) || entryFunction == function))
     {
-      return;
+      return counters;
     }
   }
 
-  if(WaitForSingleObject(waitableEvent, INFINITE) == WAIT_FAILED)
-  {
-    logWarning("TaskEvent::waitForCompletion failed to wait for waitable event. Have to resort to busy wait.");
-    while(!isComplete());
-  }
+  return functionCounters[functionCountersCapacity - 1];
 }
-void TaskEvent::addPrerequisite()
+void TaskManager::recordLatency(LatencyCounters& counters, int64 ticks)
 {
-  ++prerequisiteCount;
+  const int64 microseconds = ticks * 1000000 / performanceCounterFrequency;
+  const int64 bucketIndex = std::min(int64(std::bit_width(uint64(microseconds))), taskLatencyBucketCount - 1);
+  counters.counts[bucketIndex].fetch_add(1, std::memory_order_relaxed);
+  counters.totalTicks.fetch_add(ticks, std::memory_order_relaxed);
+  updateHighWaterMark(counters.maxTicks, ticks);
 }
-void TaskEvent::removePrerequisite()
+TaskLatencyHistogram TaskManager::getLatencyHistogram(const LatencyCounters& counters) const
 {
-  const int8 newCount = --prerequisiteCount;
-  assert(newCount >= 0);
-  if (newCount == 0)
+  TaskLatencyHistogram histogram;
+  for (int64 bucketIndex = 0; bucketIndex < taskLatencyBucketCount; ++bucketIndex)
   {
-    taskManager.enqueue(function, data, desiredThread, Ref<TaskEvent>(this));
+    histogram.counts[bucketIndex] = counters.counts[bucketIndex].load(std::memory_order_relaxed);
   }
+  histogram.totalMicroseconds = counters.totalTicks.load(std::memory_order_relaxed) * 1000000 / performanceCounterFrequency;
+  histogram.maxMicroseconds = counters.maxTicks.load(std::memory_order_relaxed) * 1000000 / performanceCounterFrequency;
+  return histogram;
+}
+TaskThreadTelemetry TaskManager::getThreadTelemetry(const ThreadCounters& counters, int64 nowTicks) const
+{
+  const int64 busyTicks = counters.busyTicks.load(std::memory_order_relaxed);
+  const int64 parkedTicks = counters.parkedTicks.load(std::memory_order_relaxed);
+  const int64 idleTicks = std::max(nowTicks - counters.startTicks.load(std::memory_order_relaxed) - busyTicks - parkedTicks, int64(0));
+
+  TaskThreadTelemetry telemetry;
+  telemetry.executedTaskCount = counters.executedTaskCount.load(std::memory_order_relaxed);
+  telemetry.busyMicroseconds = busyTicks * 1000000 / performanceCounterFrequency;
+  telemetry.idleMicroseconds = idleTicks * 1000000 / performanceCounterFrequency;
+  telemetry.parkedMicroseconds = parkedTicks * 1000000 / performanceCounterFrequency;
+  telemetry.localQueueHighWaterMark = counters.localQueueHighWaterMark.load(std::memory_order_relaxed);
+  return telemetry;
 }
-
 TaskManager::TaskManager()
-  : parallelForFinishedEvent(CreateEvent(NULL, true, true, NULL))
 {
+  LARGE_INTEGER counterFrequency;
+  QueryPerformanceFrequency(&counterFrequency);
+  performanceCounterFrequency = counterFrequency.QuadPart;
+  mainThreadCounters.startTicks = readPerformanceCounter();
+  timerStartTicks = mainThreadCounters.startTicks;
+  timerTickLength = std::max(taskTimerTickMicroseconds * performanceCounterFrequency / 1000000, int64(1));
+  spinBudgetTicks = workerConfig.spinMicroseconds * performanceCounterFrequency / 1000000;
+  yieldCount = workerConfig.yieldCount;
 }
 TaskManager::~TaskManager()
 {
@@ -276,27 +670,54 @@ void TaskManager::initialize()
     return;
   }
 
-  threadType = ThreadType::Main;
-
-  SYSTEM_INFO systemInfo;
-  GetSystemInfo(&systemInfo);
-  const int workerThreadCount = std::max(int(systemInfo.dwNumberOfProcessors - 1), 1);
-  initialize(workerThreadCount);
-}
-void TaskManager::initialize(int inThreadCount)
-{
   TRACE_SCOPE();
 
-  if (isInitialized())
+  threadType = ThreadType::Main;
+
+  if (!isCpuTopologyDetected)
   {
-    return;
+    isCpuTopologyDetected = tryDetectCpuTopology(cpuTopology);
+    if (isCpuTopologyDetected)
+    {
+      logCpuTopology(cpuTopology);
+    }
+    else
+    {
+      logWarning("Failed to detect CPU topology, workers won't be pinned.");
+    }
   }
 
+  std::vector<std::vector<int32>> slots = placeThreads(workerConfig.placement);
+
+  int inThreadCount = int(workerConfig.workerCount);
+  if (inThreadCount <= 0)
+  {
+    if (!slots.empty())
+    {
+      inThreadCount = int(slots.size());
+    }
+    else
+    {
+      SYSTEM_INFO systemInfo;
+      GetSystemInfo(&systemInfo);
+      inThreadCount = std::max(int(systemInfo.dwNumberOfProcessors - 1), 1);
+    }
+  }
   inThreadCount = std::min(inThreadCount, threadCountMax);
   threads.resize(inThreadCount);
   threadContexts.resize(inThreadCount);
+  workers = std::make_unique<Worker[]>(inThreadCount);
+  threadsShouldStop = false;
+  parkedWorkerCount = 0;
+  mainTasksUntilStarvationCheck = starvationCheckInterval;
+
+  for (int64 workerIndex = 0; workerIndex < std::min(int64(inThreadCount), int64(slots.size())); ++workerIndex)
+  {
+    workers[workerIndex].logicalProcessorIds = std::move(slots[workerIndex]);
+  }
+  logInfo("Starting %d workers, %lld of them pinned.", inThreadCount, std::min(int64(inThreadCount), int64(slots.size())));
 
-  workerQueue.semaphore = CreateSemaphore(NULL, 0, inThreadCount, NULL);
+  semaphore = CreateSemaphore(NULL, 0, inThreadCount, NULL);
 
   for (uint64 threadIndex = 0; threadIndex < inThreadCount; ++threadIndex)
   {
@@ -315,15 +736,86 @@ void TaskManager::initialize(int inThreadCount)
     ResumeThread(thread);
   }
 }
+std::vector<std::vector<int32>> TaskManager::placeThreads(WorkerPlacement placement)
+{
+  std::vector<std::vector<int32>> slots;
+  if (!isCpuTopologyDetected || placement == WorkerPlacement::Unpinned)
+  {
+    resetCurrentThreadAffinity();
+    return slots;
+  }
+
+  // Keep the main thread on the core it runs on now so it doesn't compete with workers.
+  const int32 currentLogicalProcessorId = getCurrentLogicalProcessorId();
+  int32 mainCoreIndex = -1;
+  for (const CpuTopology::LogicalProcessor& logicalProcessor : cpuTopology.logicalProcessors)
+  {
+    if (logicalProcessor.id == currentLogicalProcessorId)
+    {
+      mainCoreIndex = logicalProcessor.coreIndex;
+    }
+  }
+  std::vector<int32> mainLogicalProcessorIds;
+  for (const CpuTopology::LogicalProcessor& logicalProcessor : cpuTopology.logicalProcessors)
+  {
+    if (logicalProcessor.coreIndex == mainCoreIndex)
+    {
+      mainLogicalProcessorIds.push_back(logicalProcessor.id);
+    }
+  }
+  if (mainLogicalProcessorIds.empty() || !trySetCurrentThreadAffinity(mainLogicalProcessorIds.data(), mainLogicalProcessorIds.size()))
+  {
+    logWarning("Failed to pin the main thread to logical processor %d.", currentLogicalProcessorId);
+    mainCoreIndex = -1;
+  }
+
+  // Logical processors are sorted by cache domain and core, so neighbouring workers share caches.
+  int32 previousCoreIndex = -1;
+  for (const CpuTopology::LogicalProcessor& logicalProcessor : cpuTopology.logicalProcessors)
+  {
+    if (logicalProcessor.coreIndex == mainCoreIndex)
+    {
+      continue;
+    }
+
+    if (placement == WorkerPlacement::LogicalProcessors || logicalProcessor.coreIndex != previousCoreIndex)
+    {
+      slots.emplace_back();
+    }
+    slots.back().push_back(logicalProcessor.id);
+    previousCoreIndex = logicalProcessor.coreIndex;
+  }
+
+  return slots;
+}
+void TaskManager::setWorkerConfig(const WorkerConfig& config)
+{
+  assert(isInMainThread() || !isInitialized());
+
+  const bool needsRestart = config.workerCount != workerConfig.workerCount || config.placement != workerConfig.placement;
+  workerConfig = config;
+  spinBudgetTicks = std::max(config.spinMicroseconds, int64(0)) * performanceCounterFrequency / 1000000;
+  yieldCount = std::max(config.yieldCount, int64(0));
+  if (needsRestart && isInitialized())
+  {
+    deinitialize();
+    initialize();
+  }
+}
 void TaskManager::deinitialize()
 {
   TRACE_SCOPE();
 
   threadsShouldStop = true;
 
-  if (workerQueue.semaphore)
   {
-    while (ReleaseSemaphore(workerQueue.semaphore, 1, NULL)); // wake up worker threads so they can exit.
+    std::lock_guard<std::mutex> lock{ blockedProducersMutex };
+    blockedProducersCondition.notify_all();
+  }
+
+  if (semaphore)
+  {
+    while (ReleaseSemaphore(semaphore, 1, NULL)); // wake up worker threads so they can exit.
   }
 
   for (int threadIndex = 0; threadIndex < threads.size(); ++threadIndex)
@@ -351,37 +843,58 @@ void TaskManager::deinitialize()
         break;
     }
   }
-  threads.clear();
-  threadContexts.clear();
-
-  if (parallelForFinishedEvent)
+  // Keep tasks left in local queues so they run after the workers are restarted.
+  for (int64 workerIndex = 0; workerIndex < int64(threads.size()); ++workerIndex)
   {
-    CloseHandle(parallelForFinishedEvent);
-    parallelForFinishedEvent = nullptr;
+    for (int64 priorityIndex = 0; priorityIndex < taskPriorityCount; ++priorityIndex)
+    {
+      TaskEvent* task;
+      while (workers[workerIndex].localQueues[priorityIndex].tryPop(task))
+      {
+        globalQueues[priorityIndex].enqueue(std::move(task));
+      }
+    }
   }
+  threads.clear();
+  threadContexts.clear();
+  workers.reset();
 
-  if (workerQueue.semaphore)
+  if (semaphore)
   {
-    CloseHandle(workerQueue.semaphore);
-    workerQueue.semaphore = nullptr;
+    CloseHandle(semaphore);
+    semaphore = nullptr;
   }
 }
-Ref<TaskEvent> TaskManager::schedule(TaskFunction function, void* data, ThreadType desiredThread)
+Ref<TaskEvent> TaskManager::schedule(TaskFunction function, void* data, ThreadType desiredThread, TaskPriority priority)
 {
-  Ref<TaskEvent> completionEvent = TaskEvent::create(function, data, ThreadType::Main);
-  enqueue(function, data, desiredThread, completionEvent);
-  return completionEvent;
+  return schedule(TaskEvent::create(function, data, desiredThread, priority), nullptr, 0);
 }
-Ref<TaskEvent> TaskManager::schedule(TaskFunction function, void* data, ThreadType desiredThread, Ref<TaskEvent>* prerequisites, int8 prerequisiteCount)
+Ref<TaskEvent> TaskManager::schedule(TaskFunction function, void* data, ThreadType desiredThread, Ref<TaskEvent>* prerequisites, int32 prerequisiteCount, TaskPriority priority)
+{
+  return schedule(TaskEvent::create(function, data, desiredThread, priority), prerequisites, prerequisiteCount);
+}
+Ref<TaskEvent> TaskManager::schedule(TaskFunction function, TaskPayloadMoveFunction movePayload, TaskPayloadDestroyFunction destroyPayload, void* payload, ThreadType desiredThread, Ref<TaskEvent>* prerequisites, int32 prerequisiteCount, TaskPriority priority)
+{
+  return schedule(TaskEvent::create(function, movePayload, destroyPayload, payload, desiredThread, priority), prerequisites, prerequisiteCount);
+}
+Ref<TaskEvent> TaskManager::schedule(Ref<TaskEvent>&& completionEvent, Ref<TaskEvent>* prerequisites, int32 prerequisiteCount)
 {
   if (!prerequisites)
   {
     ensureTrue(prerequisiteCount == 0, {});
-    return schedule(function, data, desiredThread);
+    enqueue(completionEvent.get());
+    return std::move(completionEvent);
   }
   ensureTrue(prerequisiteCount > 0, {});
 
-  Ref<TaskEvent> completionEvent = TaskEvent::create(function, data, desiredThread);
+  Ref<TaskEvent> join;
+  if (prerequisiteCount > taskJoinFanIn)
+  {
+    join = createJoinEvent(prerequisites, prerequisiteCount);
+    prerequisites = &join;
+    prerequisiteCount = 1;
+  }
+
   completionEvent->setPrerequisites(prerequisiteCount);
   for (int64 i = 0; i < prerequisiteCount; ++i)
   {
@@ -390,200 +903,655 @@ Ref<TaskEvent> TaskManager::schedule(TaskFunction function, void* data, ThreadTy
       completionEvent->removePrerequisite();
     }
   }
-  return completionEvent;
-}
-void TaskManager::enqueue(TaskFunction function, void* data, ThreadType desiredThread, Ref<TaskEvent> completionEvent)
-{
-  switch (desiredThread)
-  {
-    case ThreadType::Main:
-      enqueueToMain(function, data, std::move(completionEvent));
-      break;
-
-    case ThreadType::Worker:
-      enqueueToWorker(function, data, std::move(completionEvent));
-      break;
-
-    default:
-      logError("Attempted to schedule to unknown thread.");
-      assert(false);
-      break;
-  }
+  return std::move(completionEvent);
 }
-void TaskManager::enqueueToMain(TaskFunction function, void* data, Ref<TaskEvent>&& completionEvent)
+Ref<TaskEvent> TaskManager::schedule(const TaskDesc& desc, Ref<TaskEvent>* prerequisites, int32 prerequisiteCount)
 {
-  mainTaskQueue.enqueue(Task{ function, data, std::move(completionEvent) });
+  Ref<TaskEvent> task = TaskEvent::create(desc.function, desc.data, desc.desiredThread, desc.priority);
+  task->estimatedCostMicroseconds = desc.estimatedCostMicroseconds;
+  return schedule(std::move(task), prerequisites, prerequisiteCount);
 }
-void TaskManager::enqueueToWorker(TaskFunction task, void* taskData, Ref<TaskEvent>&& completionEvent)
+Ref<TaskEvent> TaskManager::scheduleBatch(std::span<const TaskDesc> tasks, bool shouldCreateCompletionEvent)
 {
-  // At first glance it could seem it's not necessary to lock the entire method, 
-  // but even if we locked before the write into the queu and incrementing the taskIndexToWrite,
-  // we would still have to do the previous instructions anyway.
-  std::lock_guard<std::mutex> writerMutexGuard{ workerQueue.writerMutex };
+  TRACE_SCOPE();
+
+  const int64 taskCount = int64(tasks.size());
 
-  const int64 taskIndexToWrite = workerQueue.taskIndexToWrite.load(std::memory_order::memory_order_relaxed);
-  const int64 nextTaskIndexToWrite = (taskIndexToWrite + 1) % arrayLength(workerQueue.tasks);
+  // Over the soft capacity the tasks go one by one so that the backpressure policy applies to each of them.
+  const bool shouldApplyBackpressure = queueFullPolicy != TaskQueueFullPolicy::Grow && getGlobalQueueSize() + taskCount >= queueSoftCapacity;
 
-  if (nextTaskIndexToWrite == workerQueue.cachedTaskIndexToRead)
+  // Worker tasks hold the queue reference until they are executed, like in enqueueToWorker.
+  std::vector<TaskEvent*> workerTasks[taskPriorityCount];
+  std::vector<Ref<TaskEvent>> events;
+  if (shouldCreateCompletionEvent)
   {
-    workerQueue.cachedTaskIndexToRead = workerQueue.taskIndexToRead.load(std::memory_order::memory_order_relaxed);
-    if (nextTaskIndexToWrite == workerQueue.cachedTaskIndexToRead)
+    events.reserve(taskCount);
+  }
+  const int64 scheduleTicks = readPerformanceCounter();
+  for (const TaskDesc& desc : tasks)
+  {
+    Ref<TaskEvent> task = TaskEvent::create(desc.function, desc.data, desc.desiredThread, desc.priority);
+    task->scheduleTicks = scheduleTicks;
+    task->estimatedCostMicroseconds = desc.estimatedCostMicroseconds;
+    if (shouldCreateCompletionEvent)
     {
-      int spinCount = 0;
-      constexpr int maxSpinCount = 1000;
-      do
-      {
-        workerQueue.cachedTaskIndexToRead = workerQueue.taskIndexToRead.load(std::memory_order::memory_order_relaxed);
+      events.push_back(task);
+    }
 
-        logWarning("Cannot write new task with index %lld as the queue is full.", taskIndexToWrite);
-      } while (nextTaskIndexToWrite == workerQueue.cachedTaskIndexToRead && spinCount++ < maxSpinCount);
+    if (desc.desiredThread == ThreadType::Worker && !shouldApplyBackpressure)
+    {
+      task->ref();
+      workerTasks[int64(desc.priority)].push_back(task.get());
+    }
+    else
+    {
+      enqueue(task.get());
     }
   }
 
-  workerQueue.tasks[workerQueue.taskIndexToWrite].function = task;
-  workerQueue.tasks[workerQueue.taskIndexToWrite].data = taskData;
-  workerQueue.tasks[workerQueue.taskIndexToWrite].completionEvent = std::move(completionEvent);
+  // Worker tasks aren't queued yet, so they can't complete before the join is attached.
+  Ref<TaskEvent> completionEvent;
+  if (shouldCreateCompletionEvent)
+  {
+    completionEvent = createJoinEvent(events.data(), taskCount);
+  }
+
+  int64 workerTaskCount = 0;
+  for (int64 lane = 0; lane < taskPriorityCount; ++lane)
+  {
+    std::vector<TaskEvent*>& laneTasks = workerTasks[lane];
+    workerTaskCount += int64(laneTasks.size());
+
+    int64 pushedCount = 0;
+    if (currentWorker)
+    {
+      while (pushedCount < int64(laneTasks.size()) && currentWorker->localQueues[lane].tryPush(laneTasks[pushedCount]))
+      {
+        ++pushedCount;
+      }
+      updateHighWaterMark(currentWorker->counters.localQueueHighWaterMark, currentWorker->localQueues[lane].getSize());
+    }
 
-  workerQueue.taskIndexToWrite.store(nextTaskIndexToWrite, std::memory_order_release);
+    const int64 remainingCount = int64(laneTasks.size()) - pushedCount;
+    if (remainingCount > 0)
+    {
+      globalQueues[lane].enqueue(laneTasks.data() + pushedCount, remainingCount);
+      updateHighWaterMark(globalQueueHighWaterMark, getGlobalQueueSize());
+    }
+  }
+  wakeParkedWorkers(workerTaskCount);
 
-  ReleaseSemaphore(workerQueue.semaphore, 1, NULL);
+  return completionEvent;
+}
+Ref<TaskEvent> TaskManager::createJoinEvent(Ref<TaskEvent>* prerequisites, int64 prerequisiteCount)
+{
+  if (prerequisiteCount > taskJoinFanIn)
+  {
+    // Join groups first and then the group joins, so that completions spread over many counters.
+    std::vector<Ref<TaskEvent>> groupJoins;
+    groupJoins.reserve((prerequisiteCount + taskJoinFanIn - 1) / taskJoinFanIn);
+    for (int64 groupBegin = 0; groupBegin < prerequisiteCount; groupBegin += taskJoinFanIn)
+    {
+      groupJoins.push_back(createJoinEvent(prerequisites + groupBegin, std::min(taskJoinFanIn, prerequisiteCount - groupBegin)));
+    }
+    return createJoinEvent(groupJoins.data(), int64(groupJoins.size()));
+  }
+
+  // One extra prerequisite keeps the join from completing while the others are still being added.
+  Ref<TaskEvent> join = TaskEvent::create();
+  join->setPrerequisites(int32(prerequisiteCount) + 1);
+  for (int64 i = 0; i < prerequisiteCount; ++i)
+  {
+    if (!prerequisites[i]->tryAddSubsequent(join))
+    {
+      join->removePrerequisite();
+    }
+  }
+  join->removePrerequisite();
+  return join;
+}
+void TaskManager::enqueue(TaskEvent* task)
+{
+  switch (task->desiredThread)
+  {
+    case ThreadType::Main:
+      enqueueToMain(task);
+      break;
+
+    case ThreadType::Worker:
+      enqueueToWorker(task);
+      break;
+
+    default:
+      logError("Attempted to schedule to unknown thread.");
+      assert(false);
+      break;
+  }
+}
+void TaskManager::enqueueToMain(TaskEvent* task)
+{
+  task->scheduleTicks = readPerformanceCounter();
+  mainTaskQueues[int64(task->priority)].enqueue(Ref<TaskEvent>(task));
+
+  // Pairs with the announcement in waitForCompletion, either we see the sleeping main thread or it sees the task.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (mainThreadHelpingWaiter.event.load(std::memory_order_relaxed))
+  {
+    wakeHelpingWaiter(mainThreadHelpingWaiter);
+  }
+}
+void TaskManager::enqueueToWorker(TaskEvent* task)
+{
+  task->ref(); // Released after execution.
+  task->scheduleTicks = readPerformanceCounter();
+
+  const int64 lane = int64(task->priority);
+  if (currentWorker && currentWorker->localQueues[lane].tryPush(task))
+  {
+    updateHighWaterMark(currentWorker->counters.localQueueHighWaterMark, currentWorker->localQueues[lane].getSize());
+  }
+  else
+  {
+    const int64 globalQueueSize = getGlobalQueueSize();
+    if (globalQueueSize >= queueSoftCapacity && applyBackpressure(task))
+    {
+      return;
+    }
+
+    globalQueues[lane].enqueue(std::move(task));
+    updateHighWaterMark(globalQueueHighWaterMark, globalQueueSize + 1);
+  }
+
+  wakeParkedWorkers(1);
+}
+bool TaskManager::applyBackpressure(TaskEvent* task)
+{
+  ++queueFullCount;
+
+  TaskQueueFullPolicy policy = queueFullPolicy;
+  if (policy == TaskQueueFullPolicy::Block && currentWorker)
+  {
+    policy = TaskQueueFullPolicy::RunInline;
+  }
+
+  switch (policy)
+  {
+    case TaskQueueFullPolicy::RunInline:
+    {
+      TRACE_SCOPE("runTaskInline");
+
+      TaskThreadContext context;
+      if (currentWorker)
+      {
+        context = threadContexts[currentWorker - workers.get()];
+      }
+      else
+      {
+        context.scratchArena = &getThreadScratchArena();
+      }
+      execute(task, context);
+      return true;
+    }
+
+    case TaskQueueFullPolicy::Block:
+    {
+      TRACE_SCOPE("waitForQueueSpace");
+
+      ++blockedProducerCount;
+      {
+        std::unique_lock<std::mutex> lock{ blockedProducersMutex };
+        blockedProducersCondition.wait(lock, [this]() { return getGlobalQueueSize() < queueSoftCapacity || threadsShouldStop; });
+      }
+      --blockedProducerCount;
+      return false;
+    }
+
+    default:
+      return false;
+  }
+}
+void TaskManager::setBackpressure(TaskQueueFullPolicy policy, int64 softCapacity)
+{
+  ensureTrue(softCapacity > 0);
+
+  {
+    std::lock_guard<std::mutex> lock{ blockedProducersMutex };
+    queueFullPolicy = policy;
+    queueSoftCapacity = softCapacity;
+  }
+  blockedProducersCondition.notify_all();
 }
 
 struct ParallelForTaskData
 {
-  std::atomic<int64> currentValue;
+  std::atomic<int64> nextValue;
   int64 endValue;
-  const std::function<void(int64 iterationIndex, int64 threadIndex)>& function;
-  std::atomic<int64> functionCallsDoneCount;
-  std::atomic<int64> threadsRemaining;
-  void* finishedEvent;
+  int64 grainSize;
+  int64 threadCount;
+  ParallelForRangeFunction function;
+  void* functionContext;
+  std::atomic<int64> iterationsDoneCount;
+  std::atomic<int64> threadsRemaining; // Helper tasks which didn't finish yet + the calling thread.
+  Ref<TaskEvent> finishedEvent;
 };
-static void parallelForTaskInternal(ParallelForTaskData& taskData, int64 threadIndex)
+static bool tryClaimParallelForChunk(ParallelForTaskData& taskData, int64& outChunkBegin, int64& outChunkEnd)
+{
+  int64 chunkBegin = taskData.nextValue.load(std::memory_order_relaxed);
+  while (chunkBegin < taskData.endValue)
+  {
+    // Guided scheduling, chunks start big to keep the claiming overhead low and shrink near the end so that all threads finish at about the same time.
+    const int64 remainingIterationCount = taskData.endValue - chunkBegin;
+    const int64 chunkSize = std::min(remainingIterationCount, std::max(taskData.grainSize, remainingIterationCount / (2 * taskData.threadCount)));
+    if (taskData.nextValue.compare_exchange_weak(chunkBegin, chunkBegin + chunkSize, std::memory_order_relaxed))
+    {
+      outChunkBegin = chunkBegin;
+      outChunkEnd = chunkBegin + chunkSize;
+      return true;
+    }
+  }
+  return false;
+}
+static void parallelForTaskInternal(ParallelForTaskData& taskData, int64 totalIterationCount, int64 threadIndex)
 {
-  int64 currentValue = taskData.currentValue++;
-  int64 localFunctionCallsDoneCount = 0;
-  while (currentValue < taskData.endValue)
+  int64 chunkBegin;
+  int64 chunkEnd;
+  while (tryClaimParallelForChunk(taskData, chunkBegin, chunkEnd))
   {
-    taskData.function(currentValue, threadIndex);
-    currentValue = taskData.currentValue++;
-    // We have to count this instead of using currentValue as some iteration might take longer than the rest.
-    localFunctionCallsDoneCount = ++taskData.functionCallsDoneCount;
+    taskData.function(chunkBegin, chunkEnd, threadIndex, taskData.functionContext);
+
+    // We have to count this instead of using nextValue as some chunks might take longer than the rest.
+    const int64 chunkIterationCount = chunkEnd - chunkBegin;
+    if (taskData.iterationsDoneCount.fetch_add(chunkIterationCount, std::memory_order_acq_rel) + chunkIterationCount == totalIterationCount)
+    {
+      taskData.finishedEvent->complete();
+    }
   }
+}
 
-  const bool thisThreadFinishedLastIteration = localFunctionCallsDoneCount == taskData.endValue;
-  if (thisThreadFinishedLastIteration)
+struct ParallelForWorkerTaskData
+{
+  ParallelForTaskData* parallelFor;
+  int64 totalIterationCount;
+};
+DEFINE_TASK_BEGIN(parallelForTask, ParallelForWorkerTaskData)
+{
+  ParallelForTaskData& parallelForData = *taskData.parallelFor;
+  parallelForTaskInternal(parallelForData, taskData.totalIterationCount, threadContext.index + 1); // Calling thread is 0.
+
+  // The last thread will delete the shared data.
+  if (--parallelForData.threadsRemaining == 0)
   {
-    SetEvent(taskData.finishedEvent);
+    delete &parallelForData;
   }
 }
+DEFINE_TASK_END
 
-DEFINE_TASK_BEGIN(parallelForTask, ParallelForTaskData)
+void TaskManager::parallelFor(int64 beginValue, int64 endValue, int64 grainSize, ParallelForRangeFunction function, void* functionContext)
 {
-  // The last thread will delete the task data;
-  taskDataGuard.release();
+  TRACE_SCOPE();
 
-  parallelForTaskInternal(taskData, threadContext.index + 1); // Calling thread is 0.
+  const int64 totalIterationCount = endValue - beginValue;
+  if (totalIterationCount <= 0)
+  {
+    return;
+  }
+  grainSize = std::max(grainSize, int64(1));
+  const int64 callingThreadIndex = currentWorker ? (currentWorker - workers.get()) + 1 : 0;
+
+  const int64 chunkCount = (totalIterationCount + grainSize - 1) / grainSize;
+  const int64 helperTaskCount = std::min(int64(threads.size()), chunkCount - 1);
+  if (helperTaskCount <= 0)
+  {
+    function(beginValue, endValue, callingThreadIndex, functionContext);
+    return;
+  }
 
-  if (--taskData.threadsRemaining == 0)
+  // Every call has its own state, so parallelFor can be called concurrently and from within tasks, including other parallelFor bodies.
+  // Helper tasks which start after all chunks were claimed just drop their reference.
+  const int64 totalThreadCount = helperTaskCount + 1;
+  ParallelForTaskData* taskData = new ParallelForTaskData{ beginValue, endValue, grainSize, totalThreadCount, function, functionContext, 0, totalThreadCount, TaskEvent::create() };
+  for (int64 i = 0; i < helperTaskCount; ++i)
   {
-    delete& taskData;
+    enqueueToWorker(TaskEvent::create(&parallelForTask, new ParallelForWorkerTaskData{ taskData, totalIterationCount }, ThreadType::Worker, TaskPriority::Normal).get());
+  }
+
+  // The calling thread works on its own chunks until there are none left to claim, so a worker calling parallelFor never blocks
+  // on tasks sitting in a queue, only on chunks which other threads are executing right now.
+  parallelForTaskInternal(*taskData, totalIterationCount, callingThreadIndex);
+  // Don't run main thread tasks in the middle of the caller's code.
+  taskData->finishedEvent->waitForCompletion(currentWorker ? TaskWaitMode::Help : TaskWaitMode::Block);
+
+  if (--taskData->threadsRemaining == 0)
+  {
+    delete taskData;
   }
 }
-DEFINE_TASK_END
+void TaskManager::processMainThreadTasks()
+{
+  TRACE_SCOPE();
+
+  TaskThreadContext context;
+  context.index = 0;
+  context.scratchArena = &getThreadScratchArena();
 
-void TaskManager::parallelFor(int64 beginValue, int64 endValue, const std::function<void(int64 iterationIndex, int64 threadIndex)>& function)
+  while (tryExecuteMainThreadTask(context)) {}
+}
+void TaskManager::processMainThreadTasks(int64 budgetMicroseconds)
 {
   TRACE_SCOPE();
 
-  DWORD waitResult = WaitForSingleObject(parallelForFinishedEvent, 0);
-  switch (waitResult)
+  TaskThreadContext context;
+  context.index = 0;
+  context.scratchArena = &getThreadScratchArena();
+
+  const int64 startTicks = readPerformanceCounter();
+  const int64 budgetTicks = budgetMicroseconds * performanceCounterFrequency / 1000000;
+  MainThreadTaskBudget budget = {};
+  budget.budgetMicroseconds = budgetMicroseconds;
+  int64 estimatedTicks = 0;
+  while (true)
   {
-    case WAIT_TIMEOUT:
-      logError("parallelForFinishedEvent is not signaled from last call. It will be leaked.");
-      [[fallthrough]];
-    case WAIT_FAILED:
-      logError("Failed to wait on parallelForFinishedEvent from last call. It will be leaked.");
-      parallelForFinishedEvent = CreateEvent(NULL, true, true, NULL); // old one will leak, but this situation shouldn't happen.
+    Ref<TaskEvent> task;
+    if (!tryDequeueMainThreadTask(task))
+    {
       break;
+    }
+
+    const int64 taskEstimatedTicks = getEstimatedCostTicks(*task.get());
+    if (budget.executedTaskCount > 0 && readPerformanceCounter() - startTicks + taskEstimatedTicks > budgetTicks)
+    {
+      deferredMainTasks[int64(task->priority)] = std::move(task);
+      budget.wasBudgetExhausted = true;
+      break;
+    }
+
+    run(*task.get(), context);
+    ++budget.executedTaskCount;
+    estimatedTicks += taskEstimatedTicks;
   }
-  ResetEvent(parallelForFinishedEvent);
 
-  const int64 totalIterationCount = endValue - beginValue;
-  const int64 totalThreadCount = (threads.size() + 1);
-  int64 iterationCountToDoInCurrentThread = totalIterationCount / totalThreadCount;
-  if (totalIterationCount % totalThreadCount > 0)
+  budget.usedMicroseconds = (readPerformanceCounter() - startTicks) * 1000000 / performanceCounterFrequency;
+  budget.estimatedMicroseconds = estimatedTicks * 1000000 / performanceCounterFrequency;
+  mainThreadTaskBudget = budget;
+}
+bool TaskManager::tryExecuteMainThreadTask(const TaskThreadContext& threadContext)
+{
+  Ref<TaskEvent> task;
+  if (!tryDequeueMainThreadTask(task))
   {
-    // Do possibly a little bit more work in current thread to minimize chance of waiting for worker threads.
-    ++iterationCountToDoInCurrentThread;
+    return false;
+  }
+
+  run(*task.get(), threadContext);
+  return true;
+}
+bool TaskManager::tryDequeueMainThreadTask(Ref<TaskEvent>& outTask)
+{
+  // Like workers, the main thread looks at the lowest priority lane first every starvationCheckInterval tasks.
+  if (--mainTasksUntilStarvationCheck <= 0)
+  {
+    mainTasksUntilStarvationCheck = starvationCheckInterval;
+    for (int64 lane = taskPriorityCount - 1; lane >= 0; --lane)
+    {
+      if (tryDequeueMainThreadTask(TaskPriority(lane), outTask))
+      {
+        return true;
+      }
+    }
+    return false;
   }
-  const int64 beginValueForWorkerThreads = beginValue + iterationCountToDoInCurrentThread;
-  ParallelForTaskData* taskData = nullptr;
-  if (beginValueForWorkerThreads < endValue)
+
+  for (int64 lane = 0; lane < taskPriorityCount; ++lane)
   {
-    const int64 totalThreadCount = int64(threads.size() + 1); // We assume the calling thread is not one of the worker threads.
-    taskData = new ParallelForTaskData{ beginValueForWorkerThreads, endValue, function, iterationCountToDoInCurrentThread, totalThreadCount, parallelForFinishedEvent };
-    for(size_t i = 0; i < threads.size(); ++i)
+    if (tryDequeueMainThreadTask(TaskPriority(lane), outTask))
     {
-      enqueueToWorker(&parallelForTask, taskData, Ref<TaskEvent>());
+      return true;
     }
   }
-  else
+  return false;
+}
+bool TaskManager::tryDequeueMainThreadTask(TaskPriority priority, Ref<TaskEvent>& outTask)
+{
+  // A task carried over by the budget stays at the head of its lane.
+  Ref<TaskEvent>& deferredMainTask = deferredMainTasks[int64(priority)];
+  if (deferredMainTask.isValid())
+  {
+    outTask = std::move(deferredMainTask);
+    return true;
+  }
+  return mainTaskQueues[int64(priority)].tryDequeue(outTask);
+}
+int64 TaskManager::getEstimatedCostTicks(const TaskEvent& task)
+{
+  if (task.estimatedCostMicroseconds > 0)
   {
-    SetEvent(parallelForFinishedEvent);
+    return task.estimatedCostMicroseconds * performanceCounterFrequency / 1000000;
   }
 
-  for (int64 i = beginValue; i < beginValue + iterationCountToDoInCurrentThread; ++i)
+  // Fall back to the average duration measured by the telemetry.
+  FunctionCounters& counters = findFunctionCounters(task.function);
+  const int64 executedCount = counters.executedCount.load(std::memory_order_relaxed);
+  return executedCount > 0 ? counters.startToEnd.totalTicks.load(std::memory_order_relaxed) / executedCount : 0;
+}
+bool TaskTimerWheel::tryInsert(int64 dueTick, Ref<TaskEvent>&& task)
+{
+  if (dueTick <= currentTick)
+  {
+    return false;
+  }
+
+  insert({ dueTick, std::move(task) });
+  ++entryCount;
+  return true;
+}
+void TaskTimerWheel::advance(int64 tick, std::vector<Ref<TaskEvent>>& outDueTasks)
+{
+  if (entryCount == 0)
   {
-    function(i, 0);
+    currentTick = std::max(currentTick, tick);
+    return;
   }
 
-  if (taskData)
+  std::vector<Entry> cascadedEntries;
+  while (currentTick < tick)
   {
-    const int64 iterationCountToDoInWorkerThreads = endValue - beginValueForWorkerThreads;
-    const int64 iterationsDoneInWorkerThreads = taskData->functionCallsDoneCount.load(std::memory_order_relaxed) - iterationCountToDoInCurrentThread;
-    if (iterationsDoneInWorkerThreads < iterationCountToDoInWorkerThreads)
+    ++currentTick;
+
+    // Higher levels first, their tasks may move to the slot of a lower level that is reached at this very tick.
+    int64 level = 1;
+    while (level < levelCount && (currentTick & ((int64(1) << (slotBits * level)) - 1)) == 0)
+    {
+      ++level;
+    }
+    for (--level; level > 0; --level)
     {
-      parallelForTaskInternal(*taskData, 0); // Help out with remaining iterations.
+      cascadedEntries.clear();
+      std::swap(cascadedEntries, slots[level][(currentTick >> (slotBits * level)) & (slotCount - 1)]);
+      for (Entry& entry : cascadedEntries)
+      {
+        if (entry.dueTick <= currentTick)
+        {
+          outDueTasks.emplace_back(std::move(entry.task));
+          --entryCount;
+        }
+        else
+        {
+          insert(std::move(entry));
+        }
+      }
     }
 
-    if (--taskData->threadsRemaining == 0)
+    std::vector<Entry>& dueSlot = slots[0][currentTick & (slotCount - 1)];
+    for (Entry& entry : dueSlot)
     {
-      delete taskData;
+      outDueTasks.emplace_back(std::move(entry.task));
     }
-    else
+    entryCount -= int64(dueSlot.size());
+    dueSlot.clear();
+
+    if (entryCount == 0)
     {
-      constexpr DWORD waitTimeoutMs = 1000;
-      waitResult = WaitForSingleObject(parallelForFinishedEvent, waitTimeoutMs);
-      switch (waitResult)
-      {
-        case WAIT_TIMEOUT:
-          logError("parallelForFinishedEvent timeout after %d ms.", waitTimeoutMs);
-          break;
+      currentTick = tick;
+    }
+  }
+}
+void TaskTimerWheel::insert(Entry&& entry)
+{
+  const int64 delta = std::min(entry.dueTick - currentTick, maxDelta);
+  int64 level = 0;
+  while (level < levelCount - 1 && delta >= (int64(1) << (slotBits * (level + 1))))
+  {
+    ++level;
+  }
+  slots[level][((currentTick + delta) >> (slotBits * level)) & (slotCount - 1)].emplace_back(std::move(entry));
+}
 
-        case WAIT_FAILED:
-          logError("Failed to wait on parallelForFinishedEvent.");
-          break;
+Ref<TaskEvent> TaskManager::scheduleAfter(int64 delayMicroseconds, Ref<TaskEvent>&& task)
+{
+  if (delayMicroseconds <= 0)
+  {
+    return schedule(std::move(task), nullptr, 0);
+  }
 
-        default:
-          break;
-      }
+  // Round up, the task must not run before the delay elapsed.
+  const int64 dueTicks = readPerformanceCounter() - timerStartTicks + delayMicroseconds * performanceCounterFrequency / 1000000;
+  const int64 dueTick = (dueTicks + timerTickLength - 1) / timerTickLength;
+  Ref<TaskEvent> result = task;
+  {
+    std::lock_guard<std::mutex> lock{ timersMutex };
+    if (timeTimers.tryInsert(dueTick, std::move(task)))
+    {
+      return result;
     }
   }
+  return schedule(std::move(result), nullptr, 0);
 }
-void TaskManager::processMainThreadTasks()
+Ref<TaskEvent> TaskManager::scheduleAtFrame(int64 frameIndex, Ref<TaskEvent>&& task)
+{
+  Ref<TaskEvent> result = task;
+  {
+    std::lock_guard<std::mutex> lock{ timersMutex };
+    if (frameTimers.tryInsert(frameIndex + 1, std::move(task)))
+    {
+      return result;
+    }
+  }
+  return schedule(std::move(result), nullptr, 0);
+}
+void TaskManager::advanceTimers(int64 frameIndex)
 {
   TRACE_SCOPE();
 
-  TaskThreadContext context;
-  context.index = 0;
+  const int64 nowTicks = readPerformanceCounter();
+  const int64 timeTick = (nowTicks - timerStartTicks) / timerTickLength;
 
-  Task task;
-  while (mainTaskQueue.tryDequeue(task))
+  std::vector<Ref<TaskEvent>> dueTasks;
   {
-    task.function(task.data, context);
-    if (task.completionEvent.isValid())
+    std::lock_guard<std::mutex> lock{ timersMutex };
+    timeTimers.advance(timeTick, dueTasks);
+    frameTimers.advance(frameIndex + 1, dueTasks);
+  }
+  for (Ref<TaskEvent>& task : dueTasks)
+  {
+    enqueue(task.get());
+  }
+}
+int64 TaskManager::getTimerFrameIndex()
+{
+  std::lock_guard<std::mutex> lock{ timersMutex };
+  return frameTimers.getCurrentTick() - 1;
+}
+void TaskManager::waitForCompletion(const TaskEvent& event, TaskWaitMode mode)
+{
+  TRACE_SCOPE();
+
+  Worker* worker = mode == TaskWaitMode::Help ? currentWorker : nullptr;
+  const bool helpMainThread = mode == TaskWaitMode::Help && isInMainThread();
+  HelpingWaiter* helpingWaiter = worker ? &worker->helpingWaiter : helpMainThread ? &mainThreadHelpingWaiter : nullptr;
+  const int64 workerIndex = worker ? worker - workers.get() : 0;
+  TaskThreadContext mainThreadContext;
+  mainThreadContext.index = 0;
+  mainThreadContext.scratchArena = &getThreadScratchArena();
+
+  TaskEvent* workerTask = nullptr;
+  Ref<TaskEvent> mainThreadTask;
+  const auto tryDequeueTaskToHelp = [&]()
+  {
+    return worker ? tryDequeue(*worker, workerIndex, workerTask) : helpMainThread && tryDequeueMainThreadTask(mainThreadTask);
+  };
+  const auto executeTaskToHelp = [&]()
+  {
+    if (worker)
+    {
+      execute(workerTask, threadContexts[workerIndex]);
+    }
+    else
     {
-      task.completionEvent->complete();
+      Ref<TaskEvent> task = std::move(mainThreadTask);
+      run(*task.get(), mainThreadContext);
+    }
+  };
+
+  while (!event.isComplete())
+  {
+    if (tryDequeueTaskToHelp())
+    {
+      executeTaskToHelp();
+      continue;
+    }
+
+    if (!helpingWaiter)
+    {
+      const bool isComplete = false;
+      ++event.waiterCount;
+      if (!event.isComplete())
+      {
+        TRACE_SCOPE("sleep");
+        WaitOnAddress(const_cast<std::atomic<bool>*>(&event.subsequents.isComplete), const_cast<bool*>(&isComplete), sizeof(isComplete), INFINITE);
+      }
+      --event.waiterCount;
+      continue;
+    }
+
+    // Producers and the event completion look for sleeping helpers after they publish, so check once more after announcing the sleep.
+    // The announcement is withdrawn before executing anything, the task may wait for another event on this thread.
+    const uint32 wakeCount = helpingWaiter->wakeCount.load(std::memory_order_seq_cst);
+    helpingWaiter->event.store(&event, std::memory_order_seq_cst);
+    if (worker)
+    {
+      sleepingHelpingWorkerCount.fetch_add(1, std::memory_order_seq_cst);
+    }
+    ++event.waiterCount;
+    const bool hasTaskToHelp = !event.isComplete() && tryDequeueTaskToHelp();
+    if (!hasTaskToHelp && !event.isComplete())
+    {
+      TRACE_SCOPE("sleep");
+      WaitOnAddress(&helpingWaiter->wakeCount, const_cast<uint32*>(&wakeCount), sizeof(wakeCount), INFINITE);
+    }
+    --event.waiterCount;
+    if (worker)
+    {
+      sleepingHelpingWorkerCount.fetch_sub(1, std::memory_order_relaxed);
+    }
+    helpingWaiter->event.store(nullptr, std::memory_order_relaxed);
+
+    if (hasTaskToHelp)
+    {
+      executeTaskToHelp();
+    }
+  }
+}
+void TaskManager::wakeHelpingWaiters(const TaskEvent& event)
+{
+  if (mainThreadHelpingWaiter.event.load(std::memory_order_relaxed) == &event)
+  {
+    wakeHelpingWaiter(mainThreadHelpingWaiter);
+  }
+  for (int64 workerIndex = 0; workerIndex < int64(threads.size()); ++workerIndex)
+  {
+    if (workers[workerIndex].helpingWaiter.event.load(std::memory_order_relaxed) == &event)
+    {
+      wakeHelpingWaiter(workers[workerIndex].helpingWaiter);
     }
   }
 }
@@ -592,6 +1560,14 @@ DWORD TaskManager::workerThreadMain(LPVOID parameter)
   threadType = ThreadType::Worker;
 
   TaskThreadContext& threadContext = *static_cast<TaskThreadContext*>(parameter);
+  currentWorker = &taskManager.workers[threadContext.index];
+  threadContext.scratchArena = &getThreadScratchArena();
+  currentWorker->counters.startTicks = readPerformanceCounter();
+
+  if (!currentWorker->logicalProcessorIds.empty() && !trySetCurrentThreadAffinity(currentWorker->logicalProcessorIds.data(), currentWorker->logicalProcessorIds.size()))
+  {
+    logWarning("Failed to pin worker %lld.", threadContext.index);
+  }
 
   {
     char threadName[64];
@@ -601,10 +1577,7 @@ DWORD TaskManager::workerThreadMain(LPVOID parameter)
 
   while (!taskManager.threadsShouldStop)
   {
-    {
-      TRACE_SCOPE("waitForWork");
-      WaitForSingleObject(taskManager.workerQueue.semaphore, INFINITE);
-    }
+    taskManager.waitForWork();
 
     if (taskManager.threadsShouldStop)
     {
@@ -614,36 +1587,232 @@ DWORD TaskManager::workerThreadMain(LPVOID parameter)
     taskManager.processAllTasks(threadContext);
   }
 
+  currentWorker = nullptr;
+
   return 0;
 }
 bool TaskManager::isInitialized() const
 {
-  return workerQueue.semaphore != nullptr;
+  return semaphore != nullptr;
 }
-void TaskManager::processAllTasks(const TaskThreadContext& threadContext)
+void TaskManager::waitForWork()
 {
-  while (true)
+  TRACE_SCOPE("waitForWork");
+
+  const int64 spinEndTicks = readPerformanceCounter() + spinBudgetTicks.load(std::memory_order_relaxed);
+  do
+  {
+    for (int64 i = 0; i < 64; ++i)
+    {
+      _mm_pause();
+    }
+    if (hasQueuedWorkerTasks() || threadsShouldStop)
+    {
+      return;
+    }
+  } while (readPerformanceCounter() < spinEndTicks);
+
+  for (int64 i = yieldCount.load(std::memory_order_relaxed); i > 0; --i)
   {
-    int64 taskIndexToRead = workerQueue.taskIndexToRead.load(std::memory_order::memory_order_relaxed);
+    SwitchToThread();
+    if (hasQueuedWorkerTasks() || threadsShouldStop)
+    {
+      return;
+    }
+  }
+
+  // Producers look at parkedWorkerCount after they enqueue, so check the queues once more after announcing the park.
+  parkedWorkerCount.fetch_add(1, std::memory_order_seq_cst);
+  if ((hasQueuedWorkerTasks() || threadsShouldStop) && tryUnpark())
+  {
+    return;
+  }
 
-    if (taskIndexToRead == workerQueue.cachedTaskIndexToWrite)
+  const int64 parkStartTicks = readPerformanceCounter();
+  WaitForSingleObject(semaphore, INFINITE);
+  currentWorker->counters.parkedTicks.fetch_add(readPerformanceCounter() - parkStartTicks, std::memory_order_relaxed);
+}
+bool TaskManager::hasQueuedWorkerTasks() const
+{
+  if (getGlobalQueueSize() > 0)
+  {
+    return true;
+  }
+  for (int64 workerIndex = 0; workerIndex < int64(threads.size()); ++workerIndex)
+  {
+    for (const LocalTaskQueue& localQueue : workers[workerIndex].localQueues)
     {
-      workerQueue.cachedTaskIndexToWrite = workerQueue.taskIndexToWrite.load(std::memory_order::memory_order_acquire);
-      if (taskIndexToRead == workerQueue.cachedTaskIndexToWrite)
+      if (!localQueue.isEmpty())
       {
-        return;
+        return true;
       }
     }
+  }
+  return false;
+}
+bool TaskManager::tryUnpark()
+{
+  // Fails when a producer already took the count to signal the semaphore, the caller has to consume the signal then.
+  int64 currentParkedWorkerCount = parkedWorkerCount.load(std::memory_order_relaxed);
+  while (currentParkedWorkerCount > 0)
+  {
+    if (parkedWorkerCount.compare_exchange_weak(currentParkedWorkerCount, currentParkedWorkerCount - 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+void TaskManager::wakeParkedWorkers(int64 taskCount)
+{
+  // Pairs with the fetch_add in waitForWork, either the producer sees the parked worker or the worker sees the task.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  int64 wakeCount = 0;
+  while (wakeCount < taskCount && parkedWorkerCount.load(std::memory_order_relaxed) > 0 && tryUnpark())
+  {
+    ++wakeCount;
+  }
+  if (wakeCount > 0)
+  {
+    ReleaseSemaphore(semaphore, LONG(wakeCount), NULL);
+  }
 
-    Task task = workerQueue.tasks[taskIndexToRead];
-    const int64 nextTaskIndexToRead = (taskIndexToRead + 1) % arrayLength(workerQueue.tasks);
-    if (workerQueue.taskIndexToRead.compare_exchange_strong(taskIndexToRead, nextTaskIndexToRead))
+  // Workers sleeping in waitForCompletion can execute the tasks as well.
+  for (int64 workerIndex = 0; wakeCount < taskCount && workerIndex < int64(threads.size()) && sleepingHelpingWorkerCount.load(std::memory_order_relaxed) > 0; ++workerIndex)
+  {
+    if (workers[workerIndex].helpingWaiter.event.load(std::memory_order_relaxed))
     {
-      task.function(task.data, threadContext);
-      if (task.completionEvent.isValid())
+      wakeHelpingWaiter(workers[workerIndex].helpingWaiter);
+      ++wakeCount;
+    }
+  }
+}
+void TaskManager::wakeHelpingWaiter(HelpingWaiter& waiter)
+{
+  waiter.wakeCount.fetch_add(1, std::memory_order_seq_cst);
+  WakeByAddressSingle(&waiter.wakeCount);
+}
+void TaskManager::processAllTasks(const TaskThreadContext& threadContext)
+{
+  TaskEvent* task;
+  while (true)
+  {
+    if (tryDequeue(*currentWorker, threadContext.index, task))
+    {
+      execute(task, threadContext);
+    }
+    else
+    {
+      return;
+    }
+  }
+}
+bool TaskManager::tryDequeue(Worker& worker, int64 workerIndex, TaskEvent*& outTask)
+{
+  if (--worker.tasksUntilStarvationCheck <= 0)
+  {
+    worker.tasksUntilStarvationCheck = starvationCheckInterval;
+    for (int64 lane = taskPriorityCount - 1; lane >= 0; --lane)
+    {
+      if (tryDequeue(worker, workerIndex, TaskPriority(lane), outTask))
       {
-        task.completionEvent->complete();
+        return true;
       }
     }
+    return false;
+  }
+
+  for (int64 lane = 0; lane < taskPriorityCount; ++lane)
+  {
+    if (tryDequeue(worker, workerIndex, TaskPriority(lane), outTask))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+bool TaskManager::tryDequeue(Worker& worker, int64 workerIndex, TaskPriority priority, TaskEvent*& outTask)
+{
+  return worker.localQueues[int64(priority)].tryPop(outTask) || tryDequeueFromGlobalQueue(priority, outTask) || trySteal(workerIndex, priority, outTask);
+}
+bool TaskManager::tryDequeueFromGlobalQueue(TaskPriority priority, TaskEvent*& outTask)
+{
+  if (!globalQueues[int64(priority)].tryDequeue(outTask))
+  {
+    return false;
+  }
+
+  if (blockedProducerCount.load(std::memory_order_relaxed) > 0 && getGlobalQueueSize() < queueSoftCapacity)
+  {
+    // Lock so that the notification can't slip in between the blocked producer's check and its wait.
+    std::lock_guard<std::mutex> lock{ blockedProducersMutex };
+    blockedProducersCondition.notify_all();
+  }
+
+  return true;
+}
+int64 TaskManager::getGlobalQueueSize() const
+{
+  int64 size = 0;
+  for (const SegmentedQueue<TaskEvent*, 1024>& globalQueue : globalQueues)
+  {
+    size += globalQueue.getSize();
+  }
+  return size;
+}
+bool TaskManager::trySteal(int64 thiefIndex, TaskPriority priority, TaskEvent*& outTask)
+{
+  // Start with the next worker so that thieves spread over different victims.
+  const int64 workerCount = getWorkerCount();
+  for (int64 offset = 1; offset < workerCount; ++offset)
+  {
+    const int64 victimIndex = (thiefIndex + offset) % workerCount;
+    if (workers[victimIndex].localQueues[int64(priority)].trySteal(outTask))
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+void TaskManager::execute(TaskEvent* task, const TaskThreadContext& threadContext)
+{
+  run(*task, threadContext);
+  task->unref();
+}
+void TaskManager::run(TaskEvent& task, const TaskThreadContext& threadContext)
+{
+  const TaskFunction function = task.function;
+
+  ++executionDepth;
+  const ScratchArena::Marker scratchMarker = threadContext.scratchArena->getMarker();
+  const int64 startTicks = readPerformanceCounter();
+  function(task.data, threadContext);
+  if (task.destroyPayload)
+  {
+    // Captures are released before the subsequents start.
+    const TaskPayloadDestroyFunction destroyPayload = task.destroyPayload;
+    task.destroyPayload = nullptr;
+    destroyPayload(task.data);
+  }
+  const int64 endTicks = readPerformanceCounter();
+  threadContext.scratchArena->rewind(scratchMarker);
+  --executionDepth;
+
+  task.complete();
+
+  FunctionCounters& counters = findFunctionCounters(function);
+  counters.executedCount.fetch_add(1, std::memory_order_relaxed);
+  recordLatency(counters.scheduleToStart, startTicks - task.scheduleTicks);
+  recordLatency(counters.startToEnd, endTicks - startTicks);
+
+  ThreadCounters* threadCounters = currentWorker ? &currentWorker->counters : isInMainThread() ? &mainThreadCounters : nullptr;
+  if (threadCounters)
+  {
+    threadCounters->executedTaskCount.fetch_add(1, std::memory_order_relaxed);
+    if (executionDepth == 0)
+    {
+      threadCounters->busyTicks.fetch_add(endTicks - startTicks, std::memory_order_relaxed);
+    }
   }
 }
\ No newline at end of file
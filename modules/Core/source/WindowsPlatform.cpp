@@ -121,40 +121,89 @@ Vec2i MainWindow::getCursorPosition()
   return Vec2i{ mousePosition.x, mousePosition.y };
 }
 
-void runGameLoop(std::function<void(int64 frameIndex, float timeDelta)> frameCallback)
+// Returns false when the application should quit.
+static bool pumpWindowsMessages()
 {
+  TRACE_SCOPE();
+
+  MSG message{};
+  while (PeekMessage(&message, nullptr, 0, 0, PM_REMOVE)) {
+    TranslateMessage(&message);
+    DispatchMessage(&message);
+
+    if (message.message == WM_QUIT)
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+class FrameTimer
+{
+public:
+
+  FrameTimer()
+  {
+    QueryPerformanceFrequency(&counterFrequency);
+    QueryPerformanceCounter(&lastCounterValue);
+  }
+
+  // Seconds since the previous call.
+  float tick()
+  {
+    LARGE_INTEGER currentCounterValue;
+    QueryPerformanceCounter(&currentCounterValue);
+    const float timeDelta = (float)(currentCounterValue.QuadPart - lastCounterValue.QuadPart) / counterFrequency.QuadPart;
+    lastCounterValue = currentCounterValue;
+    return timeDelta;
+  }
+
+private:
+
   LARGE_INTEGER counterFrequency;
-  QueryPerformanceFrequency(&counterFrequency);
   LARGE_INTEGER lastCounterValue;
-  QueryPerformanceCounter(&lastCounterValue);
+};
 
+void runGameLoop(std::function<void(int64 frameIndex, float timeDelta)> frameCallback)
+{
+  FrameTimer timer;
   int64 frameIndex = 0;
 
-  MSG message{};
   while (true)
   {
     TRACE_FRAME();
 
+    if (!pumpWindowsMessages())
     {
-      TRACE_SCOPE("pumpWindowsMessages");
+      return;
+    }
 
-      while (PeekMessage(&message, nullptr, 0, 0, PM_REMOVE)) {
-        TranslateMessage(&message);
-        DispatchMessage(&message);
+    const float timeDelta = timer.tick();
+    advanceTaskTimers(frameIndex);
+    frameCallback(frameIndex++, timeDelta);
+  }
+}
 
-        if (message.message == WM_QUIT)
-        {
-          return;
-        }
-      }
-    }
+void runPipelinedGameLoop(FrameStages stages, int64 framesInFlight)
+{
+  FramePipeline pipeline{ std::move(stages), framesInFlight };
+  FrameTimer timer;
 
-    LARGE_INTEGER currentCounterValue;
-    QueryPerformanceCounter(&currentCounterValue);
-    const float timeDelta = (float)(currentCounterValue.QuadPart - lastCounterValue.QuadPart) / counterFrequency.QuadPart;
-    lastCounterValue = currentCounterValue;
+  while (true)
+  {
+    TRACE_FRAME();
 
-    frameCallback(frameIndex++, timeDelta);
+    if (!pumpWindowsMessages())
+    {
+      pipeline.flush();
+      return;
+    }
+
+    const float timeDelta = timer.tick();
+    advanceTaskTimers(pipeline.getNextFrameIndex());
+    pipeline.beginFrame(timeDelta);
   }
 }
 
@@ -4,6 +4,19 @@
 #include "Core/Config.hpp"
 #include "Core/Math.hpp"
 #include "Core/String.hpp"
+#include "Core/Task.hpp"
+#include "Core/Coroutine.hpp"
+#include "Core/FramePipeline.hpp"
+#include "Core/ParallelAlgorithms.hpp"
+#include "Core/VirtualArray.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <numeric>
+#include <thread>
+#include <vector>
 
 // Memory tests ************************************************************************************
 
@@ -35,6 +48,434 @@ TEST(Memory, alignedMalloc) {
   }
 }
 
+struct alignas(32) PoolTestObject
+{
+  byte data[96];
+};
+
+TEST(Memory, ThreadSafePoolAllocatorGrows)
+{
+  ThreadSafePoolAllocator<PoolTestObject, 16> allocator;
+  EXPECT_EQ(allocator.getCapacity(), 0);
+
+  std::vector<PoolTestObject*> objects;
+  for (int i = 0; i < 40; ++i)
+  {
+    PoolTestObject* object = static_cast<PoolTestObject*>(allocator.allocate());
+    EXPECT_TRUE(isAligned(object, alignof(PoolTestObject)));
+    objects.push_back(object);
+  }
+  EXPECT_EQ(allocator.getCapacity(), 48);
+  EXPECT_EQ(allocator.getCurrentCount(), 40);
+
+  for (int i = 0; i < 30; ++i)
+  {
+    allocator.deallocate(objects.back());
+    objects.pop_back();
+  }
+  EXPECT_EQ(allocator.getCurrentCount(), 10);
+  EXPECT_GE(allocator.getPeakCount(), 40);
+
+  // Deallocated objects are reused before growing again.
+  for (int i = 0; i < 38; ++i)
+  {
+    objects.push_back(static_cast<PoolTestObject*>(allocator.allocate()));
+  }
+  EXPECT_EQ(allocator.getCapacity(), 48);
+  EXPECT_EQ(allocator.getPeakCount(), 48);
+
+  std::sort(objects.begin(), objects.end());
+  EXPECT_TRUE(std::adjacent_find(objects.begin(), objects.end()) == objects.end());
+
+  for (PoolTestObject* object : objects)
+  {
+    allocator.deallocate(object);
+  }
+  EXPECT_EQ(allocator.getCurrentCount(), 0);
+}
+
+TEST(Memory, ThreadSafePoolAllocatorContention)
+{
+  ThreadSafePoolAllocator<PoolTestObject, 64> allocator;
+
+  std::vector<std::thread> threads;
+  for (int threadIndex = 0; threadIndex < 4; ++threadIndex)
+  {
+    threads.emplace_back([&allocator, threadIndex]()
+    {
+      PoolTestObject* objects[100];
+      for (int iteration = 0; iteration < 1000; ++iteration)
+      {
+        for (PoolTestObject*& object : objects)
+        {
+          object = static_cast<PoolTestObject*>(allocator.allocate());
+          object->data[0] = byte(threadIndex);
+        }
+        for (PoolTestObject* object : objects)
+        {
+          EXPECT_EQ(object->data[0], byte(threadIndex)); // Nobody else got the same object.
+          allocator.deallocate(object);
+        }
+      }
+    });
+  }
+  for (std::thread& thread : threads)
+  {
+    thread.join();
+  }
+
+  EXPECT_EQ(allocator.getCurrentCount(), 0);
+  EXPECT_LE(allocator.getCapacity(), 4 * (100 + 2 * 32) + 64);
+}
+// Benchmark, run with --gtest_also_run_disabled_tests. Cost per operation should stay flat as threads are added.
+TEST(Memory, DISABLED_ThreadSafePoolAllocatorContentionCurve)
+{
+  constexpr int64 iterationCount = 10000;
+  constexpr int64 objectCount = 100;
+  const int64 maxThreadCount = std::max(int64(std::thread::hardware_concurrency()), int64(1));
+  for (int64 threadCount = 1; threadCount <= maxThreadCount; ++threadCount)
+  {
+    ThreadSafePoolAllocator<PoolTestObject, 64> allocator;
+    std::atomic<bool> shouldStart = false;
+    std::vector<std::thread> threads;
+    for (int64 threadIndex = 0; threadIndex < threadCount; ++threadIndex)
+    {
+      threads.emplace_back([&allocator, &shouldStart]()
+      {
+        while (!shouldStart) {}
+        PoolTestObject* objects[objectCount];
+        for (int64 iteration = 0; iteration < iterationCount; ++iteration)
+        {
+          for (PoolTestObject*& object : objects)
+          {
+            object = static_cast<PoolTestObject*>(allocator.allocate());
+          }
+          for (PoolTestObject* object : objects)
+          {
+            allocator.deallocate(object);
+          }
+        }
+      });
+    }
+
+    const auto startTime = std::chrono::steady_clock::now();
+    shouldStart = true;
+    for (std::thread& thread : threads)
+    {
+      thread.join();
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+    EXPECT_EQ(allocator.getCurrentCount(), 0);
+    // Threads run in parallel, so the wall time per thread's operation is the cost each thread sees.
+    printf("%3lld threads: %8.2f ns/operation\n", threadCount, seconds * 1e9 / double(2 * iterationCount * objectCount));
+  }
+}
+
+TEST(Memory, ScratchArena)
+{
+  ScratchArena arena{ 1024 };
+
+  const ScratchArena::Marker start = arena.getMarker();
+  byte* first = static_cast<byte*>(arena.allocate(100, 1));
+  EXPECT_TRUE(isAligned(arena.allocate(8, 64), 64));
+  // Doesn't fit the first block, another block is chained.
+  arena.allocate(1000, 1);
+  EXPECT_EQ(arena.getBlockCount(), 2);
+  // Bigger than a block.
+  arena.allocate(4096, 16);
+  EXPECT_EQ(arena.getBlockCount(), 3);
+
+  arena.rewind(start);
+  EXPECT_EQ(arena.allocate(100, 1), first);
+  arena.allocate(1000, 1);
+  arena.allocate(4096, 16);
+  EXPECT_EQ(arena.getBlockCount(), 3);
+
+  {
+    ScratchArenaScope scope{ arena };
+    ScratchArenaResource resource{ arena };
+    std::pmr::vector<int64> values{ &resource };
+    for (int64 i = 0; i < 1000; ++i)
+    {
+      values.push_back(i);
+    }
+    EXPECT_EQ(std::accumulate(values.begin(), values.end(), int64(0)), 999 * 1000 / 2);
+  }
+}
+
+TEST(Memory, FrameAllocator)
+{
+  TaskSystemInitializer taskSystemInitializer;
+
+  constexpr int64 frameCapacity = 64 * 1024;
+  FrameAllocator allocator{ 2, frameCapacity };
+
+  std::vector<int64*> allocations(1000);
+  parallelFor(0, int64(allocations.size()), [&allocator, &allocations](int64 i, int64 threadIndex)
+  {
+    allocations[i] = allocator.allocate<int64>(8);
+    std::fill_n(allocations[i], 8, i);
+  });
+  for (int64 i = 0; i < int64(allocations.size()); ++i)
+  {
+    ASSERT_NE(allocations[i], nullptr);
+    EXPECT_TRUE(isAligned(allocations[i], FrameAllocator::minAlignment));
+    EXPECT_EQ(std::count(allocations[i], allocations[i] + 8, i), 8); // Nobody else got the same memory.
+  }
+  EXPECT_TRUE(isAligned(allocator.allocate(1, 256), 256));
+  EXPECT_EQ(allocator.allocate(frameCapacity), nullptr);
+
+  // The first buffer can be reused only after the fence of the first frame retired.
+  Ref<TaskEvent> firstFrameFence = TaskEvent::create();
+  allocator.nextFrame(firstFrameFence);
+  const FrameAllocatorStats stats = allocator.getStats();
+  EXPECT_EQ(stats.overflowCount, 1);
+  EXPECT_EQ(stats.overflowedFrameCount, 1);
+  EXPECT_GE(stats.highWaterMark, 1000 * 64 + frameCapacity);
+
+  schedule([firstFrameFence](const TaskThreadContext&) mutable
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    firstFrameFence->complete();
+  }, ThreadType::Worker);
+  Ref<TaskEvent> secondFrameFence = TaskEvent::create();
+  secondFrameFence->complete();
+  allocator.nextFrame(secondFrameFence);
+  EXPECT_TRUE(firstFrameFence->isComplete());
+  EXPECT_NE(allocator.allocate(frameCapacity), nullptr);
+  EXPECT_EQ(allocator.getStats().lastFrameSize, 0);
+}
+
+TEST(Memory, engineAllocator)
+{
+  TaskSystemInitializer taskSystemInitializer;
+
+  for (int64 size : { 1, 16, 17, 128, 129, 1000, 8192, 8193, 100000 })
+  {
+    for (int64 alignment : { 16, 64, 4096, 65536 })
+    {
+      void* pointer = allocateMemory(size, MemoryTag::Untagged, alignment);
+      ASSERT_NE(pointer, nullptr);
+      EXPECT_TRUE(isAligned(pointer, alignment));
+      EXPECT_GE(getAllocationSize(pointer), size);
+      memset(pointer, 0xcd, size);
+      freeMemory(pointer);
+    }
+  }
+  freeMemory(nullptr);
+
+  // Freed small objects are reused by the same thread.
+  void* small = allocateMemory(48);
+  freeMemory(small);
+  EXPECT_EQ(allocateMemory(40), small);
+  freeMemory(small);
+
+  // Large blocks are coalesced with their free neighbours.
+  const int64 largeSize = 1024 * 1024;
+  void* large[3] = { allocateMemory(largeSize), allocateMemory(largeSize, MemoryTag::Untagged, 65536), allocateMemory(largeSize) };
+  const MemoryAllocatorStats allocatedStats = getMemoryAllocatorStats();
+  EXPECT_GE(allocatedStats.largeAllocatedSize, 3 * largeSize);
+  freeMemory(large[0]);
+  freeMemory(large[2]);
+  freeMemory(large[1]);
+  const MemoryAllocatorStats freedStats = getMemoryAllocatorStats();
+  EXPECT_EQ(freedStats.largeAllocatedSize, allocatedStats.largeAllocatedSize - 3 * largeSize);
+  EXPECT_GE(freedStats.largestLargeFreeBlockSize, 3 * largeSize);
+
+  std::vector<int64*> allocations(10000);
+  parallelFor(0, int64(allocations.size()), [&allocations](int64 i, int64 threadIndex)
+  {
+    const int64 count = 1 + i % 300;
+    allocations[i] = static_cast<int64*>(allocateMemory(count * sizeof(int64)));
+    std::fill_n(allocations[i], count, i);
+  });
+  parallelFor(0, int64(allocations.size()), [&allocations](int64 i, int64 threadIndex)
+  {
+    const int64 count = 1 + i % 300;
+    EXPECT_EQ(std::count(allocations[i], allocations[i] + count, i), count); // Nobody else got the same memory.
+    freeMemory(allocations[i]);
+  });
+}
+// Benchmark, run with --gtest_also_run_disabled_tests. Compares with the system malloc on a churning mix of small and large sizes.
+// Fragmentation is estimated as the address range spanned by the live allocations relative to their total size.
+TEST(Memory, DISABLED_engineAllocatorVersusMalloc)
+{
+  struct Allocator
+  {
+    const char* name;
+    void* (*allocate)(size_t size);
+    void (*free)(void* pointer);
+  };
+  const Allocator allocators[] = {
+    { "engine", [](size_t size) { return allocateMemory(int64(size)); }, [](void* pointer) { freeMemory(pointer); } },
+    { "malloc", [](size_t size) { return std::malloc(size); }, [](void* pointer) { std::free(pointer); } }
+  };
+
+  constexpr int64 liveCount = 20000;
+  constexpr int64 churnCount = 1000000;
+  // Mostly small sizes with an occasional large one, the same sequence for both allocators.
+  const auto getSize = [](uint32 seed)
+  {
+    const uint32 hash = seed * 2654435761u;
+    return hash % 10 == 0 ? size_t(8193 + (hash >> 8) % (64 * 1024)) : size_t(16 + (hash >> 8) % 1024);
+  };
+
+  for (const Allocator& allocator : allocators)
+  {
+    std::vector<std::pair<byte*, size_t>> allocations(liveCount);
+    const auto startTime = std::chrono::steady_clock::now();
+    for (int64 i = 0; i < liveCount; ++i)
+    {
+      const size_t size = getSize(uint32(i));
+      allocations[i] = { static_cast<byte*>(allocator.allocate(size)), size };
+    }
+    for (int64 i = 0; i < churnCount; ++i)
+    {
+      std::pair<byte*, size_t>& allocation = allocations[(uint32(i) * 2246822519u) % liveCount];
+      allocator.free(allocation.first);
+      const size_t size = getSize(uint32(liveCount + i));
+      allocation = { static_cast<byte*>(allocator.allocate(size)), size };
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+    byte* lowestAddress = allocations[0].first;
+    byte* highestAddress = allocations[0].first;
+    int64 liveSize = 0;
+    for (const std::pair<byte*, size_t>& allocation : allocations)
+    {
+      ASSERT_NE(allocation.first, nullptr);
+      lowestAddress = std::min(lowestAddress, allocation.first);
+      highestAddress = std::max(highestAddress, allocation.first + allocation.second);
+      liveSize += int64(allocation.second);
+    }
+    printf("%s: %8.2f ns/operation, live allocations span %.2fx their size\n", allocator.name, seconds * 1e9 / double(liveCount + 2 * churnCount),
+      double(highestAddress - lowestAddress) / double(liveSize));
+    if (&allocator == &allocators[0])
+    {
+      const MemoryAllocatorStats stats = getMemoryAllocatorStats();
+      printf("engine: %.2fx of the live size committed, largest free large block %lld of %lld free bytes\n", double(stats.committedSize) / double(liveSize),
+        stats.largestLargeFreeBlockSize, stats.largeFreeSize);
+    }
+
+    for (const std::pair<byte*, size_t>& allocation : allocations)
+    {
+      allocator.free(allocation.first);
+    }
+  }
+}
+
+TEST(Memory, memoryTags)
+{
+  TaskSystemInitializer taskSystemInitializer;
+
+  const MemoryTagStats before = getMemoryTagSnapshot()[MemoryTag::Config];
+  constexpr int64 largeSize = 100 * 1024;
+  void* large[10];
+  for (void*& pointer : large)
+  {
+    pointer = allocateMemory(largeSize, MemoryTag::Config);
+  }
+  const MemoryTagStats allocated = getMemoryTagSnapshot()[MemoryTag::Config];
+  EXPECT_GE(allocated.liveSize - before.liveSize, 10 * largeSize);
+  EXPECT_EQ(allocated.liveCount - before.liveCount, 10);
+  EXPECT_EQ(allocated.allocationCount - before.allocationCount, 10);
+  EXPECT_EQ(getAllocationTag(large[0]), MemoryTag::Config);
+  for (void* pointer : large)
+  {
+    freeMemory(pointer);
+  }
+
+  // Allocated and freed by different threads, counts not merged yet are part of the snapshot.
+  std::vector<void*> allocations(1000);
+  parallelFor(0, int64(allocations.size()), [&allocations](int64 i, int64 threadIndex)
+  {
+    allocations[i] = allocateMemory(32, MemoryTag::Config);
+  });
+  EXPECT_EQ(getMemoryTagSnapshot()[MemoryTag::Config].liveCount - before.liveCount, 1000);
+  parallelFor(0, int64(allocations.size()), [&allocations](int64 i, int64 threadIndex)
+  {
+    freeMemory(allocations[allocations.size() - 1 - i]);
+  });
+  void* small = allocateMemory(32, MemoryTag::Config);
+  EXPECT_EQ(getAllocationTag(small), MemoryTag::Config);
+  freeMemory(small);
+
+  // Freed by a thread local destroyed after the thread's counters were unregistered.
+  struct FreeOnThreadExit
+  {
+    ~FreeOnThreadExit() { freeMemory(pointer); }
+    void* pointer = nullptr;
+  };
+  std::thread([]()
+  {
+    thread_local FreeOnThreadExit freeOnThreadExit;
+    freeOnThreadExit.pointer = allocateMemory(32, MemoryTag::Config);
+  }).join();
+  {
+    std::vector<int64, TaggedAllocator<int64, MemoryTag::Config>> values(100);
+    EXPECT_EQ(getMemoryTagSnapshot()[MemoryTag::Config].liveCount - before.liveCount, 1);
+  }
+
+  const MemoryTagStats freed = getMemoryTagSnapshot()[MemoryTag::Config];
+  EXPECT_EQ(freed.liveSize, before.liveSize);
+  EXPECT_EQ(freed.liveCount, before.liveCount);
+  EXPECT_EQ(freed.allocationCount - before.allocationCount, 10 + 1000 + 1 + 1 + 1);
+  EXPECT_GE(freed.highWaterMark, before.liveSize + 10 * largeSize);
+  EXPECT_STREQ(toString(MemoryTag::Config), "Config");
+}
+
+TEST(Memory, VirtualArray)
+{
+  VirtualArray<std::vector<int64>> array{ 100000 };
+  EXPECT_EQ(array.getCommittedSize(), 0);
+
+  // Elements stay in place while the array grows.
+  const std::vector<int64>* firstAddress = array.tryEmplaceBack(3, 7);
+  ASSERT_NE(firstAddress, nullptr);
+  for (int64 i = 1; i < 50000; ++i)
+  {
+    ASSERT_NE(array.tryEmplaceBack(1, i), nullptr);
+  }
+  EXPECT_EQ(&array[0], firstAddress);
+  EXPECT_EQ(array[0], std::vector<int64>(3, 7));
+  EXPECT_EQ(array.getCount(), 50000);
+  EXPECT_GE(array.getCommittedSize(), 50000 * int64(sizeof(std::vector<int64>)));
+  int64 sum = 0;
+  for (const std::vector<int64>& element : array)
+  {
+    sum += element.back();
+  }
+  EXPECT_EQ(sum, int64(49999) * 50000 / 2 + 7);
+
+  // Shrinking decommits the unused pages, they are committed again on the next growth.
+  EXPECT_TRUE(array.tryResize(10));
+  array.shrinkToFit();
+  EXPECT_EQ(array.getCount(), 10);
+  EXPECT_EQ(array.getCommittedSize(), getVirtualMemoryPageSize());
+  EXPECT_TRUE(array.tryResize(20000));
+  EXPECT_TRUE(array[19999].empty());
+  EXPECT_EQ(array[9].back(), 9);
+
+  VirtualArray<std::vector<int64>> moved = std::move(array);
+  EXPECT_EQ(&moved[0], firstAddress);
+  EXPECT_EQ(moved.getCount(), 20000);
+  EXPECT_TRUE(array.isEmpty());
+  moved.clear();
+  EXPECT_TRUE(moved.isEmpty());
+
+  // Growing past maxCount fails without touching memory beyond the reservation.
+  VirtualArray<int64> full{ 3 };
+  EXPECT_TRUE(full.tryResize(3));
+  EXPECT_EQ(full.tryEmplaceBack(4), nullptr);
+  EXPECT_FALSE(full.tryResize(4));
+  EXPECT_EQ(full.getCount(), 3);
+  VirtualArray<int64> empty;
+  EXPECT_EQ(empty.tryEmplaceBack(1), nullptr);
+  EXPECT_FALSE(empty.tryResize(1));
+  EXPECT_TRUE(empty.isEmpty());
+}
+
 // Config tests ************************************************************************************
 
 TEST(Config, tryParseConfigSimpleValid)
@@ -179,4 +620,796 @@ TEST(String, getLengthUntilFirstSlash)
 
   const wchar_t* str7 = L"abc";
   EXPECT_EQ(getLengthUntilFirstSlash(str7), 3);
+}
+
+// Task tests **************************************************************************************
+
+static void busyWait(std::chrono::microseconds duration)
+{
+  const auto end = std::chrono::steady_clock::now() + duration;
+  while (std::chrono::steady_clock::now() < end) {}
+}
+
+static std::atomic<int64> finishedBackgroundTaskCount;
+static void backgroundTask(void*, const TaskThreadContext&)
+{
+  busyWait(std::chrono::milliseconds(1));
+  ++finishedBackgroundTaskCount;
+}
+static void recordStartTimeTask(void* startTime, const TaskThreadContext&)
+{
+  *static_cast<std::chrono::steady_clock::time_point*>(startTime) = std::chrono::steady_clock::now();
+}
+static void recordFinishedBackgroundTaskCountTask(void* finishedCount, const TaskThreadContext&)
+{
+  *static_cast<int64*>(finishedCount) = finishedBackgroundTaskCount;
+}
+
+TEST(Task, criticalLatencyUnderBackgroundFlood)
+{
+  TaskSystemInitializer taskSystemInitializer;
+  finishedBackgroundTaskCount = 0;
+
+  constexpr int64 backgroundTaskCount = 500;
+  std::vector<Ref<TaskEvent>> backgroundEvents;
+  for (int64 i = 0; i < backgroundTaskCount; ++i)
+  {
+    backgroundEvents.emplace_back(schedule(&backgroundTask, nullptr, ThreadType::Worker, TaskPriority::Background));
+  }
+
+  int64 finishedCountAtCriticalStart = 0;
+  const int64 finishedCountAtCriticalSchedule = finishedBackgroundTaskCount;
+  schedule(&recordFinishedBackgroundTaskCountTask, &finishedCountAtCriticalStart, ThreadType::Worker, TaskPriority::Critical)->waitForCompletion();
+
+  // Each worker finishes the background task it is executing and at most two more, one it was already dequeuing
+  // and one picked by the starvation check.
+  EXPECT_LE(finishedCountAtCriticalStart - finishedCountAtCriticalSchedule, 3 * getWorkerCount());
+
+  for (Ref<TaskEvent>& backgroundEvent : backgroundEvents)
+  {
+    backgroundEvent->waitForCompletion();
+  }
+  EXPECT_EQ(finishedBackgroundTaskCount.load(), backgroundTaskCount);
+}
+
+struct StarvationTestData
+{
+  std::atomic<bool> isBackgroundTaskFinished = false;
+  std::chrono::steady_clock::time_point deadline;
+};
+static void selfReschedulingCriticalTask(void* data, const TaskThreadContext&)
+{
+  StarvationTestData& testData = *static_cast<StarvationTestData*>(data);
+  if (!testData.isBackgroundTaskFinished && std::chrono::steady_clock::now() < testData.deadline)
+  {
+    schedule(&selfReschedulingCriticalTask, data, ThreadType::Worker, TaskPriority::Critical);
+  }
+}
+static void markBackgroundFinishedTask(void* data, const TaskThreadContext&)
+{
+  static_cast<StarvationTestData*>(data)->isBackgroundTaskFinished = true;
+}
+
+TEST(Task, backgroundIsNotStarved)
+{
+  StarvationTestData testData;
+  testData.deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+
+  TaskSystemInitializer taskSystemInitializer;
+
+  // Keep every worker busy with a never ending chain of critical tasks.
+  for (int64 i = 0; i < 64; ++i)
+  {
+    schedule(&selfReschedulingCriticalTask, &testData, ThreadType::Worker, TaskPriority::Critical);
+  }
+  schedule(&markBackgroundFinishedTask, &testData, ThreadType::Worker, TaskPriority::Background)->waitForCompletion();
+
+  EXPECT_TRUE(testData.isBackgroundTaskFinished);
+  EXPECT_LT(std::chrono::steady_clock::now(), testData.deadline);
+}
+TEST(Task, parallelForRangesCoverEveryIndexOnce)
+{
+  TaskSystemInitializer taskSystemInitializer;
+
+  for (int64 grainSize : { 1, 7, 64, 100000 })
+  {
+    std::vector<std::atomic<int32>> visitCounts(10000);
+    parallelFor(0, int64(visitCounts.size()), [&](int64 rangeBegin, int64 rangeEnd, int64 threadIndex)
+    {
+      EXPECT_LT(rangeBegin, rangeEnd);
+      EXPECT_LE(threadIndex, getWorkerCount());
+      EXPECT_TRUE(rangeEnd - rangeBegin >= grainSize || rangeEnd == int64(visitCounts.size()));
+      for (int64 i = rangeBegin; i < rangeEnd; ++i)
+      {
+        ++visitCounts[i];
+      }
+    }, grainSize);
+
+    for (const std::atomic<int32>& visitCount : visitCounts)
+    {
+      EXPECT_EQ(visitCount.load(), 1);
+    }
+  }
+}
+// Benchmark, run with --gtest_also_run_disabled_tests. Compares the per index parallelFor with the chunked one on a tiny kernel.
+TEST(Task, DISABLED_parallelForOverhead)
+{
+  TaskSystemInitializer taskSystemInitializer;
+
+  constexpr int64 iterationCount = 1 << 24;
+  std::vector<float> values(iterationCount, 2.0f); // A fixed point of the kernel.
+  const auto measure = [&values](const char* name, const auto& function)
+  {
+    const auto startTime = std::chrono::steady_clock::now();
+    function();
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    printf("%-24s %8.2f ns/iteration\n", name, seconds * 1e9 / double(values.size()));
+  };
+
+  measure("serial", [&values]()
+  {
+    for (float& value : values)
+    {
+      value = value * 0.5f + 1.0f;
+    }
+  });
+  measure("per index", [&values]()
+  {
+    parallelFor(0, int64(values.size()), [&values](int64 iterationIndex, int64 threadIndex) { values[iterationIndex] = values[iterationIndex] * 0.5f + 1.0f; });
+  });
+  for (int64 grainSize : { 1, 256, 4096, 65536 })
+  {
+    char name[32];
+    snprintf(name, sizeof(name), "chunked, grain %lld", grainSize);
+    measure(name, [&values, grainSize]()
+    {
+      parallelFor(0, int64(values.size()), [&values](int64 rangeBegin, int64 rangeEnd, int64 threadIndex)
+      {
+        for (int64 i = rangeBegin; i < rangeEnd; ++i)
+        {
+          values[i] = values[i] * 0.5f + 1.0f;
+        }
+      }, grainSize);
+    });
+  }
+
+  EXPECT_TRUE(std::all_of(values.begin(), values.end(), [](float value) { return value == 2.0f; }));
+}
+
+TEST(Task, nestedParallelFor)
+{
+  TaskSystemInitializer taskSystemInitializer;
+
+  std::atomic<int64> sum = 0;
+  parallelFor(0, 64, [&](int64 outerIndex, int64)
+  {
+    parallelFor(0, 1000, [&](int64 rangeBegin, int64 rangeEnd, int64)
+    {
+      int64 localSum = 0;
+      for (int64 i = rangeBegin; i < rangeEnd; ++i)
+      {
+        localSum += i;
+      }
+      sum += localSum;
+    }, 16);
+  });
+
+  EXPECT_EQ(sum.load(), 64 * (999 * 1000 / 2));
+}
+
+static void waitForChildTask(void* remainingDepth, const TaskThreadContext&)
+{
+  int64& depth = *static_cast<int64*>(remainingDepth);
+  if (depth > 0)
+  {
+    --depth;
+    schedule(&waitForChildTask, remainingDepth, ThreadType::Worker)->waitForCompletion();
+  }
+}
+
+TEST(Task, waitingWorkersHelpWithQueuedTasks)
+{
+  TaskSystemInitializer taskSystemInitializer;
+
+  // Much deeper than the worker count, every worker blocking on its child would deadlock.
+  int64 remainingDepth = 100;
+  schedule(&waitForChildTask, &remainingDepth, ThreadType::Worker)->waitForCompletion();
+
+  EXPECT_EQ(remainingDepth, 0);
+}
+
+static Task<int64> doubleOnWorker(int64 value)
+{
+  co_await switchTo(ThreadType::Worker);
+  EXPECT_EQ(threadType, ThreadType::Worker);
+  co_return value * 2;
+}
+static Task<int64> sumDoubledOnWorkersThenSwitchToMain()
+{
+  int64 sum = 0;
+  for (int64 i = 0; i < 10; ++i)
+  {
+    sum += co_await doubleOnWorker(i);
+  }
+
+  co_await switchTo(ThreadType::Main);
+  EXPECT_TRUE(isInMainThread());
+  co_return sum;
+}
+
+static Task<int64> sumLargeFrameOnWorker()
+{
+  int64 values[1024];
+  std::iota(std::begin(values), std::end(values), int64(0));
+  co_await switchTo(ThreadType::Worker);
+  co_return std::accumulate(std::begin(values), std::end(values), int64(0));
+}
+
+TEST(Task, coroutines)
+{
+  TaskSystemInitializer taskSystemInitializer;
+
+  // Waiting on the main thread runs main thread tasks, so the coroutine can finish there.
+  Task<int64> task = sumDoubledOnWorkersThenSwitchToMain();
+  task.getCompletionEvent()->waitForCompletion();
+
+  ASSERT_TRUE(task.isComplete());
+  EXPECT_EQ(task.getResult(), 90);
+
+  // Frames too big for the frame pools come from the engine allocator and are counted as task memory.
+  const MemoryTagStats before = getMemoryTagSnapshot()[MemoryTag::Task];
+  Task<int64> largeFrameTask = sumLargeFrameOnWorker();
+  largeFrameTask.getCompletionEvent()->waitForCompletion();
+  EXPECT_EQ(largeFrameTask.getResult(), 1023 * 1024 / 2);
+  EXPECT_GT(getMemoryTagSnapshot()[MemoryTag::Task].allocationCount, before.allocationCount);
+}
+
+TEST(Task, scheduleLambdas)
+{
+  TaskSystemInitializer taskSystemInitializer;
+
+  std::atomic<int64> sum = 0;
+  int64 small = 1;
+  Ref<TaskEvent> smallTask = schedule([&sum, small](const TaskThreadContext&) { sum += small; }, ThreadType::Worker);
+
+  // Doesn't fit inline, goes to the heap.
+  int64 big[32] = { 2 };
+  Ref<TaskEvent> bigTask = schedule([&sum, big](const TaskThreadContext&) { sum += big[0]; }, ThreadType::Worker, &smallTask, 1, TaskPriority::Critical);
+
+  std::shared_ptr<int64> owned = std::make_shared<int64>(4);
+  std::weak_ptr<int64> ownedWeak = owned;
+  schedule([&sum, owned = std::move(owned)](const TaskThreadContext&) { sum += *owned; }, ThreadType::Worker, &bigTask, 1)->waitForCompletion();
+
+  EXPECT_EQ(sum.load(), 7);
+  EXPECT_TRUE(ownedWeak.expired()); // Captures are destroyed after the task is executed.
+
+  // Lvalues are copied, the caller's function keeps its captures.
+  std::shared_ptr<int64> shared = std::make_shared<int64>(8);
+  auto addShared = [&sum, shared](const TaskThreadContext&) { sum += *shared; };
+  const auto addBig = [&sum, big](const TaskThreadContext&) { sum += big[0]; };
+  schedule(addShared, ThreadType::Worker)->waitForCompletion();
+  schedule(addBig, ThreadType::Worker)->waitForCompletion();
+  scheduleAfter(0, addShared, ThreadType::Worker)->waitForCompletion();
+  EXPECT_EQ(sum.load(), 7 + 8 + 2 + 8);
+  addShared(TaskThreadContext{});
+  EXPECT_EQ(sum.load(), 7 + 8 + 2 + 8 + 8);
+  EXPECT_EQ(shared.use_count(), 2);
+
+  // Tasks freed without running, here because their prerequisite never completes, still destroy their captures.
+  {
+    Ref<TaskEvent> neverCompleted = TaskEvent::create();
+    schedule(addShared, ThreadType::Worker, &neverCompleted, 1);
+    schedule([shared, big](const TaskThreadContext&) {}, ThreadType::Worker, &neverCompleted, 1);
+    EXPECT_EQ(shared.use_count(), 4);
+  }
+  EXPECT_EQ(shared.use_count(), 2);
+}
+
+TEST(Task, poolsGrowBeyondOneSlab)
+{
+  TaskSystemInitializer taskSystemInitializer;
+
+  std::vector<Ref<TaskEvent>> events;
+  for (int64 i = 0; i < 3000; ++i)
+  {
+    events.emplace_back(TaskEvent::create());
+  }
+
+  const TaskPoolUsage usage = getTaskPoolUsage();
+  EXPECT_GE(usage.taskEventCount, 3000);
+  EXPECT_GE(usage.taskEventPeakCount, usage.taskEventCount);
+  EXPECT_GE(usage.taskEventCapacity, usage.taskEventPeakCount);
+
+  events.clear();
+  EXPECT_LE(getTaskPoolUsage().taskEventCount, usage.taskEventCount - 3000);
+}
+TEST(Task, workerConfig)
+{
+  CpuTopology topology;
+  ASSERT_TRUE(tryDetectCpuTopology(topology));
+  EXPECT_GE(topology.coreCount, 1);
+  EXPECT_GE(int64(topology.logicalProcessors.size()), int64(topology.coreCount));
+  // Cores and cache domains are numbered densely, every one of them has a logical processor.
+  int32 lastCoreIndex = -1;
+  int32 lastCacheDomainIndex = -1;
+  for (const CpuTopology::LogicalProcessor& logicalProcessor : topology.logicalProcessors)
+  {
+    EXPECT_TRUE(logicalProcessor.coreIndex == lastCoreIndex || logicalProcessor.coreIndex == lastCoreIndex + 1);
+    EXPECT_TRUE(logicalProcessor.cacheDomainIndex == lastCacheDomainIndex || logicalProcessor.cacheDomainIndex == lastCacheDomainIndex + 1);
+    lastCoreIndex = logicalProcessor.coreIndex;
+    lastCacheDomainIndex = logicalProcessor.cacheDomainIndex;
+  }
+  EXPECT_EQ(lastCoreIndex + 1, topology.coreCount);
+  EXPECT_EQ(lastCacheDomainIndex + 1, topology.cacheDomainCount);
+
+  TaskSystemInitializer taskSystemInitializer;
+
+  setWorkerConfig({ 3, WorkerPlacement::LogicalProcessors });
+  EXPECT_EQ(getWorkerCount(), 3);
+
+  std::atomic<int64> sum = 0;
+  parallelFor(0, 1000, [&sum](int64 rangeBegin, int64 rangeEnd, int64 threadIndex) { sum += rangeEnd - rangeBegin; });
+  EXPECT_EQ(sum, 1000);
+
+  setWorkerConfig({ 2, WorkerPlacement::Unpinned });
+  EXPECT_EQ(getWorkerCount(), 2);
+  schedule([&sum](const TaskThreadContext& threadContext) { ++sum; }, ThreadType::Worker)->waitForCompletion();
+  EXPECT_EQ(sum, 1001);
+
+  setWorkerConfig({});
+}
+// Benchmark, run with --gtest_also_run_disabled_tests. Throughput should go up with the worker count.
+TEST(Task, DISABLED_throughputScaling)
+{
+  CpuTopology topology;
+  ASSERT_TRUE(tryDetectCpuTopology(topology));
+
+  TaskSystemInitializer taskSystemInitializer;
+
+  // Tasks spawned by workers go to their local queues, idle workers have to steal them.
+  constexpr int64 rootTaskCount = 64;
+  constexpr int64 childTaskCount = 1000;
+  for (int64 workerCount = 1; workerCount <= int64(topology.logicalProcessors.size()); workerCount *= 2)
+  {
+    setWorkerConfig({ workerCount, WorkerPlacement::LogicalProcessors });
+
+    std::atomic<int64> executedCount = 0;
+    const auto startTime = std::chrono::steady_clock::now();
+    std::vector<Ref<TaskEvent>> rootEvents;
+    for (int64 i = 0; i < rootTaskCount; ++i)
+    {
+      rootEvents.emplace_back(schedule([&executedCount](const TaskThreadContext& threadContext)
+      {
+        std::vector<Ref<TaskEvent>> childEvents;
+        childEvents.reserve(childTaskCount);
+        for (int64 childIndex = 0; childIndex < childTaskCount; ++childIndex)
+        {
+          childEvents.emplace_back(schedule([&executedCount](const TaskThreadContext& threadContext) { ++executedCount; }, ThreadType::Worker));
+        }
+        for (const Ref<TaskEvent>& childEvent : childEvents)
+        {
+          childEvent->waitForCompletion();
+        }
+      }, ThreadType::Worker));
+    }
+    for (const Ref<TaskEvent>& rootEvent : rootEvents)
+    {
+      rootEvent->waitForCompletion(TaskWaitMode::Block);
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+    EXPECT_EQ(executedCount, rootTaskCount * childTaskCount);
+    printf("%3lld workers: %8.2f M tasks/s\n", workerCount, double(rootTaskCount * childTaskCount) / seconds / 1e6);
+  }
+
+  setWorkerConfig({});
+}
+static void telemetryTestTask(void* taskData, const TaskThreadContext& threadContext)
+{
+  busyWait(std::chrono::microseconds(200));
+}
+TEST(Task, telemetry)
+{
+  TaskSystemInitializer taskSystemInitializer;
+  resetTaskTelemetry();
+
+  std::vector<Ref<TaskEvent>> events;
+  for (int64 i = 0; i < 20; ++i)
+  {
+    events.emplace_back(schedule(&telemetryTestTask, nullptr, ThreadType::Worker));
+  }
+  for (const Ref<TaskEvent>& event : events)
+  {
+    event->waitForCompletion(TaskWaitMode::Block);
+  }
+  const TaskTelemetry telemetry = getTaskTelemetry();
+  EXPECT_EQ(int64(telemetry.workers.size()), getWorkerCount());
+
+  int64 executedTaskCount = 0;
+  for (const TaskThreadTelemetry& worker : telemetry.workers)
+  {
+    executedTaskCount += worker.executedTaskCount;
+  }
+  EXPECT_EQ(executedTaskCount, 20);
+
+  auto functionTelemetry = std::find_if(telemetry.functions.begin(), telemetry.functions.end(), [](const TaskFunctionTelemetry& function) { return function.function == &telemetryTestTask; });
+  ASSERT_NE(functionTelemetry, telemetry.functions.end());
+  EXPECT_EQ(functionTelemetry->executedCount, 20);
+  EXPECT_GE(functionTelemetry->startToEnd.totalMicroseconds, 20 * 200);
+  EXPECT_EQ(functionTelemetry->startToEnd.counts[0], 0);
+
+  // Every task, including the parallelFor helpers, is measured from when it was queued.
+  std::atomic<int64> iterationCount = 0;
+  parallelFor(0, 1000, [&iterationCount](int64 iterationIndex, int64 threadIndex) { ++iterationCount; });
+  EXPECT_EQ(iterationCount.load(), 1000);
+  for (const TaskFunctionTelemetry& function : getTaskTelemetry().functions)
+  {
+    EXPECT_LT(function.scheduleToStart.maxMicroseconds, 1000000);
+  }
+}
+TEST(Task, workerIdleSpinBudget)
+{
+  TaskSystemInitializer taskSystemInitializer;
+
+  // Park right away, then spin for a long time, workers must pick up tasks either way.
+  for (const WorkerConfig& config : { WorkerConfig{ 0, WorkerPlacement::PhysicalCores, 0, 0 }, WorkerConfig{ 0, WorkerPlacement::PhysicalCores, 10000, 8 } })
+  {
+    setWorkerConfig(config);
+
+    std::atomic<int64> executedCount = 0;
+    for (int64 i = 0; i < 100; ++i)
+    {
+      schedule([&executedCount](const TaskThreadContext& threadContext) { ++executedCount; }, ThreadType::Worker)->waitForCompletion(TaskWaitMode::Block);
+    }
+    EXPECT_EQ(executedCount, 100);
+  }
+
+  setWorkerConfig({});
+}
+// Benchmark, run with --gtest_also_run_disabled_tests. Longer spinning should trade CPU time for wake up latency.
+TEST(Task, DISABLED_workerIdleSpinBudgetLatency)
+{
+  TaskSystemInitializer taskSystemInitializer;
+
+  // Tasks arrive with gaps, so workers run out of work between them.
+  constexpr int64 taskCount = 200;
+  constexpr auto taskGap = std::chrono::microseconds(500);
+  for (const WorkerConfig& config : { WorkerConfig{ 0, WorkerPlacement::PhysicalCores, 0, 0 }, WorkerConfig{ 0, WorkerPlacement::PhysicalCores, 0, 8 }, WorkerConfig{}, WorkerConfig{ 0, WorkerPlacement::PhysicalCores, 1000, 8 } })
+  {
+    setWorkerConfig(config);
+    resetTaskTelemetry();
+
+    std::chrono::steady_clock::duration totalLatency{};
+    for (int64 i = 0; i < taskCount; ++i)
+    {
+      std::this_thread::sleep_for(taskGap);
+      std::chrono::steady_clock::time_point startTime;
+      const auto scheduleTime = std::chrono::steady_clock::now();
+      schedule(&recordStartTimeTask, &startTime, ThreadType::Worker)->waitForCompletion(TaskWaitMode::Block);
+      totalLatency += startTime - scheduleTime;
+    }
+
+    // Idle time is spent spinning and yielding.
+    int64 idleMicroseconds = 0;
+    int64 parkedMicroseconds = 0;
+    for (const TaskThreadTelemetry& worker : getTaskTelemetry().workers)
+    {
+      idleMicroseconds += worker.idleMicroseconds;
+      parkedMicroseconds += worker.parkedMicroseconds;
+    }
+    printf("spin %5lld us, yield %lld: %8.2f us start latency, %8.2f ms worker CPU burned idle, %8.2f ms parked\n", config.spinMicroseconds, config.yieldCount,
+      std::chrono::duration<double, std::micro>(totalLatency).count() / double(taskCount), double(idleMicroseconds) / 1000.0, double(parkedMicroseconds) / 1000.0);
+  }
+
+  setWorkerConfig({});
+}
+TEST(Task, parallelAlgorithms)
+{
+  TaskSystemInitializer taskSystemInitializer;
+
+  std::vector<int64> values(100000);
+  for (int64 i = 0; i < int64(values.size()); ++i)
+  {
+    values[i] = (i * 7919) % 100003 - 50000;
+  }
+
+  EXPECT_EQ(parallelReduce(std::span(values), int64(0), std::plus<>{}, 1000), std::accumulate(values.begin(), values.end(), int64(0)));
+
+  std::vector<int64> scanned(values.size());
+  parallelInclusiveScan(values, std::span(scanned), std::plus<>{}, 1000);
+  std::vector<int64> expectedScanned(values.size());
+  std::inclusive_scan(values.begin(), values.end(), expectedScanned.begin());
+  EXPECT_EQ(scanned, expectedScanned);
+
+  std::vector<int64> expectedSorted = values;
+  std::sort(expectedSorted.begin(), expectedSorted.end());
+  std::vector<int64> radixSorted = values;
+  parallelSort(std::span(radixSorted), 1000);
+  EXPECT_EQ(radixSorted, expectedSorted);
+  std::vector<int64> mergeSorted = values;
+  parallelSort(std::span(mergeSorted), std::less<>{}, 1000);
+  EXPECT_EQ(mergeSorted, expectedSorted);
+
+  std::vector<float> floats = { 3.5f, -0.5f, 0.0f, -7.25f, 1e20f, -1e20f, 2.0f };
+  parallelSort(std::span(floats), 1);
+  EXPECT_TRUE(std::is_sorted(floats.begin(), floats.end()));
+
+  std::vector<int64> partitioned = values;
+  const int64 negativeCount = parallelPartition(std::span(partitioned), [](int64 value) { return value < 0; }, 1000);
+  std::vector<int64> expectedPartitioned = values;
+  std::stable_partition(expectedPartitioned.begin(), expectedPartitioned.end(), [](int64 value) { return value < 0; });
+  EXPECT_EQ(partitioned, expectedPartitioned);
+  EXPECT_EQ(negativeCount, std::count_if(values.begin(), values.end(), [](int64 value) { return value < 0; }));
+
+  parallelForEach(std::span(values), [](int64& value) { value *= 2; });
+  EXPECT_EQ(values[1], 2 * (7919 - 50000));
+}
+// Benchmark, run with --gtest_also_run_disabled_tests. Compares with the serial standard library algorithms.
+TEST(Task, DISABLED_parallelAlgorithmsVersusStd)
+{
+  TaskSystemInitializer taskSystemInitializer;
+
+  const auto measureMilliseconds = [](const auto& function)
+  {
+    const auto startTime = std::chrono::steady_clock::now();
+    function();
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+  };
+  for (int64 count : { 1000000, 10000000, 100000000 })
+  {
+    std::vector<int32> values(count);
+    for (int64 i = 0; i < count; ++i)
+    {
+      // Scrambled, but the same every run. Small enough for std::reduce, which may add two values before widening them.
+      values[i] = int32(uint32(i) * 2654435761u) >> 8;
+    }
+
+    int64 stdSum = 0;
+    int64 parallelSum = 0;
+    const double stdReduceMilliseconds = measureMilliseconds([&]() { stdSum = std::reduce(values.begin(), values.end(), int64(0)); });
+    const double parallelReduceMilliseconds = measureMilliseconds([&]() { parallelSum = parallelReduce(std::span(values), int64(0), std::plus<>{}); });
+    EXPECT_EQ(parallelSum, stdSum);
+
+    std::vector<int32> stdSorted = values;
+    std::vector<int32> radixSorted = values;
+    std::vector<int32> mergeSorted = values;
+    const double stdSortMilliseconds = measureMilliseconds([&]() { std::sort(stdSorted.begin(), stdSorted.end()); });
+    const double radixSortMilliseconds = measureMilliseconds([&]() { parallelSort(std::span(radixSorted)); });
+    const double mergeSortMilliseconds = measureMilliseconds([&]() { parallelSort(std::span(mergeSorted), std::less<>{}); });
+    EXPECT_EQ(radixSorted, stdSorted);
+    EXPECT_EQ(mergeSorted, stdSorted);
+
+    printf("%10lld elements: std::reduce %8.2f ms, parallelReduce %8.2f ms, std::sort %8.2f ms, parallel radix sort %8.2f ms, parallel merge sort %8.2f ms\n",
+      count, stdReduceMilliseconds, parallelReduceMilliseconds, stdSortMilliseconds, radixSortMilliseconds, mergeSortMilliseconds);
+  }
+}
+TEST(Task, scheduleBatch)
+{
+  TaskSystemInitializer taskSystemInitializer;
+
+  std::atomic<int64> sum = 0;
+  std::vector<TaskDesc> tasks;
+  for (int64 i = 0; i < 1000; ++i)
+  {
+    tasks.push_back({ [](void* taskData, const TaskThreadContext& threadContext) { *static_cast<std::atomic<int64>*>(taskData) += 1; }, &sum, ThreadType::Worker, TaskPriority(i % taskPriorityCount) });
+  }
+  tasks.push_back({ [](void* taskData, const TaskThreadContext& threadContext) { *static_cast<std::atomic<int64>*>(taskData) += 1000; }, &sum, ThreadType::Main });
+
+  Ref<TaskEvent> completionEvent = scheduleBatch(tasks);
+  completionEvent->waitForCompletion();
+  EXPECT_EQ(sum, 2000);
+
+  EXPECT_TRUE(scheduleBatch({})->isComplete());
+}
+TEST(Task, wideJoin)
+{
+  TaskSystemInitializer taskSystemInitializer;
+
+  std::atomic<int64> executedCount = 0;
+  std::vector<Ref<TaskEvent>> prerequisites;
+  for (int64 i = 0; i < 5000; ++i)
+  {
+    prerequisites.push_back(schedule([&executedCount](const TaskThreadContext& threadContext) { ++executedCount; }, ThreadType::Worker));
+  }
+
+  bool wasExecutedAfterPrerequisites = false;
+  Ref<TaskEvent> subsequent = schedule([&executedCount, &wasExecutedAfterPrerequisites](const TaskThreadContext& threadContext)
+  {
+    wasExecutedAfterPrerequisites = executedCount == 5000;
+  }, ThreadType::Worker, prerequisites.data(), int32(prerequisites.size()));
+  subsequent->waitForCompletion();
+  EXPECT_TRUE(wasExecutedAfterPrerequisites);
+
+  EXPECT_TRUE(createJoinEvent(prerequisites.data(), int64(prerequisites.size()))->isComplete());
+  EXPECT_TRUE(createJoinEvent(nullptr, 0)->isComplete());
+}
+TEST(Task, mainThreadTaskBudget)
+{
+  TaskSystemInitializer taskSystemInitializer;
+
+  // The tasks take almost no time, so what fits the budget is decided by the declared costs.
+  static int64 executedCount = 0;
+  executedCount = 0;
+  for (int64 i = 0; i < 10; ++i)
+  {
+    schedule({ [](void* taskData, const TaskThreadContext& threadContext) { ++executedCount; }, nullptr, ThreadType::Main, TaskPriority::Normal, 1000 });
+  }
+
+  // No task fits a budget smaller than its cost, but at least one is executed.
+  processMainThreadTasks(500);
+  EXPECT_EQ(executedCount, 1);
+  MainThreadTaskBudget budget = getMainThreadTaskBudget();
+  EXPECT_EQ(budget.executedTaskCount, 1);
+  EXPECT_EQ(budget.estimatedMicroseconds, 1000);
+  EXPECT_TRUE(budget.wasBudgetExhausted);
+
+  // The carried over task goes first, the rest fits a generous budget.
+  processMainThreadTasks(500);
+  EXPECT_EQ(executedCount, 2);
+  processMainThreadTasks(10000000);
+  EXPECT_EQ(executedCount, 10);
+  budget = getMainThreadTaskBudget();
+  EXPECT_EQ(budget.executedTaskCount, 8);
+  EXPECT_EQ(budget.estimatedMicroseconds, 8000);
+  EXPECT_FALSE(budget.wasBudgetExhausted);
+
+  processMainThreadTasks();
+  EXPECT_EQ(executedCount, 10);
+}
+TEST(Task, mainThreadTaskPriorities)
+{
+  TaskSystemInitializer taskSystemInitializer;
+
+  static std::vector<TaskPriority> executedPriorities;
+  executedPriorities.clear();
+  const auto scheduleMainThreadTask = [](TaskPriority priority, int32 estimatedCostMicroseconds)
+  {
+    schedule({ [](void* taskData, const TaskThreadContext& threadContext) { executedPriorities.push_back(TaskPriority(reinterpret_cast<intptr_t>(taskData))); },
+      reinterpret_cast<void*>(intptr_t(priority)), ThreadType::Main, priority, estimatedCostMicroseconds });
+  };
+
+  // A carried over task doesn't go ahead of a more important task queued since.
+  scheduleMainThreadTask(TaskPriority::Normal, 1000);
+  scheduleMainThreadTask(TaskPriority::Normal, 1000);
+  processMainThreadTasks(500);
+  scheduleMainThreadTask(TaskPriority::Critical, 1000);
+  processMainThreadTasks(500);
+  processMainThreadTasks(500);
+  EXPECT_EQ(executedPriorities, (std::vector<TaskPriority>{ TaskPriority::Normal, TaskPriority::Critical, TaskPriority::Normal }));
+
+  // Background tasks get their turn while Critical tasks keep coming.
+  executedPriorities.clear();
+  scheduleMainThreadTask(TaskPriority::Background, 0);
+  for (int64 i = 0; i < 100; ++i)
+  {
+    scheduleMainThreadTask(TaskPriority::Critical, 0);
+  }
+  processMainThreadTasks();
+  ASSERT_EQ(executedPriorities.size(), 101);
+  EXPECT_LT(std::find(executedPriorities.begin(), executedPriorities.end(), TaskPriority::Background) - executedPriorities.begin(), 32);
+}
+
+TEST(Task, framePipeline)
+{
+  TaskSystemInitializer taskSystemInitializer;
+
+  constexpr int64 framesInFlight = 3;
+  constexpr int64 frameCount = 200;
+  FrameSlots<int64> simulatedValues;
+  FrameSlots<int64> preparedValues;
+  std::atomic<int64> lastSimulatedFrame = -1;
+  std::atomic<int64> lastPreparedFrame = -1;
+  std::atomic<int64> submittedFrameCount = 0;
+  std::atomic<int64> errorCount = 0;
+
+  {
+    FramePipeline pipeline{ {
+      [&](int64 frameIndex, float timeDelta)
+      {
+        // The slot is free only once the frame framesInFlight before this one was submitted.
+        if (lastSimulatedFrame != frameIndex - 1 || submittedFrameCount < frameIndex - framesInFlight + 1)
+        {
+          ++errorCount;
+        }
+        simulatedValues[frameIndex] = frameIndex * 2;
+        lastSimulatedFrame = frameIndex;
+      },
+      [&](int64 frameIndex)
+      {
+        if (lastPreparedFrame != frameIndex - 1 || lastSimulatedFrame < frameIndex)
+        {
+          ++errorCount;
+        }
+        preparedValues[frameIndex] = simulatedValues[frameIndex] + 1;
+        lastPreparedFrame = frameIndex;
+      },
+      [&](int64 frameIndex)
+      {
+        if (!isInMainThread() || submittedFrameCount != frameIndex || preparedValues[frameIndex] != frameIndex * 2 + 1)
+        {
+          ++errorCount;
+        }
+        ++submittedFrameCount;
+      } }, framesInFlight };
+
+    for (int64 frameIndex = 0; frameIndex < frameCount; ++frameIndex)
+    {
+      pipeline.beginFrame(1.f / 60.f);
+      EXPECT_LE(pipeline.getNextFrameIndex() - pipeline.getSubmittedFrameCount(), framesInFlight - 1);
+    }
+  }
+
+  EXPECT_EQ(submittedFrameCount, frameCount);
+  EXPECT_EQ(errorCount, 0);
+}
+
+struct FrameTimerTestData
+{
+  int64 dueFrameIndex;
+  int64* currentFrameIndex;
+  int64 firedFrameIndex = -1;
+};
+static void recordFiredFrameTask(void* data, const TaskThreadContext&)
+{
+  FrameTimerTestData& testData = *static_cast<FrameTimerTestData*>(data);
+  testData.firedFrameIndex = *testData.currentFrameIndex;
+}
+TEST(Task, timers)
+{
+  TaskSystemInitializer taskSystemInitializer;
+
+  // Due frames around the boundaries of the timer wheel levels, the last one is beyond the reach of the wheel.
+  const int64 baseFrameIndex = getTaskTimerFrameIndex() + 1;
+  int64 currentFrameIndex = baseFrameIndex;
+  FrameTimerTestData testData[] = { { 0 }, { 1 }, { 63 }, { 64 }, { 65 }, { 4095 }, { 4096 }, { 4097 }, { 300000 }, { 17000000 } };
+  for (FrameTimerTestData& data : testData)
+  {
+    data.dueFrameIndex += baseFrameIndex;
+    data.currentFrameIndex = &currentFrameIndex;
+    scheduleAtFrame(data.dueFrameIndex, &recordFiredFrameTask, &data, ThreadType::Main);
+  }
+  constexpr int64 longFrameStep = 997;
+  for (; currentFrameIndex < baseFrameIndex + 17000000 + longFrameStep; currentFrameIndex += currentFrameIndex < baseFrameIndex + 5000 ? 1 : longFrameStep)
+  {
+    advanceTaskTimers(currentFrameIndex);
+    processMainThreadTasks();
+  }
+  for (const FrameTimerTestData& data : testData)
+  {
+    EXPECT_GE(data.firedFrameIndex, data.dueFrameIndex);
+    EXPECT_LT(data.firedFrameIndex, data.dueFrameIndex + (data.dueFrameIndex < baseFrameIndex + 5000 ? 1 : longFrameStep));
+  }
+
+  // Already advanced frames are due right away.
+  std::atomic<int64> executedCount = 0;
+  scheduleAtFrame(baseFrameIndex, [&executedCount](const TaskThreadContext&) { ++executedCount; }, ThreadType::Worker)->waitForCompletion();
+  scheduleAfter(0, [&executedCount](const TaskThreadContext&) { ++executedCount; }, ThreadType::Worker)->waitForCompletion();
+  EXPECT_EQ(executedCount, 2);
+
+  constexpr int64 delayMicroseconds = 20000;
+  const auto startTime = std::chrono::steady_clock::now();
+  Ref<TaskEvent> delayedTask = scheduleAfter(delayMicroseconds, [&executedCount](const TaskThreadContext&) { ++executedCount; }, ThreadType::Worker);
+  while (!delayedTask->isComplete() && std::chrono::steady_clock::now() - startTime < std::chrono::seconds(5))
+  {
+    advanceTaskTimers(currentFrameIndex++);
+    std::this_thread::yield();
+  }
+  EXPECT_TRUE(delayedTask->isComplete());
+  EXPECT_GE(std::chrono::steady_clock::now() - startTime, std::chrono::microseconds(delayMicroseconds));
+}
+
+static void recordScratchAllocationTask(void* data, const TaskThreadContext& threadContext)
+{
+  *static_cast<void**>(data) = threadContext.scratchArena->allocate(256);
+}
+TEST(Task, scratchArenaRewindsAfterTask)
+{
+  TaskSystemInitializer taskSystemInitializer;
+
+  void* allocations[2] = {};
+  schedule(&recordScratchAllocationTask, &allocations[0], ThreadType::Main);
+  schedule(&recordScratchAllocationTask, &allocations[1], ThreadType::Main);
+  processMainThreadTasks();
+  EXPECT_NE(allocations[0], nullptr);
+  EXPECT_EQ(allocations[0], allocations[1]);
 }
\ No newline at end of file
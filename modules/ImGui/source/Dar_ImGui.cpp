@@ -1,14 +1,25 @@
 #include "ImGui/ImGui.hpp"
 
 #include "Core/Core.hpp"
+#include "Core/Memory.hpp"
 
 #include <external/imgui_impl_win32.h>
 #include <external/imgui_impl_dx11.h>
 
 namespace Dar
 {
+  static void* allocateImGuiMemory(size_t size, void* userData)
+  {
+    return allocateMemory(size, MemoryTag::ImGui);
+  }
+  static void freeImGuiMemory(void* pointer, void* userData)
+  {
+    freeMemory(pointer);
+  }
+
   ImGui::ImGui(void* windowHandle, ID3D11Device* device, ID3D11DeviceContext* deviceContext)
   {
+    ::ImGui::SetAllocatorFunctions(&allocateImGuiMemory, &freeImGuiMemory);
     ::ImGui::CreateContext();
     if (!ImGui_ImplWin32_Init(windowHandle))
     {